@@ -235,40 +235,47 @@ class ParticleToFieldRhsCalculator(object):
 
 
 
+def make_pusher_field_args(maxwell_op, fields):
+    """Return a tuple (ex,ey,ez,bx,by,bz) suitable for passing to the
+    pushers, inserting ZeroVectors for components that C{maxwell_op}
+    does not carry.
+    """
+    from pyrticle._internal import ZeroVector
+
+    e, h = maxwell_op.split_eh(fields)
+
+    idx = 0
+    e_arg = []
+    for use_component in maxwell_op.get_eh_subset()[0:3]:
+        if use_component:
+            e_arg.append(e[idx])
+            idx += 1
+        else:
+            e_arg.append(ZeroVector())
+
+    idx = 0
+    b_arg = []
+    for use_component in maxwell_op.get_eh_subset()[3:6]:
+        if use_component:
+            b_arg.append(maxwell_op.mu * h[idx])
+            idx += 1
+        else:
+            b_arg.append(ZeroVector())
+
+    return tuple(e_arg) + tuple(b_arg)
+
+
+
+
 class FieldToParticleRhsCalculator(object):
     def __init__(self, method, maxwell_op):
         self.method = method
         self.maxwell_op = maxwell_op
 
     def __call__(self, t, fields_f, state_f):
-        from pyrticle._internal import ZeroVector
-
-        fields = fields_f()
         state = state_f()
 
-        e, h = self.maxwell_op.split_eh(fields)
-
-        # assemble field_args of the form [ex,ey,ez] and [bx,by,bz],
-        # inserting ZeroVectors where necessary.
-        idx = 0
-        e_arg = []
-        for use_component in self.maxwell_op.get_eh_subset()[0:3]:
-            if use_component:
-                e_arg.append(e[idx])
-                idx += 1
-            else:
-                e_arg.append(ZeroVector())
-
-        idx = 0
-        b_arg = []
-        for use_component in self.maxwell_op.get_eh_subset()[3:6]:
-            if use_component:
-                b_arg.append(self.maxwell_op.mu * h[idx])
-                idx += 1
-            else:
-                b_arg.append(ZeroVector())
-
-        field_args = tuple(e_arg) + tuple(b_arg)
+        field_args = make_pusher_field_args(self.maxwell_op, fields_f())
 
         velocities = self.method.velocities(state)
 
@@ -313,6 +320,112 @@ class ParticleRhsCalculator(object):
 
 
 
+class LeapfrogAdvancer(object):
+    """Advances fields with a hedge time stepper and particles with a
+    native leapfrog push (see L{PicMethod.boris_push}), one field step
+    per call. The initial momenta are taken to be at the same time as the
+    positions and are moved back by half a push step before the first push.
+
+    With C{subcycles} > 1, the particles take that many substeps per field
+    step. They see fields interpolated linearly in time between the start
+    and the end of the field step. The current driving the next field step
+    is then the average of the currents deposited after each substep.
+
+    With C{supercycles} > 1, the particles take one step, as long as that
+    many field steps, at the start of each cycle. The current held fixed
+    over the cycle is then the average of the currents before and after
+    the push.
+
+    This does not build on hedge's TwoRateAdamsBashforthTimeStepper,
+    which is what provides different particle and field rates when
+    particles are advanced along with the fields through their
+    right-hand side. That stepper extrapolates from a history of
+    right-hand sides for each component. The leapfrog push updates 
+    positions and momenta in place instead and has no right-hand side 
+    to keep a history of.
+    """
+
+    def __init__(self, method, maxwell_op, field_stepper, f_rhs_calculator,
+            dt, use_vay=False, subcycles=1, supercycles=1):
+        if subcycles < 1 or supercycles < 1:
+            raise ValueError, "sub- and supercycle counts must be positive"
+        if subcycles > 1 and supercycles > 1:
+            raise ValueError, "cannot sub- and supercycle at the same time"
+
+        self.method = method
+        self.maxwell_op = maxwell_op
+        self.field_stepper = field_stepper
+        self.f_rhs_calculator = f_rhs_calculator
+        self.dt = dt
+        self.use_vay = use_vay
+        self.subcycles = subcycles
+        self.supercycles = supercycles
+
+        self.j = None
+        self.field_step_count = 0
+        self.momenta_lag = False
+
+    def _field_rhs(self, state):
+        state_f = lambda: state
+
+        def rhs(t, fields):
+            return (self.f_rhs_calculator(t, lambda: fields, state_f)
+                    + self.maxwell_op.assemble_fields(
+                        e=-1/self.maxwell_op.epsilon*self.j))
+
+        return rhs
+
+    def _push(self, state, fields, dt):
+        if not self.momenta_lag:
+            # momenta start out at the same time as the positions--move
+            # them back by half a step, as the leapfrog push expects
+            self.method.boris_push(state, self.maxwell_op, fields, -dt/2,
+                    self.use_vay, momenta_only=True)
+            self.momenta_lag = True
+
+        self.method.boris_push(state, self.maxwell_op, fields, dt, self.use_vay)
+
+    def __call__(self, y, t):
+        fields, ts_state = y
+        state = ts_state.state
+
+        if self.supercycles > 1:
+            if self.field_step_count % self.supercycles == 0:
+                j_before = self.method.deposit_j(state)
+                self._push(state, fields, self.supercycles*self.dt)
+                self.j = (j_before + self.method.deposit_j(state))/2
+
+            new_fields = self.field_stepper(fields, t, self.dt,
+                    self._field_rhs(state))
+        else:
+            if self.j is None:
+                self.j = self.method.deposit_j(state)
+
+            new_fields = self.field_stepper(fields, t, self.dt,
+                    self._field_rhs(state))
+
+            sub_dt = self.dt/self.subcycles
+            j_sum = 0
+            for substep in range(self.subcycles):
+                theta = substep/self.subcycles
+                if theta == 0:
+                    sub_fields = fields
+                else:
+                    sub_fields = (1-theta)*fields + theta*new_fields
+
+                self._push(state, sub_fields, sub_dt)
+                j_sum = j_sum + self.method.deposit_j(state)
+
+            self.j = j_sum/self.subcycles
+
+        self.field_step_count += 1
+
+        from hedge.tools import make_obj_array
+        return make_obj_array([new_fields, ts_state])
+
+
+
+
 class PicMethod(object):
     """
     @arg debug: A set of strings telling what to debug. So far, the
@@ -578,19 +691,62 @@ class PicMethod(object):
         from pyrticle._internal import FindEventCounters
         find_counters = FindEventCounters()
 
-        class BHitListener(_internal.BoundaryHitListener):
-            def note_boundary_hit(subself, pn):
-                _internal.kill_particle(
-                        new_state.particle_state,
-                        pn, new_state.particle_number_shift_signaller)
-
         from pyrticle._internal import update_containing_elements
         sub_timer = self.find_el_timer.start_sub_timer()
         update_containing_elements(
                 self.mesh_data, new_state.particle_state,
-                BHitListener(), find_counters)
+                self._make_boundary_hit_listener(new_state), find_counters)
         sub_timer.stop().submit()
 
+        self._transfer_find_counters(find_counters)
+
+        return new_state
+
+    def boris_push(self, state, maxwell_op, fields, dt, use_vay=False,
+            momenta_only=False):
+        """Advance the particles in C{state} by one relativistic leapfrog
+        step of length C{dt}, in place, using the Boris (or, if C{use_vay}
+        is set, the Vay) scheme with the fields C{fields}.
+
+        Momenta are understood to lag positions by half a step. Unlike
+        L{advance_state}, this needs only one field gather per step.
+
+        If C{momenta_only} is set, positions are left alone. Calling this
+        with C{-dt/2} sets up the half-step lag for momenta that are given
+        at the same time as the positions.
+        """
+        field_args = make_pusher_field_args(maxwell_op, fields)
+        e, b = self.pusher.particle_fields(
+                state, self.velocities(state), *field_args)
+
+        if momenta_only:
+            from pyrticle._internal import boris_momentum_push
+            boris_momentum_push(state.particle_state,
+                    e, b, dt, self.units.VACUUM_LIGHT_SPEED(), use_vay)
+        else:
+            from pyrticle._internal import FindEventCounters, boris_push
+            find_counters = FindEventCounters()
+
+            sub_timer = self.find_el_timer.start_sub_timer()
+            boris_push(self.mesh_data, state.particle_state,
+                    e, b, dt, self.units.VACUUM_LIGHT_SPEED(), use_vay,
+                    self._make_boundary_hit_listener(state), find_counters)
+            sub_timer.stop().submit()
+
+            self._transfer_find_counters(find_counters)
+
+        state.derived_quantity_cache.clear()
+
+    def _make_boundary_hit_listener(self, state):
+        class BHitListener(_internal.BoundaryHitListener):
+            def note_boundary_hit(subself, pn):
+                _internal.kill_particle(
+                        state.particle_state,
+                        pn, state.particle_number_shift_signaller)
+
+        return BHitListener()
+
+    def _transfer_find_counters(self, find_counters):
         self.find_same_counter.transfer(
                 find_counters.find_same)
         self.find_by_neighbor_counter.transfer(
@@ -600,8 +756,6 @@ class PicMethod(object):
         self.find_global_counter.transfer(
                 find_counters.find_global)
 
-        return new_state
-
     # visualization -----------------------------------------------------------
     def get_mesh_vis_vars(self):
         return self.vis_listener.mesh_vis_map.items()
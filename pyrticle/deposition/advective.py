@@ -47,12 +47,17 @@ class AdvectiveDepositor(Depositor):
     def __init__(self, activation_threshold=1e-5, kill_threshold=1e-3,
             filter_amp=None, filter_order=None,
             upwind_alpha=1,
+            thread_count=1,
             ):
         Depositor.__init__(self)
 
+        if thread_count < 1:
+            raise ValueError, "thread_count must be at least 1"
+
         self.activation_threshold = activation_threshold
         self.kill_threshold = kill_threshold
         self.upwind_alpha = upwind_alpha
+        self.thread_count = thread_count
 
         self.shape_function = None
 
@@ -101,6 +106,7 @@ class AdvectiveDepositor(Depositor):
                 self.activation_threshold,
                 self.kill_threshold,
                 self.upwind_alpha)
+        self.backend.thread_count = self.thread_count
 
         for i, diffmat in enumerate(ldis.differentiation_matrices()):
             self.backend.add_local_diff_matrix(i, diffmat)
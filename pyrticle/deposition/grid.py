@@ -41,6 +41,10 @@ class GridDepositor(Depositor, GridVisualizer):
             filter_min_amplification=None,
             filter_order=None,
             jiggle_radius=0.0,
+            thread_count=1,
+            sparse_remap=False,
+            cache_dir=None,
+            fft_convolution=False,
             ):
         Depositor.__init__(self)
         self.brick_generator = brick_generator
@@ -54,6 +58,14 @@ class GridDepositor(Depositor, GridVisualizer):
 
         self.jiggle_radius = jiggle_radius
 
+        if thread_count < 1:
+            raise ValueError, "thread_count must be at least 1"
+        self.thread_count = thread_count
+        self.sparse_remap = sparse_remap
+        self.cache_dir = cache_dir
+        self.fft_convolution = fft_convolution
+        self.convolution_kernel_ffts = None
+
     @property
     def name(self):
         if self.jiggle_radius:
@@ -72,6 +84,8 @@ class GridDepositor(Depositor, GridVisualizer):
         Depositor.initialize(self, method)
 
         if self.jiggle_radius:
+            if self.fft_convolution:
+                raise ValueError, "fft_convolution requires regular bricks"
             dep_type = "Jiggly"
         else:
             dep_type = "Regular"
@@ -79,14 +93,10 @@ class GridDepositor(Depositor, GridVisualizer):
         backend_class = getattr(_internal, 
                 dep_type + "GridDepositor" + method.get_dimensionality_suffix())
         backend = self.backend = backend_class(method.mesh_data)
+        backend.thread_count = self.thread_count
 
         discr = method.discretization
 
-        if self.enforce_continuity:
-            self.prepare_average_groups()
-        else:
-            backend.average_group_starts.append(0)
-
         if self.filter_min_amplification is not None:
             from hedge.discretization import Filter, ExponentialFilterResponseFunction
             self.filter = Filter(discr, ExponentialFilterResponseFunction(
@@ -94,31 +104,120 @@ class GridDepositor(Depositor, GridVisualizer):
         else:
             self.filter = None
 
-        for i, (stepwidths, origin, dims) in enumerate(
-                self.brick_generator(discr)):
-            if self.jiggle_radius:
-                brk = _internal.JigglyBrick(i, backend.grid_node_count_with_extra(), 
-                        stepwidths, origin, dims,
-                        jiggle_radius=self.jiggle_radius)
+        brick_params = list(self.brick_generator(discr))
+
+        for i, (stepwidths, origin, dims) in enumerate(brick_params):
+            self.append_brick(stepwidths, origin, dims)
+
+        self.adaptive_bricks = hasattr(self.brick_generator, "fine_bricks")
+        if self.adaptive_bricks and self.submethod == "brick":
+            raise ValueError, "adaptive bricks require a pointwise submethod"
+        self.fine_brick_params = []
+        self.upkeep_count = 0
+
+        if self.cache_dir is not None:
+            import os
+            cache_key = self.preparation_cache_key(brick_params)
+            cache_file = os.path.join(self.cache_dir, 
+                    "rec-grid-%s.dat" % cache_key)
+            from_cache = backend.read_preparation_cache(cache_file, cache_key)
+        else:
+            from_cache = False
+
+        if from_cache:
+            print "rec_grid: loaded preparation from %s" % cache_file
+            if self.adaptive_bricks:
+                # needed to re-prepare elements when rebricking
+                self.prepare_local_discretizations()
+            self.generate_point_statistics(sum(
+                len(eog.grid_nodes) - info.original_point_count
+                for eog, info in zip(
+                    backend.elements_on_grid, backend.preparation_info)))
+        else:
+            if self.enforce_continuity:
+                self.prepare_average_groups()
+            else:
+                backend.average_group_starts.append(0)
+
+            if self.submethod in ["simplex_extra", "simplex_enlarge", "simplex_reduce"]:
+                self.prepare_with_pointwise_projection()
+            elif self.submethod == "brick":
+                self.prepare_with_brick_interpolation()
             else:
-                brk = _internal.Brick(i, backend.grid_node_count_with_extra(), 
-                        stepwidths, origin, dims)
-            backend.bricks.append(brk)
-
-        if self.submethod == "simplex_extra":
-            self.prepare_with_pointwise_projection_and_extra_points()
-        elif self.submethod == "simplex_enlarge":
-            self.prepare_with_pointwise_projection_and_enlargement()
-        elif self.submethod == "simplex_reduce":
-            self.prepare_with_pointwise_projection_and_basis_reduction()
-        elif self.submethod == "brick":
-            self.prepare_with_brick_interpolation()
+                raise RuntimeError, "invalid rec_grid submethod specified"
+
+            if self.cache_dir is not None:
+                self.write_preparation_cache(cache_file, cache_key)
+
+        backend.prepare_remap()
+        if self.sparse_remap:
+            backend.assemble_remap_operator()
+
+    def append_brick(self, stepwidths, origin, dims):
+        backend = self.backend
+        number = len(backend.bricks)
+
+        if self.jiggle_radius:
+            brk = _internal.JigglyBrick(number, backend.grid_node_count(), 
+                    stepwidths, origin, dims,
+                    jiggle_radius=self.jiggle_radius)
         else:
-            raise RuntimeError, "invalid rec_grid submethod specified"
+            brk = _internal.Brick(number, backend.grid_node_count(), 
+                    stepwidths, origin, dims)
+        backend.bricks.append(brk)
 
     def set_shape_function(self, state, sf):
         Depositor.set_shape_function(self, state, sf)
         self.backend.shape_function = sf
+        self.convolution_kernel_ffts = None
+
+    def upkeep(self, state):
+        Depositor.upkeep(self, state)
+
+        if (self.adaptive_bricks and self.shape_function is not None
+                and self.upkeep_count % self.brick_generator.rebrick_interval == 0):
+            self.rebrick(state)
+        self.upkeep_count += 1
+
+    def rebrick(self, state):
+        """Replace the fine bricks by ones fitting the current particle
+        positions, and bring the grid preparation up to date with them.
+        The background brick stays, and so do the elements only it 
+        reaches.
+        """
+        fine_brick_params = self.brick_generator.fine_bricks(
+                state.positions, self.shape_function.radius)
+
+        def same_params(params_a, params_b):
+            return len(params_a) == len(params_b) and all(
+                    all((numpy.asarray(x) == numpy.asarray(y)).all() 
+                        for x, y in zip(a, b))
+                    for a, b in zip(params_a, params_b))
+
+        if same_params(fine_brick_params, self.fine_brick_params):
+            return
+
+        backend = self.backend
+        del backend.bricks[1:]
+        for stepwidths, origin, dims in fine_brick_params:
+            self.append_brick(stepwidths, origin, dims)
+        self.fine_brick_params = fine_brick_params
+
+        changed_count = backend.update_elements_on_grid(self.submethod,
+                self.el_tolerance, self.max_extra_points)
+        print "rec_grid: rebricked, %d fine bricks, %d elements updated" % (
+                len(fine_brick_params), changed_count)
+
+        backend.prepare_remap()
+        if self.sparse_remap:
+            backend.assemble_remap_operator()
+
+        # drop everything that depends on the bricks
+        self.convolution_kernel_ffts = None
+        try:
+            del self.grid_nodes_t
+        except AttributeError:
+            pass
 
     def add_instrumentation(self, mgr, observer):
         Depositor.add_instrumentation(self, mgr, observer)
@@ -127,6 +226,8 @@ class GridDepositor(Depositor, GridVisualizer):
         mgr.set_constant("rec_grid_enforce_continuity", self.enforce_continuity)
         mgr.set_constant("rec_grid_method", self.submethod)
         mgr.set_constant("rec_grid_jiggle_radius", self.jiggle_radius)
+        mgr.set_constant("rec_grid_sparse_remap", self.sparse_remap)
+        mgr.set_constant("rec_grid_fft_convolution", self.fft_convolution)
 
         self.brick_generator.log_data(mgr)
 
@@ -134,11 +235,57 @@ class GridDepositor(Depositor, GridVisualizer):
 
 
     # preparation helpers -----------------------------------------------------
-    def find_containing_brick(self, pt):
-        for brk in self.backend.bricks:
-            if brk.bounding_box().contains(pt):
-                return brk
-        raise RuntimeError, "no containing brick found for point"
+    def preparation_cache_key(self, brick_params):
+        """Return a hash of everything the preparation depends upon:
+        the mesh and its discretization, the bricks and the
+        preparation parameters.
+        """
+        import hashlib
+        key = hashlib.sha1()
+
+        def add(*args):
+            for arg in args:
+                if isinstance(arg, numpy.ndarray):
+                    key.update(str((arg.dtype.str, arg.shape)))
+                    key.update(numpy.ascontiguousarray(arg).tostring())
+                else:
+                    key.update(repr(arg))
+
+        discr = self.method.discretization
+        mesh = discr.mesh
+
+        add(numpy.asarray(mesh.points, dtype=numpy.float64))
+        add(numpy.array([el.vertex_indices for el in mesh.elements], 
+            dtype=numpy.int32))
+        add(numpy.asarray(discr.nodes, dtype=numpy.float64))
+        for eg in discr.element_groups:
+            add(eg.local_discretization.order, len(eg.members))
+
+        for stepwidths, origin, dims in brick_params:
+            add(numpy.asarray(stepwidths, dtype=numpy.float64),
+                    numpy.asarray(origin, dtype=numpy.float64),
+                    numpy.asarray(dims, dtype=numpy.int32))
+
+        add(self.jiggle_radius, self.submethod, self.el_tolerance,
+                self.max_extra_points, self.enforce_continuity,
+                self.filter_min_amplification, self.filter_order)
+
+        return key.hexdigest()
+
+    def write_preparation_cache(self, cache_file, cache_key):
+        import os
+        cache_dir = os.path.dirname(cache_file)
+        try:
+            os.makedirs(cache_dir)
+        except OSError:
+            if not os.path.isdir(cache_dir):
+                raise
+
+        # write to a temporary file and rename, so that concurrent 
+        # runs never see partially written cache files
+        temp_file = "%s.%d.tmp" % (cache_file, os.getpid())
+        self.backend.write_preparation_cache(temp_file, cache_key)
+        os.rename(temp_file, cache_file)
 
     def prepare_average_groups(self):
         discr = self.method.discretization
@@ -182,96 +329,6 @@ class GridDepositor(Depositor, GridVisualizer):
 
         print len(avg_groups), "average groups"
 
-    def find_points_in_element(self, el, el_tolerance):
-        from pyrticle._internal import ElementOnGrid
-        eog = ElementOnGrid()
-        eog.element_number = el.id
-
-        points = self.backend.find_points_in_element(
-                eog, el_tolerance * la.norm(el.map.matrix, 2))
-        
-        return eog, list(points)
-
-    def scaled_vandermonde(self, el, eog, points, basis):
-        """The remapping procedure in rec_grid relies on a pseudoinverse
-        minimizing the pointwise error on all found interpolation points.
-        But if an element spans bricks with different resolution, the 
-        high-res points get an unfair advantage, because there's so many
-        more of them. Therefore, each point is weighted by its 
-        corresponding cell volume, meaning that the corresponding row of
-        the structured Vandermonde matrix must be scaled by this volume, 
-        as computed by L{find_points_in_element}. This routine returns the
-        scaled Vandermonde matrix.
-        """
-
-        from hedge.polynomial import generic_vandermonde
-        vdm = generic_vandermonde(
-                [el.inverse_map(x) for x in points], 
-                basis)
-
-        for i, weight in enumerate(eog.weight_factors):
-            vdm[i] *= weight
-
-        return vdm
-
-    def make_pointwise_interpolation_matrix(self, eog, eg, el, ldis, svd, scaled_vdm,
-            basis_subset=None):
-        u, s, vt = svd
-
-        point_count = u.shape[0]
-        node_count = vt.shape[1]
-
-        thresh = (numpy.finfo(float).eps * max(s.shape) * s[0])
-
-        nonzero_flags = numpy.abs(s) >= thresh
-        inv_s = numpy.zeros((len(s),), dtype=float)
-        inv_s[nonzero_flags] = 1/s[nonzero_flags]
-
-        if not nonzero_flags.all():
-            from warnings import warn
-            warn("grid dep: taking pseudoinverse of poorly conditioned matrix--"
-                    "this should have been caught earlier")
-
-        # compute the pseudoinverse of the structured Vandermonde matrix
-        inv_s_diag = numpy.zeros(
-                (node_count, point_count), 
-                dtype=float)
-        inv_s_diag[:len(s),:len(s)] = numpy.diag(inv_s)
-
-        svdm_pinv = numpy.dot(numpy.dot(vt.T, inv_s_diag), u.T)
-
-        # check that it's reasonable
-        pinv_resid = la.norm(
-            numpy.dot(svdm_pinv, scaled_vdm)
-            - numpy.eye(node_count))
-
-        if pinv_resid > 1e-8:
-            from warnings import warn
-            warn("rec_grid: bad pseudoinv precision, element=%d, "
-                    "#nodes=%d, #sgridpts=%d, resid=%.5g centroid=%s"
-                % (el.id, node_count, point_count, pinv_resid,
-                        el.centroid(self.method.discretization.mesh.points)))
-
-        el_vdm = ldis.vandermonde()
-        if basis_subset is not None:
-            el_vdm = el_vdm[:,basis_subset]
-        imat = numpy.dot(el_vdm, svdm_pinv)
-
-        if self.filter is not None:
-            imat = numpy.dot(self.filter.get_filter_matrix(eg), imat)
-
-        assert not numpy.isnan(imat).any(), \
-                "encountered NaN in element %d's interpolation matrix" % el.id
-        assert not numpy.isinf(imat).any(), \
-                "encountered infinity in element %d's interpolation matrix" % el.id
-
-        eog.interpolation_matrix = numpy.asarray(imat, order="F")
-
-        if basis_subset is None:
-            from hedge.tools import leftsolve
-            eog.inverse_interpolation_matrix = numpy.asarray(
-                    leftsolve(el_vdm, scaled_vdm), order="F")
-
     def generate_point_statistics(self, cond_claims=0):
         discr = self.method.discretization
 
@@ -312,346 +369,104 @@ class GridDepositor(Depositor, GridVisualizer):
 
 
     # preparation methods -----------------------------------------------------
-    def prepare_with_pointwise_projection_and_extra_points(self):
+    def prepare_local_discretizations(self):
+        """Give the backend the per-element-group data that the pointwise
+        projection needs to (re-)prepare elements.
+        """
         discr = self.method.discretization
         backend = self.backend
 
-        backend.elements_on_grid.reserve(
-                sum(len(eg.members) for eg in discr.element_groups))
-
-        # map brick numbers to [ (point, el_id, el_structured_point_index),...]
-        # This is used to write out the C++ extra_points structure further
-        # down.
-        ep_brick_map = {}
+        from hedge.polynomial import generic_vandermonde
+        from pyrticle._internal import MonomialBasisFunction, \
+                LocalMonomialDiscretization, GridLocalDiscretization
 
-        min_s_values = []
+        ldis_indices = [None] * sum(
+                len(eg.members) for eg in discr.element_groups)
 
-        # Iterate over all elements
-        for eg in discr.element_groups:
+        for i, eg in enumerate(discr.element_groups):
             ldis = eg.local_discretization
 
-            for el in eg.members:
-                eog, points = self.find_points_in_element(el, self.el_tolerance)
-
-                # If the structured Vandermonde matrix is singular,
-                # add "extra points" to prevent that.
-                ep_count = 0
-                while True:
-                    scaled_vdm = self.scaled_vandermonde(el, eog, points, 
-                            ldis.basis_functions())
-
-                    u, s, vt = svd = la.svd(scaled_vdm)
-
-                    if len(points) >= ldis.node_count():
-                        # case 1: theoretically enough points found
-                        thresh = (numpy.finfo(float).eps
-                                * max(scaled_vdm.shape) * s[0])
-                        zero_indices = [i for i, si in enumerate(s)
-                            if abs(si) < thresh]
-                    else:
-                        zero_indices = range(vt.shape[0]-len(s), vt.shape[0])
-                        assert zero_indices
-
-                    if not zero_indices:
-                        break
-
-                    ep_count += 1
-                    if ep_count > self.max_extra_points:
-                        from warnings import warn
-                        warn("rec_grid: could not regularize structured "
-                                "vandermonde matrix for el #%d with #ep bound" % el.id)
-                        break
-
-                    # Getting here means that a mode
-                    # maps to zero on the structured grid.
-                    # Find it.
-
-                    # mode linear combination available for zeroed 
-                    # mode: use it
-                    zeroed_mode = vt[zero_indices[0]]
-                    zeroed_mode_nodal = numpy.dot(ldis.vandermonde(), 
-                            zeroed_mode)
-
-                    # Then, find the point in that mode with
-                    # the highest absolute value.
-                    from pytools import argmax
-                    max_node_idx = argmax(abs(xi) for xi in zeroed_mode_nodal)
-                    new_point = discr.nodes[
-                            discr.find_el_range(el.id).start
-                            +max_node_idx]
-
-                    ep_brick_map.setdefault(
-                            self.find_containing_brick(new_point).number,
-                            []).append(
-                                    (new_point, el.id, len(points)))
-
-                    points.append(new_point)
-
-                    # the final grid_node_number at which this point
-                    # will end up is as yet unknown. insert a
-                    # placeholder
-                    eog.grid_nodes.append(0)
-
-                if ep_count:
-                    print "element %d #nodes=%d sgridpt=%d, extra=%d" % (
-                            el.id, ldis.node_count(), len(points), ep_count)
-                min_s_values.append(min(s))
-
-                self.make_pointwise_interpolation_matrix(eog, eg, el, ldis, svd, scaled_vdm)
-
-                backend.elements_on_grid.append(eog)
-
-        # fill in the extra points
-        ep_brick_starts = [0]
-        extra_points = []
-        
-        gnc = backend.grid_node_count_with_extra()
-        for brk in backend.bricks:
-            for pt, el_id, struc_idx in ep_brick_map.get(brk.number, []):
-                # replace zero placeholder from above
-                backend.elements_on_grid[el_id].grid_nodes[struc_idx] = \
-                        gnc + len(extra_points)
-                extra_points.append(pt)
-
-            ep_brick_starts.append(len(extra_points))
-
-        backend.first_extra_point = gnc
-        backend.extra_point_brick_starts.extend(ep_brick_starts)
-        backend.extra_points = numpy.array(extra_points)
-
-        # print some statistics
-        self.generate_point_statistics(len(extra_points))
-
-
-
+            lmd = LocalMonomialDiscretization()
+            lmd.basis.extend([MonomialBasisFunction(*idx)
+                for idx in ldis.node_tuples()])
 
-    def prepare_with_pointwise_projection_and_enlargement(self):
-        tolerance_bound = 1.5
+            mon_vdm_t = generic_vandermonde(ldis.unit_nodes(), lmd.basis).T
+            lmd.inverse_vandermonde_t = numpy.asarray(
+                    la.inv(mon_vdm_t), order="F")
 
-        discr = self.method.discretization
-        backend = self.backend
-
-        backend.elements_on_grid.reserve(
-                sum(len(eg.members) for eg in discr.element_groups))
-
-        cond_claims = 0
-        min_s_values = []
-        max_s_values = []
-        cond_s_values = []
-
-        from hedge.discretization import Projector, Discretization
-        fine_discr = Discretization(discr.mesh, order=8)
-        proj = Projector(discr, fine_discr)
-
-        from hedge.visualization import SiloVisualizer
-        vis = SiloVisualizer(fine_discr)
-
-        # Iterate over all elements
-        for eg in discr.element_groups:
-            ldis = eg.local_discretization
+            gld = GridLocalDiscretization()
+            gld.monomials = lmd
+            gld.vandermonde = numpy.asarray(ldis.vandermonde(), order="C")
+            gld.mode_degrees.extend(
+                    sum(mid) for mid in ldis.generate_mode_identifiers())
+            if self.filter is not None:
+                gld.filter_matrix = numpy.asarray(
+                        self.filter.get_filter_matrix(eg), order="C")
+            backend.local_discretizations.append(gld)
 
             for el in eg.members:
-                # If the structured Vandermonde matrix is singular,
-                # enlarge the element tolerance
-
-                my_tolerance = self.el_tolerance
-
-                orig_point_count = None
-
-                while True:
-                    eog, points = self.find_points_in_element(el, my_tolerance)
-                    if orig_point_count is None:
-                        orig_point_count = len(points)
-
-                    scaled_vdm = self.scaled_vandermonde(el, eog, points, 
-                            ldis.basis_functions())
-
-                    bad_vdm = len(points) < ldis.node_count()
-                    if not bad_vdm:
-                        try:
-                            u, s, vt = svd = la.svd(scaled_vdm)
-                            thresh = (numpy.finfo(float).eps
-                                    * max(scaled_vdm.shape) * s[0])
-                            zero_indices = [i for i, si in enumerate(s)
-                                if abs(si) < thresh]
-                            bad_vdm = bool(zero_indices)
-                        except la.LinAlgError:
-                            bad_vdm = True
-
-                    if not bad_vdm:
-                        break
-
-                    my_tolerance += 0.03
-                    if my_tolerance >= tolerance_bound:
-                        from warnings import warn
-                        warn("rec_grid: could not regularize structured "
-                                "vandermonde matrix for el #%d by enlargement" % el.id)
-                        break
-
-                #from pytools import average
-                #print average(eog.weight_factors), min(s)
-                #raw_input()
-
-                if my_tolerance > self.el_tolerance:
-                    print "element %d: #nodes=%d, orig #sgridpt=%d, extra tol=%g, #extra points=%d" % (
-                            el.id, ldis.node_count(), orig_point_count, 
-                            my_tolerance-self.el_tolerance,
-                            len(points)-orig_point_count)
-                    cond_claims += len(points)-orig_point_count
-                min_s_values.append(min(s))
-                max_s_values.append(max(s))
-                cond_s_values.append(max(s)/min(s))
-
-                if max(s)/min(s) > 1e2:
-                    for i in range(len(s)):
-                        if s[0]/s[i] > 1e2:
-                            zeroed_mode = vt[i]
-                            zeroed_mode_nodal = numpy.dot(ldis.vandermonde(), 
-                                    zeroed_mode)
-                            print el.id, i, s[0]/s[i]
-                            fromvec = discr.volume_zeros()
-                            fromvec[discr.find_el_range(el.id)] = zeroed_mode_nodal
-
-                            gn = list(eog.grid_nodes)
-                            assert len(gn) == len(u[i])
-
-                            tovec = numpy.zeros((backend.grid_node_count_with_extra(),), dtype=float)
-                            tovec[gn] = s[i]*u[i]
-
-                            usevec = numpy.zeros((backend.grid_node_count_with_extra(),), dtype=float)
-                            usevec[gn] = 1
-
-                            visf = vis.make_file("nulled-%04d%02d" % (el.id, i))
-                            vis.add_data(visf, [("meshmode", proj(fromvec))],
-                                    expressions=[
-                                    ("absmesh", "abs(meshmode)"),
-                                    ("absgrid", "abs(gridmode)"),
-                                    ])
-                            self.visualize_grid_quantities(visf, [
-                                    ("gridmode", tovec),
-                                    ("usevec", usevec),
-                                    ],
-                                    )
-                            visf.close()
-                    #print s
-                    #raw_input()
-
-                self.make_pointwise_interpolation_matrix(eog, eg, el, ldis, svd, scaled_vdm)
-
-                backend.elements_on_grid.append(eog)
-
-        # we don't need no stinkin' extra points
-        backend.extra_point_brick_starts.extend([0]*(len(backend.bricks)+1))
-
-        # print some statistics
-        self.generate_point_statistics(cond_claims)
+                ldis_indices[el.id] = i
 
+        backend.ldis_indices.extend(ldis_indices)
 
+    def prepare_with_pointwise_projection(self):
+        """Find the structured points in each element and build the
+        pointwise least-squares interpolation matrices from them. If the
+        structured Vandermonde matrix of an element is singular, it is
+        regularized according to L{submethod}:
 
+        - C{simplex_extra} adds "extra points" at element nodes,
+        - C{simplex_enlarge} enlarges the element tolerance,
+        - C{simplex_reduce} removes badly resolved modes.
 
-    def prepare_with_pointwise_projection_and_basis_reduction(self):
+        The work is done by the backend, in parallel over elements.
+        """
         discr = self.method.discretization
         backend = self.backend
 
-        backend.elements_on_grid.reserve(
-                sum(len(eg.members) for eg in discr.element_groups))
-
-        min_s_values = []
-        max_s_values = []
-        cond_s_values = []
-
-        basis_len_vec = discr.volume_zeros()
-        el_condition_vec = discr.volume_zeros()
-        point_count_vec = discr.volume_zeros()
-
-        # Iterate over all elements
-        for eg in discr.element_groups:
-            ldis = eg.local_discretization
-
-            mode_id_to_index = dict(
-                    (bid, i) for i, bid in enumerate(ldis.generate_mode_identifiers()))
-
-            for el in eg.members:
-                basis = list(zip(
-                    ldis.generate_mode_identifiers(), 
-                    ldis.basis_functions()))
-
-                eog, points = self.find_points_in_element(el, self.el_tolerance)
-
-                while True:
-                    scaled_vdm = self.scaled_vandermonde(el, eog, points, 
-                            [bf for bid, bf in basis])
-
-                    max_bid_sum = max(sum(bid) for bid, bf in basis)
-                    killable_basis_elements = [
-                            (i, bid) for i, (bid, bf) in enumerate(basis)
-                            if sum(bid) == max_bid_sum]
-
-                    try:
-                        u, s, vt = svd = la.svd(scaled_vdm)
-
-                        thresh = (numpy.finfo(float).eps
-                                * max(scaled_vdm.shape) * s[0])
-
-                        assert s[-1] == numpy.min(s)
-                        assert s[0] == numpy.max(s)
-                        
-                        # Imagine that--s can have negative entries.
-                        # (AK: I encountered one negative zero.)
-
-                        if len(basis) > len(points) or numpy.abs(s[0]/s[-1]) > 10:
-                            retry = True
-
-                            # badly conditioned, kill a basis entry
-                            vti = vt[-1]
-
-                            from pytools import argmax2
-                            kill_idx, kill_bid = argmax2(
-                                    ((j, bid), abs(vti[j])) 
-                                    for j, bid in killable_basis_elements)
-
-                            assert kill_bid == basis[kill_idx][0]
-                            basis.pop(kill_idx)
-                        else:
-                            retry = False
-
-                    except la.LinAlgError:
-                        # SVD likely didn't converge. Lacking an SVD, we don't have 
-                        # much guidance on what modes to kill. Any of the killable
-                        # ones will do.
-
-                        # Bang, you're dead.
-                        basis.pop(killable_basis_elements[0][0])
-
-                        retry = True
-
-                    if not retry:
-                        break
-
-                    if len(basis) == 1:
-                        raise RuntimeError(
-                                "basis reduction has killed almost the entire basis on element %d"
-                                % el.id)
-
-                if ldis.node_count() > len(basis):
-                    print "element %d: #nodes=%d, killed modes=%d" % (
-                            el.id, ldis.node_count(), ldis.node_count()-len(basis),)
+        self.prepare_local_discretizations()
+        backend.prepare_elements_on_grid(self.submethod,
+                self.el_tolerance, self.max_extra_points)
 
-                basis_len_vec[discr.find_el_range(el.id)] = len(basis)
-                el_condition_vec[discr.find_el_range(el.id)] = s[0]/s[-1]
-                point_count_vec[discr.find_el_range(el.id)] = len(points)
+        # report on regularization
+        from warnings import warn
 
-                min_s_values.append(min(s))
-                max_s_values.append(max(s))
-                cond_s_values.append(max(s)/min(s))
+        cond_claims = 0
+        for eog, info in zip(backend.elements_on_grid, backend.preparation_info):
+            node_count = len(eog.interpolation_matrix)
+            extra_claims = len(eog.grid_nodes) - info.original_point_count
+            cond_claims += extra_claims
+
+            if extra_claims:
+                print "element %d: #nodes=%d, orig #sgridpt=%d, #extra points=%d" % (
+                        eog.element_number, node_count, 
+                        info.original_point_count, extra_claims)
+            if info.mode_count < node_count:
+                print "element %d: #nodes=%d, killed modes=%d" % (
+                        eog.element_number, node_count, 
+                        node_count-info.mode_count)
+
+            if not info.regularized:
+                warn("rec_grid: could not regularize structured "
+                        "vandermonde matrix for el #%d" % eog.element_number)
+            if info.pinv_residual > 1e-8:
+                warn("rec_grid: bad pseudoinv precision, element=%d, "
+                        "#nodes=%d, #sgridpts=%d, resid=%.5g"
+                    % (eog.element_number, node_count, 
+                        len(eog.grid_nodes), info.pinv_residual))
 
-                self.make_pointwise_interpolation_matrix(eog, eg, el, ldis, svd, scaled_vdm,
-                        basis_subset=[mode_id_to_index[bid] for bid, bf in basis])
+        # visualize basis length for each element
+        if set(["depositor", "vis_files"]) <= self.method.debug:
+            basis_len_vec = discr.volume_zeros()
+            el_condition_vec = discr.volume_zeros()
+            point_count_vec = discr.volume_zeros()
 
-                backend.elements_on_grid.append(eog)
+            for eog, info in zip(backend.elements_on_grid, backend.preparation_info):
+                el_range = discr.find_el_range(eog.element_number)
+                basis_len_vec[el_range] = info.mode_count
+                el_condition_vec[el_range] = info.condition
+                point_count_vec[el_range] = len(eog.grid_nodes)
 
-        # visualize basis length for each element
-        if set(["depositor", "vis_files"]) < self.method.debug:
             from hedge.visualization import SiloVisualizer
             vis = SiloVisualizer(discr)
             visf = vis.make_file("rec-debug")
@@ -662,11 +477,8 @@ class GridDepositor(Depositor, GridVisualizer):
                 ])
             visf.close()
 
-        # we don't need no stinkin' extra points
-        backend.extra_point_brick_starts.extend([0]*(len(backend.bricks)+1))
-
         # print some statistics
-        self.generate_point_statistics()
+        self.generate_point_statistics(cond_claims)
 
 
 
@@ -790,59 +602,164 @@ class GridDepositor(Depositor, GridVisualizer):
         eff_shape = q_grid.shape[1:]
         if len(eff_shape) == 0:
             result = discr.volume_zeros()
-            self.backend.remap_grid_to_mesh(
-                    q_grid, result, 0, 1)
+            self.backend.remap_grid_to_mesh(q_grid, result, 1)
         elif len(eff_shape) == 1:
             result = numpy.zeros((len(discr),)+eff_shape, dtype=float)
-            for i in range(eff_shape[0]):
-                self.backend.remap_grid_to_mesh(
-                        q_grid, result, i, eff_shape[0])
+            self.backend.remap_grid_to_mesh(q_grid, result, eff_shape[0])
         else:
             raise ValueError, "invalid effective shape for remap"
         return result
 
-    def _deposit_densites(self, state, velocities, pslice):
-        return tuple(
-                self.remap_grid_to_mesh(q_grid) 
-                for q_grid in self.deposit_grid_densities(
-                    state, velocities, pslice))
+    def _deposit_densities(self, state, velocities, pslice):
+        if not self.fft_convolution:
+            # tile-sparse deposition and remap in the backend
+            return self.backend.deposit_densities(
+                    state.depositor_state, state.particle_state,
+                    velocities, pslice)
+
+        rho_grid, j_grid = self.deposit_grid_densities(
+                state, velocities, pslice)
+
+        # remap rho and j in one go
+        rho_j = self.remap_grid_to_mesh(
+                numpy.column_stack((rho_grid, j_grid)))
+        return rho_j[:, 0].copy(), rho_j[:, 1:].copy()
 
     def _deposit_j(self, state, velocities, pslice):
+        if not self.fft_convolution:
+            return self.backend.deposit_j(
+                    state.depositor_state, state.particle_state,
+                    velocities, pslice)
+
         grid_j = self.deposit_grid_j(state, velocities, pslice)
 
         return self.remap_grid_to_mesh(grid_j)
 
     def _deposit_rho(self, state, pslice):
+        if not self.fft_convolution:
+            return self.backend.deposit_rho(
+                    state.depositor_state, state.particle_state,
+                    pslice)
+
         return self.remap_grid_to_mesh(
                 self.deposit_grid_rho(state, pslice))
 
     # deposition onto grid ------------------------------------------------
     def deposit_grid_densities(self, state, velocities, pslice=slice(None)):
         self.deposit_hook()
+
+        if self.fft_convolution:
+            def compute():
+                rho_padded, j_padded = self.backend.deposit_padded_grid_densities(
+                        state.particle_state, velocities, pslice)
+                return (self.convolve_padded_grid(rho_padded),
+                        self.convolve_padded_grid(j_padded))
+        else:
+            def compute():
+                return self.backend.deposit_grid_densities(
+                    state.depositor_state, state.particle_state, 
+                    velocities, pslice)
+
         return state.get_derived_quantities_from_cache(
                 [("rho_grid", pslice.start, pslice.stop, pslice.step),
                     ("j_grid", pslice.start, pslice.stop, pslice.step)],
-                [lambda: self.deposit_grid_rho(pslice), 
+                [lambda: self.deposit_grid_rho(state, pslice), 
                     lambda: self.deposit_grid_j(state, velocities, pslice)],
-                lambda: self.backend.deposit_grid_densities(
-                    state.depositor_state, state.particle_state, 
-                    velocities, pslice))
+                compute)
 
     def deposit_grid_j(self, state, velocities, pslice=slice(None)):
         self.deposit_hook()
+
+        if self.fft_convolution:
+            def compute():
+                return self.convolve_padded_grid(
+                        self.backend.deposit_padded_grid_j(
+                            state.particle_state, velocities, pslice))
+        else:
+            def compute():
+                return self.backend.deposit_grid_j(
+                    state.depositor_state, state.particle_state, 
+                    velocities, pslice)
+
         return state.get_derived_quantity_from_cache(
                 ("j_grid", pslice.start, pslice.stop, pslice.step), 
-                lambda: self.backend.deposit_grid_j(
-                    state.depositor_state, state.particle_state, 
-                    velocities, pslice))
+                compute)
 
     def deposit_grid_rho(self, state, pslice=slice(None)):
         self.deposit_hook()
+
+        if self.fft_convolution:
+            def compute():
+                return self.convolve_padded_grid(
+                        self.backend.deposit_padded_grid_rho(
+                            state.particle_state, pslice))
+        else:
+            def compute():
+                return self.backend.deposit_grid_rho(
+                    state.depositor_state, state.particle_state, 
+                    pslice)
+
         return state.get_derived_quantity_from_cache(
                 ("rho_grid", pslice.start, pslice.stop, pslice.step), 
-                lambda: self.backend.deposit_grid_rho(
-                    state.depositor_state, state.particle_state, 
-                    pslice))
+                compute)
+
+    # deposition by convolution -----------------------------------------------
+    def padded_brick_dimensions(self, brk):
+        padding = self.backend.convolution_padding(brk.number)
+        return tuple(int(n) + 2*padding for n in brk.dimensions)
+
+    def get_convolution_kernel_ffts(self):
+        if self.convolution_kernel_ffts is None:
+            self.convolution_kernel_ffts = [
+                    numpy.fft.rfftn(numpy.reshape(
+                        self.backend.convolution_kernel(brk.number),
+                        self.padded_brick_dimensions(brk), order="F"))
+                    for brk in self.backend.bricks]
+
+        return self.convolution_kernel_ffts
+
+    def convolve_padded_grid(self, q_padded):
+        """Convolve the cloud-in-cell deposited C{q_padded} with the 
+        shape function, brick by brick, and sample the result onto the 
+        grid, including extra points.
+
+        Since the bricks are padded by the shape function's reach, the
+        circular convolution done by the FFT does not wrap around onto 
+        the part of the brick that is kept.
+        """
+        backend = self.backend
+
+        eff_shape = q_padded.shape[1:]
+        if len(eff_shape) == 0:
+            components = 1
+        elif len(eff_shape) == 1:
+            components = eff_shape[0]
+        else:
+            raise ValueError, "invalid effective shape for convolution"
+
+        q_padded = q_padded.reshape((len(q_padded), components))
+        result_padded = numpy.empty_like(q_padded)
+
+        start = 0
+        for brk, kernel_fft in zip(
+                backend.bricks, self.get_convolution_kernel_ffts()):
+            pdims = self.padded_brick_dimensions(brk)
+            stop = start + numpy.prod(pdims)
+
+            for i in xrange(components):
+                brk_q = numpy.reshape(q_padded[start:stop, i], pdims, order="F")
+                brk_result = numpy.fft.irfftn(
+                        numpy.fft.rfftn(brk_q) * kernel_fft, pdims)
+                result_padded[start:stop, i] = numpy.reshape(
+                        brk_result, (stop-start,), order="F")
+
+            start = stop
+
+        result = numpy.zeros(
+                (backend.grid_node_count_with_extra(),) + eff_shape, 
+                dtype=float)
+        backend.sample_padded_grid(result_padded, result, components)
+        return result
 
     # grid debug quantities ---------------------------------------------------
     def ones_on_grid(self):
@@ -865,13 +782,10 @@ class GridDepositor(Depositor, GridVisualizer):
         eff_shape = q_grid.shape[1:]
         if len(eff_shape) == 0:
             result = numpy.zeros((gnc,), dtype=float)
-            self.backend.remap_residual(
-                    q_grid, result, 0, 1)
+            self.backend.remap_residual(q_grid, result, 1)
         elif len(eff_shape) == 1:
             result = numpy.zeros((gnc,)+eff_shape, dtype=float)
-            for i in range(eff_shape[0]):
-                self.backend.remap_residual(
-                        q_grid, result, i, eff_shape[0])
+            self.backend.remap_residual(q_grid, result, eff_shape[0])
         else:
             raise ValueError, "invalid effective shape for remap"
         return result
@@ -151,6 +151,159 @@ class FineCoreBrickGenerator(object):
 
 
 
+class ParticleAdaptiveBrickGenerator(object):
+    """Generates a coarse background brick covering the mesh, and, given
+    particle positions, fine bricks covering just the regions where the
+    particles are. 
+
+    Fine bricks are aligned with the background brick's cells and
+    subdivide them C{coarsening} times along each axis. Their resolution
+    is that of L{SingleBrickGenerator} with the same C{overresolve}.
+    Background cells holding at least C{min_particles} particles are 
+    covered, along with a margin of C{margin_cells} background cells
+    plus the reach of the shape function.
+
+    A depositor using this generator calls L{fine_bricks} every
+    C{rebrick_interval} timesteps.
+    """
+
+    def __init__(self, overresolve=1.5, mesh_margin=0, coarsening=4,
+            min_particles=1, margin_cells=1, rebrick_interval=10):
+        self.overresolve = overresolve
+        self.mesh_margin = mesh_margin
+        self.coarsening = coarsening
+        self.min_particles = min_particles
+        self.margin_cells = margin_cells
+        self.rebrick_interval = rebrick_interval
+
+        assert isinstance(coarsening, int)
+
+    def log_data(self, mgr):
+        mgr.set_constant("rec_grid_brick_gen", self.__class__.__name__)
+        mgr.set_constant("rec_grid_overresolve", self.overresolve)
+        mgr.set_constant("rec_grid_mesh_margin", self.mesh_margin)
+        mgr.set_constant("rec_grid_coarsening", self.coarsening)
+        mgr.set_constant("rec_grid_rebrick_interval", self.rebrick_interval)
+
+    def __call__(self, discr):
+        from hedge.discretization import ones_on_volume
+        mesh_volume = discr.integral(ones_on_volume(discr))
+        dx =  (mesh_volume / len(discr)/ self.overresolve)**(1/discr.dimensions)
+        dx *= self.coarsening
+
+        mesh = discr.mesh
+        bbox_min, bbox_max = mesh.bounding_box()
+
+        bbox_min -= self.mesh_margin
+        bbox_max += self.mesh_margin
+
+        bbox_size = bbox_max-bbox_min
+        dims = numpy.maximum(1, numpy.asarray(bbox_size/dx, dtype=numpy.int32))
+        stepwidths = bbox_size/dims
+
+        self.background = stepwidths, bbox_min, dims
+        yield stepwidths, bbox_min, dims
+
+    def fine_bricks(self, positions, shape_radius):
+        """Return a list of (stepwidths, origin, dims) for the fine 
+        bricks covering C{positions}, an array of shape (particles, 
+        dimensions).
+        """
+        stepwidths, origin, dims = self.background
+        d = len(dims)
+
+        # count particles per background cell
+        cells = numpy.floor((positions-origin)/stepwidths).astype(numpy.int32)
+        inside = numpy.all((cells >= 0) & (cells < dims), axis=1)
+        cells = cells[inside]
+
+        occupied = numpy.zeros((numpy.prod(dims),), dtype=bool)
+        if len(cells):
+            strides = numpy.cumprod([1]+list(dims[:-1]))
+            counts = numpy.bincount(numpy.dot(cells, strides))
+            occupied[:len(counts)] = counts >= self.min_particles
+        occupied = numpy.reshape(occupied, dims, order="F")
+
+        # grow by the margin
+        margin = self.margin_cells + int(numpy.ceil(
+            shape_radius/numpy.min(stepwidths)))
+        for axis in range(d):
+            grown = occupied.copy()
+            for shift in range(1, margin+1):
+                lower = [slice(None)]*d
+                upper = [slice(None)]*d
+                lower[axis] = slice(None, -shift)
+                upper[axis] = slice(shift, None)
+                grown[tuple(lower)] |= occupied[tuple(upper)]
+                grown[tuple(upper)] |= occupied[tuple(lower)]
+            occupied = grown
+
+        fine_stepwidths = stepwidths/self.coarsening
+        return [(fine_stepwidths, 
+            origin + numpy.array(lower)*stepwidths,
+            (numpy.array(upper)-numpy.array(lower))*self.coarsening)
+            for lower, upper in occupied_boxes(occupied)]
+
+
+
+
+def occupied_boxes(occupied):
+    """Return a list of non-overlapping index boxes (lower, upper) 
+    covering the C{True} entries of the boolean array C{occupied}: 
+    the bounding boxes of its connected components, merged where they
+    overlap.
+    """
+    d = len(occupied.shape)
+    seen = numpy.zeros(occupied.shape, dtype=bool)
+    boxes = []
+
+    for start in zip(*numpy.nonzero(occupied)):
+        if seen[start]:
+            continue
+
+        seen[start] = True
+        lower = list(start)
+        upper = [i+1 for i in start]
+        todo = [start]
+        while todo:
+            idx = todo.pop()
+            for axis in range(d):
+                for step in [-1, 1]:
+                    nb = list(idx)
+                    nb[axis] += step
+                    nb = tuple(nb)
+                    if (0 <= nb[axis] < occupied.shape[axis] 
+                            and occupied[nb] and not seen[nb]):
+                        seen[nb] = True
+                        todo.append(nb)
+                        lower[axis] = min(lower[axis], nb[axis])
+                        upper[axis] = max(upper[axis], nb[axis]+1)
+
+        boxes.append((lower, upper))
+
+    def overlap(a, b):
+        return all(a[0][i] < b[1][i] and b[0][i] < a[1][i] for i in range(d))
+
+    merged = True
+    while merged:
+        merged = False
+        for i in range(len(boxes)):
+            for j in range(i+1, len(boxes)):
+                if overlap(boxes[i], boxes[j]):
+                    a, b = boxes[i], boxes[j]
+                    boxes[i] = ([min(a[0][k], b[0][k]) for k in range(d)],
+                            [max(a[1][k], b[1][k]) for k in range(d)])
+                    del boxes[j]
+                    merged = True
+                    break
+            if merged:
+                break
+
+    return boxes
+
+
+
+
 # grid visualization ----------------------------------------------------------
 class GridVisualizer(object):
     def visualize_grid_quantities(self, silo, names_and_quantities):
@@ -35,21 +35,24 @@ class GridFindDepositor(Depositor, GridVisualizer):
     name = "GridFind"
     iterator_type = _internal.BrickIterator
 
-    def __init__(self, brick_generator=None):
+    def __init__(self, brick_generator=None, thread_count=1):
         Depositor.__init__(self)
         self.brick_generator = brick_generator
 
+        if thread_count < 1:
+            raise ValueError, "thread_count must be at least 1"
+        self.thread_count = thread_count
+
     def initialize(self, method):
         Depositor.initialize(self, method)
 
         backend_class = getattr(_internal, "GridFindDepositor" 
                 + method.get_dimensionality_suffix())
         backend = self.backend = backend_class(method.mesh_data)
+        backend.thread_count = self.thread_count
 
         discr = method.discretization
 
-        grid_node_num_to_nodes = {}
-
         if self.brick_generator is None:
             bbox_min, bbox_max = discr.mesh.bounding_box()
             max_bbox_size = max(bbox_max-bbox_min)
@@ -63,47 +66,12 @@ class GridFindDepositor(Depositor, GridVisualizer):
             backend.bricks.append(
                     Brick(i, backend.grid_node_count(), stepwidths, origin, dims))
 
-        from pyrticle._internal import BoxFloat
-        for eg in discr.element_groups:
-            ldis = eg.local_discretization
-
-            for el in eg.members:
-                el_bbox = BoxFloat(*el.bounding_box(discr.mesh.points))
-                el_slice = discr.find_el_range(el.id)
-
-                for brk in backend.bricks:
-                    if brk.bounding_box().intersect(el_bbox).is_empty():
-                        continue
-
-                    for node_num in range(el_slice.start, el_slice.stop):
-                        try:
-                            cell_number = brk.which_cell(
-                                        discr.nodes[node_num])
-                        except ValueError:
-                            pass
-                        else:
-                            grid_node_num_to_nodes.setdefault(
-                                    brk.index(cell_number), []).append(node_num)
-
-        from pytools import flatten
-        unassigned_nodes = (set(xrange(len(discr))) 
-                - set(flatten(grid_node_num_to_nodes.itervalues())))
-
-        if unassigned_nodes:
-            raise RuntimeError("dep_grid_find: unassigned mesh nodes found. "
-                    "you should specify a mesh_margin when generating "
-                    "bricks")
-
-        usecounts = numpy.zeros(
-                (backend.grid_node_count(),))
-        for gnn in xrange(backend.grid_node_count()):
-            grid_nodes = grid_node_num_to_nodes.get(gnn, [])
-            usecounts[gnn] = len(grid_nodes)
-            backend.node_number_list_starts.append(len(backend.node_number_lists))
-            backend.node_number_lists.extend(grid_nodes)
-        backend.node_number_list_starts.append(len(backend.node_number_lists))
+        backend.bin_mesh_nodes()
 
         if "depositor" in method.debug:
+            usecounts = numpy.diff(numpy.array(
+                backend.node_number_list_starts, dtype=numpy.float64))
+
             from hedge.visualization import SiloVisualizer
             vis = SiloVisualizer(discr)
             visf = vis.make_file("grid-find-debug")
@@ -107,6 +107,9 @@ class PICCPyUserInterface(pytools.CPyUserInterface):
 
                 "timestepper_maker": lambda dt: LSRK4TimeStepper(),
                 "dt_scale": 1,
+                "particle_integrator": None,
+                "particle_subcycles": 1,
+                "particle_supercycles": 1,
                 }
 
         doc = {
@@ -117,6 +120,10 @@ class PICCPyUserInterface(pytools.CPyUserInterface):
                 "max_volume_outer": "max. tet volume in outer mesh [m^3]",
                 "shape_bandwidth": "either 'optimize', 'guess' or a positive real number",
                 "phi_filter": "a tuple (min_amp, order) or None, describing the filtering applied to phi in hypclean mode",
+                "particle_integrator": "None to advance particles along with the fields using timestepper_maker, "
+                    "or 'boris' or 'vay' for a native leapfrog particle push",
+                "particle_subcycles": "number of particle steps per field step (native particle_integrator only)",
+                "particle_supercycles": "number of field steps per particle step (native particle_integrator only)",
                 }
 
         pytools.CPyUserInterface.__init__(self, variables, constants, doc)
@@ -384,7 +391,34 @@ class PICRunner(object):
             sub_timer.stop().submit()
 
         from hedge.timestep.multirate_ab import TwoRateAdamsBashforthTimeStepper 
-        if not isinstance(self.stepper, TwoRateAdamsBashforthTimeStepper): 
+        if setup.particle_integrator is not None:
+            if setup.particle_integrator not in ["boris", "vay"]:
+                raise ValueError, "invalid particle integrator '%s'" % (
+                        setup.particle_integrator)
+            if isinstance(self.stepper, TwoRateAdamsBashforthTimeStepper):
+                # the native push has no right-hand side for the 
+                # multirate stepper to extrapolate
+                raise ValueError, "native particle integrators cannot " \
+                        "be combined with multirate timestepping--use " \
+                        "particle_subcycles or particle_supercycles"
+
+            from pyrticle.deposition.advective import AdvectiveDepositor
+            if isinstance(self.method.depositor, AdvectiveDepositor):
+                raise ValueError, "native particle integrators cannot " \
+                        "be combined with advective deposition"
+
+            from pyrticle.cloud import LeapfrogAdvancer
+            advance = LeapfrogAdvancer(self.method, self.maxwell_op,
+                    self.stepper, self.f_rhs_calculator, self.dt,
+                    use_vay=setup.particle_integrator == "vay",
+                    subcycles=setup.particle_subcycles,
+                    supercycles=setup.particle_supercycles)
+        elif setup.particle_subcycles != 1 or setup.particle_supercycles != 1:
+            raise ValueError, "particle sub- and supercycling require a " \
+                    "native particle_integrator--for different particle " \
+                    "and field rates with a combined timestepper, use " \
+                    "TwoRateAdamsBashforthTimeStepper"
+        elif not isinstance(self.stepper, TwoRateAdamsBashforthTimeStepper): 
             def rhs(t, fields_and_state):
                 fields, ts_state = fields_and_state
                 state_f = lambda: ts_state.state
@@ -412,6 +446,10 @@ class PICRunner(object):
                     add_unwrap(self.p_rhs_calculator),
                     ),)
 
+        if setup.particle_integrator is None:
+            def advance(y, t):
+                return self.stepper(y, t, *step_args)
+
         y = make_obj_array([
             fields, 
             TimesteppablePicState(self.method, self.state)
@@ -431,7 +469,7 @@ class PICRunner(object):
                 if step % setup.vis_interval == 0:
                     visualize(self.observer)
 
-                y = self.stepper(y, t, *step_args)
+                y = advance(y, t)
 
                 fields, ts_state = y
                 self.observer.set_fields_and_state(fields, ts_state.state)
@@ -73,6 +73,25 @@ class Pusher(object):
         sub_timer.stop().submit()
         return forces
 
+    def _particle_fields(self, state, velocities, e, b, *field_args):
+        self.backend.particle_fields(
+                ps=state.particle_state,
+                e=e, b=b,
+                *field_args)
+
+    def particle_fields(self, state, velocities, *field_args):
+        """Return a tuple (e, b) of the fields seen by each particle,
+        each an array of shape (particle_count, 3).
+        """
+        e = numpy.zeros((3*len(state),))
+        b = numpy.zeros((3*len(state),))
+
+        sub_timer = self.force_timer.start_sub_timer()
+        self._particle_fields(state, velocities, e, b, *field_args)
+        sub_timer.stop().submit()
+
+        return e.reshape((len(state), 3)), b.reshape((len(state), 3))
+
     def note_move(self, state, orig, dest, size):
         pass
 
@@ -84,18 +103,33 @@ class Pusher(object):
 
 # monomial pusher -------------------------------------------------------------
 class MonomialParticlePusher(Pusher):
+    """
+    @arg element_batched: If True, gather fields element by element,
+      evaluating all particles in an element with one dense product.
+      This is faster when elements hold many particles.
+    """
+
+    def __init__(self, element_batched=False):
+        Pusher.__init__(self)
+        self.element_batched = element_batched
+
     def initialize(self, method):
         Pusher.initialize(self, method)
 
         backend_class = getattr(_internal, "MonomialPusher" 
                 + method.get_dimensionality_suffix())
         self.backend = backend_class(method.mesh_data)
+        self.backend.element_batched = self.element_batched
 
         # add monomial basis data ---------------------------------------------
         from hedge.polynomial import generic_vandermonde
-        from pyrticle._internal import MonomialBasisFunction, lu
+        from pyrticle._internal import MonomialBasisFunction
+
+        discr = method.mesh_data.discr
+        ldis_indices = [None] * sum(
+                len(eg.members) for eg in discr.element_groups)
 
-        for i, eg in enumerate(method.mesh_data.discr.element_groups):
+        for i, eg in enumerate(discr.element_groups):
             ldis = eg.local_discretization
 
             from pyrticle._internal import LocalMonomialDiscretization
@@ -104,14 +138,16 @@ class MonomialParticlePusher(Pusher):
             lmd.basis.extend([MonomialBasisFunction(*idx)
                 for idx in ldis.node_tuples()])
 
-            mon_vdm_t = numpy.asarray(
-                    generic_vandermonde(ldis.unit_nodes(), lmd.basis).T,
-                    order="C")
+            mon_vdm_t = generic_vandermonde(ldis.unit_nodes(), lmd.basis).T
 
-            lmd.lu_vandermonde_t, lmd.lu_piv_vandermonde_t = lu(mon_vdm_t)
+            lmd.inverse_vandermonde_t = numpy.asarray(
+                    la.inv(mon_vdm_t), order="F")
             self.backend.local_discretizations.append(lmd)
 
-            self.backend.ldis_indices.extend([i]*len(eg.members))
+            for el in eg.members:
+                ldis_indices[el.id] = i
+
+        self.backend.ldis_indices.extend(ldis_indices)
 
 
 
@@ -205,3 +241,15 @@ class AverageParticlePusher(Pusher):
                 velocities=velocities,
                 vis_listener=state.vis_listener,
                 *field_args)
+
+    def _particle_fields(self, state, velocities, e, b, *field_args):
+        state.pusher_state.e_normalization_stats.reset()
+        state.pusher_state.b_normalization_stats.reset()
+        self.backend.particle_fields(
+                particle_state=state.particle_state,
+                pusher_state=state.pusher_state,
+                depositor=self.method.depositor.backend,
+                depositor_state=state.depositor_state,
+                velocities=velocities,
+                e=e, b=b,
+                *field_args)
@@ -35,6 +35,8 @@ def get_config_schema():
         LibraryDir("LAPACK", []),
         Libraries("LAPACK", ["lapack"]),
 
+        Switch("USE_OPENMP", True, "Use OpenMP for multithreaded deposition"),
+
         StringListOption("CXXFLAGS", [], 
             help="Any extra C++ compiler options to include"),
         ])
@@ -79,6 +81,11 @@ def main():
     handle_component("LAPACK")
     handle_component("BLAS")
 
+    EXTRA_LINK_ARGS = []
+    if conf["USE_OPENMP"]:
+        conf["CXXFLAGS"].append("-fopenmp")
+        EXTRA_LINK_ARGS.append("-fopenmp")
+
     setup(name="pyrticle",
           version="0.90",
           description="A high-order PIC code using Hedge",
@@ -107,6 +114,7 @@ def main():
                 library_dirs=LIBRARY_DIRS + EXTRA_LIBRARY_DIRS,
                 libraries=LIBRARIES + EXTRA_LIBRARIES,
                 extra_compile_args=conf["CXXFLAGS"],
+                extra_link_args=EXTRA_LINK_ARGS,
                 define_macros=list(EXTRA_DEFINES.iteritems()),
                 )]
          )
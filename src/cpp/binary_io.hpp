@@ -0,0 +1,268 @@
+// Pyrticle - Particle in Cell in Python
+// Binary file I/O for precomputed data
+// Copyright (C) 2008 Andreas Kloeckner
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+
+
+
+#ifndef _AFHYUAH_PYRTICLE_BINARY_IO_HPP_INCLUDED
+#define _AFHYUAH_PYRTICLE_BINARY_IO_HPP_INCLUDED
+
+
+
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstring>
+#include <stdexcept>
+#include <boost/cstdint.hpp>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+
+
+namespace pyrticle
+{
+  /** A read-only memory map of an entire file. If the file does not
+   * exist or cannot be mapped, is_mapped() returns false.
+   */
+  class mapped_file
+  {
+    private:
+      const char *m_data;
+      size_t m_size;
+
+      // not copyable
+      mapped_file(const mapped_file &);
+      mapped_file &operator=(const mapped_file &);
+
+    public:
+      mapped_file(const std::string &filename)
+        : m_data(0), m_size(0)
+      {
+        const int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+          return;
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+          void *data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+          if (data != MAP_FAILED)
+          {
+            m_data = static_cast<const char *>(data);
+            m_size = st.st_size;
+          }
+        }
+
+        close(fd);
+      }
+
+      ~mapped_file()
+      {
+        if (m_data)
+          munmap(const_cast<char *>(m_data), m_size);
+      }
+
+      bool is_mapped() const
+      { return m_data != 0; }
+
+      const char *begin() const
+      { return m_data; }
+
+      const char *end() const
+      { return m_data+m_size; }
+  };
+
+
+
+
+  struct binary_format_error : public std::runtime_error
+  {
+    binary_format_error(const std::string &what)
+      : std::runtime_error(what)
+    { }
+  };
+
+
+
+
+  /** Reads what binary_writer wrote from a block of memory, throwing
+   * binary_format_error if the data ends prematurely.
+   */
+  class binary_reader
+  {
+    private:
+      const char *m_position;
+      const char *m_end;
+
+    public:
+      binary_reader(const char *begin, const char *end)
+        : m_position(begin), m_end(end)
+      { }
+
+      bool at_end() const
+      { return m_position == m_end; }
+
+      void read_raw(void *dest, size_t bytes)
+      {
+        if (size_t(m_end-m_position) < bytes)
+          throw binary_format_error("unexpected end of binary data");
+        memcpy(dest, m_position, bytes);
+        m_position += bytes;
+      }
+
+      template <class T>
+      T read()
+      {
+        T result;
+        read_raw(&result, sizeof(T));
+        return result;
+      }
+
+      /** Read an element count and make sure that at least that many
+       * items of \c item_size bytes are left. */
+      size_t read_count(size_t item_size)
+      {
+        const boost::uint64_t count = read<boost::uint64_t>();
+        if (count > size_t(m_end-m_position)/item_size)
+          throw binary_format_error("invalid element count in binary data");
+        return count;
+      }
+
+      std::string read_string()
+      {
+        const size_t length = read_count(1);
+        std::string result(m_position, length);
+        m_position += length;
+        return result;
+      }
+
+      template <class T>
+      void read_vector(std::vector<T> &v)
+      {
+        v.resize(read_count(sizeof(T)));
+        if (v.size())
+          read_raw(&v[0], v.size()*sizeof(T));
+      }
+
+      /** Read into a resizable uBLAS-style vector. */
+      template <class Vector>
+      void read_ublas_vector(Vector &v)
+      {
+        typedef typename Vector::value_type value_type;
+
+        v.resize(read_count(sizeof(value_type)));
+        for (typename Vector::iterator it = v.begin(); it != v.end(); ++it)
+          *it = read<value_type>();
+      }
+
+      /** Read a matrix into \c m, unless it is empty. */
+      template <class Matrix>
+      void read_matrix(Matrix &m)
+      {
+        typedef typename Matrix::value_type value_type;
+
+        const boost::uint64_t rows = read<boost::uint64_t>();
+        const boost::uint64_t columns = read<boost::uint64_t>();
+        if (rows*columns == 0)
+          return;
+        if (read_count(sizeof(value_type)) != rows*columns)
+          throw binary_format_error("invalid matrix size in binary data");
+
+        m = Matrix(rows, columns);
+        for (unsigned j = 0; j < columns; ++j)
+          for (unsigned i = 0; i < rows; ++i)
+            m(i, j) = read<value_type>();
+      }
+  };
+
+
+
+
+  /** Writes native-endian binary data to a file. */
+  class binary_writer
+  {
+    private:
+      std::ofstream m_stream;
+
+    public:
+      binary_writer(const std::string &filename)
+        : m_stream(filename.c_str(), std::ios::out | std::ios::binary)
+      {
+        if (!m_stream)
+          throw std::runtime_error("could not open "+filename+" for writing");
+      }
+
+      void write_raw(const void *src, size_t bytes)
+      {
+        m_stream.write(static_cast<const char *>(src), bytes);
+        if (!m_stream)
+          throw std::runtime_error("error writing binary data");
+      }
+
+      template <class T>
+      void write(const T &x)
+      { write_raw(&x, sizeof(T)); }
+
+      void write_string(const std::string &s)
+      {
+        write<boost::uint64_t>(s.size());
+        write_raw(s.data(), s.size());
+      }
+
+      template <class T>
+      void write_vector(const std::vector<T> &v)
+      {
+        write<boost::uint64_t>(v.size());
+        if (v.size())
+          write_raw(&v[0], v.size()*sizeof(T));
+      }
+
+      template <class Vector>
+      void write_ublas_vector(const Vector &v)
+      {
+        write<boost::uint64_t>(v.size());
+        for (typename Vector::const_iterator it = v.begin(); it != v.end(); ++it)
+          write(*it);
+      }
+
+      template <class Matrix>
+      void write_matrix(const Matrix &m)
+      {
+        write<boost::uint64_t>(m.size1());
+        write<boost::uint64_t>(m.size2());
+        if (m.size1()*m.size2() == 0)
+          return;
+
+        write<boost::uint64_t>(m.size1()*m.size2());
+        for (unsigned j = 0; j < m.size2(); ++j)
+          for (unsigned i = 0; i < m.size1(); ++i)
+            write(m(i, j));
+      }
+  };
+}
+
+
+
+
+#endif
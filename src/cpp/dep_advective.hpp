@@ -33,11 +33,12 @@
 #include <boost/foreach.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/numeric/ublas/vector_proxy.hpp>
+#include <boost/numeric/ublas/matrix_proxy.hpp>
 #include <boost/numeric/ublas/io.hpp>
 #include <boost/numeric/bindings/traits/ublas_matrix.hpp>
 #include <boost/numeric/bindings/blas/blas3.hpp>
 #include <boost/typeof/std/utility.hpp>
-#include <boost/unordered_map.hpp>
+#include <boost/cstdint.hpp>
 #include <pyublas/elementwise_op.hpp>
 #include <hedge/face_operators.hpp>
 #include "tools.hpp"
@@ -61,63 +62,398 @@ namespace pyrticle
 
       static const unsigned max_faces = 4;
 
-      struct active_element
+      /** An advected particle's view of the active_element_pool: its
+       * active elements occupy the slots m_first_slot up to (but not
+       * including) end_slot(), with room for m_slot_capacity of them.
+       */
+      struct advected_particle
       {
-        const mesh_data::element_info *m_element_info;
-        boost::array<mesh_data::element_number,
-          advective_depositor::max_faces> m_connections;
-        unsigned m_start_index;
-        unsigned m_min_life;
-
-        active_element()
-          : m_element_info(0)
-        {
-          for (unsigned i = 0; i < advective_depositor::max_faces; i++)
-            m_connections[i] = mesh_data::INVALID_ELEMENT;
-        }
+        shape_function                m_shape_function;
+        unsigned                      m_first_slot;
+        unsigned                      m_element_count;
+        unsigned                      m_slot_capacity;
+
+        advected_particle(const shape_function &sf, unsigned first_slot)
+          : m_shape_function(sf), m_first_slot(first_slot),
+          m_element_count(0), m_slot_capacity(0)
+        { }
+
+        unsigned end_slot() const
+        { return m_first_slot+m_element_count; }
       };
 
-      struct advected_particle
+
+
+
+      /** Maps (particle, element number) pairs to pool slots. 
+       *
+       * An open-addressing hash table with linear probing, kept in flat
+       * arrays so that copying it costs no more than copying them.
+       */
+      class slot_index
       {
-        shape_function                m_shape_function;
-        std::vector<active_element>   m_elements;
+        private:
+          std::vector<boost::uint64_t> m_keys;
+          std::vector<unsigned> m_slots;
+          unsigned m_size;
+
+          static boost::uint64_t empty_key()
+          { return ~boost::uint64_t(0); }
+
+          static boost::uint64_t make_key(
+              particle_number pn, mesh_data::element_number en)
+          { return (boost::uint64_t(pn) << 32) | en; }
+
+          unsigned home_bucket(boost::uint64_t key) const
+          {
+            // Fibonacci hashing
+            const boost::uint64_t h = key*boost::uint64_t(0x9e3779b97f4a7c15ULL);
+            return unsigned(h >> 32) & (m_keys.size()-1);
+          }
+
+          unsigned find_bucket(boost::uint64_t key) const
+          {
+            unsigned b = home_bucket(key);
+            while (m_keys[b] != key && m_keys[b] != empty_key())
+              b = (b+1) & (m_keys.size()-1);
+            return b;
+          }
 
-        active_element *find_element(mesh_data::element_number en)
+          void rehash(unsigned bucket_count)
+          {
+            std::vector<boost::uint64_t> old_keys(bucket_count, empty_key());
+            std::vector<unsigned> old_slots(bucket_count);
+            old_keys.swap(m_keys);
+            old_slots.swap(m_slots);
+
+            for (unsigned i = 0; i < old_keys.size(); ++i)
+              if (old_keys[i] != empty_key())
+              {
+                const unsigned b = find_bucket(old_keys[i]);
+                m_keys[b] = old_keys[i];
+                m_slots[b] = old_slots[i];
+              }
+          }
+
+        public:
+          static unsigned invalid_slot()
+          { return ~0u; }
+
+          slot_index()
+            : m_keys(64, empty_key()), m_slots(64), m_size(0)
+          { }
+
+          unsigned find(particle_number pn, mesh_data::element_number en) const
+          {
+            const unsigned b = find_bucket(make_key(pn, en));
+            return m_keys[b] == empty_key() ? invalid_slot() : m_slots[b];
+          }
+
+          /** Point (pn, en) at \c slot, whether or not it was present. */
+          void set(particle_number pn, mesh_data::element_number en, 
+              unsigned slot)
+          {
+            if (2*(m_size+1) > m_keys.size())
+              rehash(2*m_keys.size());
+
+            const boost::uint64_t key = make_key(pn, en);
+            const unsigned b = find_bucket(key);
+            if (m_keys[b] == empty_key())
+            {
+              m_keys[b] = key;
+              ++m_size;
+            }
+            m_slots[b] = slot;
+          }
+
+          void erase(particle_number pn, mesh_data::element_number en)
+          {
+            const unsigned mask = m_keys.size()-1;
+            unsigned hole = find_bucket(make_key(pn, en));
+            if (m_keys[hole] == empty_key())
+              return;
+
+            // shift back entries whose probe sequence crosses the hole
+            for (unsigned b = (hole+1) & mask; m_keys[b] != empty_key(); 
+                b = (b+1) & mask)
+            {
+              const unsigned home = home_bucket(m_keys[b]);
+              const bool home_in_gap = hole <= b
+                ? (hole < home && home <= b)
+                : (hole < home || home <= b);
+
+              if (!home_in_gap)
+              {
+                m_keys[hole] = m_keys[b];
+                m_slots[hole] = m_slots[b];
+                hole = b;
+              }
+            }
+
+            m_keys[hole] = empty_key();
+            --m_size;
+          }
+
+          void clear()
+          {
+            std::fill(m_keys.begin(), m_keys.end(), empty_key());
+            m_size = 0;
+          }
+
+          void swap(slot_index &other)
+          {
+            m_keys.swap(other.m_keys);
+            m_slots.swap(other.m_slots);
+            std::swap(m_size, other.m_size);
+          }
+      };
+
+
+
+
+      /** The active elements of all advected particles, as parallel
+       * arrays indexed by slot. Each particle owns a contiguous range 
+       * of slots (see advected_particle), which is moved to the end of
+       * the arrays when it runs out of room. The slots thus abandoned are
+       * reclaimed by compact(), which keeps each particle's elements in
+       * order.
+       *
+       * Element numbers are unique within a particle. Connections are
+       * stored by element number, so that they stay valid when slots
+       * move.
+       */
+      struct active_element_pool
+      {
+        std::vector<advected_particle>                m_particles;
+
+        std::vector<const mesh_data::element_info *>  m_element_info;
+        std::vector<mesh_data::element_number>        m_connections;
+        std::vector<unsigned>                         m_start_index;
+        std::vector<unsigned>                         m_min_life;
+
+        slot_index                                    m_slot_index;
+        unsigned                                      m_unused_slots;
+
+        active_element_pool()
+          : m_unused_slots(0)
+        { }
+
+        unsigned slot_count() const
+        { return m_start_index.size(); }
+
+        mesh_data::element_number *connections(unsigned slot)
+        { return &m_connections[slot*max_faces]; }
+
+        const mesh_data::element_number *connections(unsigned slot) const
+        { return &m_connections[slot*max_faces]; }
+
+        /** Return the slot of element \c en of particle \c pn, or 
+         * slot_index::invalid_slot() if it is not active. */
+        unsigned find_slot(particle_number pn, 
+            mesh_data::element_number en) const
         {
           if (en == mesh_data::INVALID_ELEMENT)
-            return 0;
-          BOOST_FOREACH(active_element &el, m_elements)
+            return slot_index::invalid_slot();
+          return m_slot_index.find(pn, en);
+        }
+
+        void add_particle(const shape_function &sf)
+        { m_particles.push_back(advected_particle(sf, slot_count())); }
+
+        unsigned add_element(particle_number pn, 
+            const mesh_data::element_info &einfo,
+            unsigned start_index, unsigned min_life)
+        {
+          if (m_particles[pn].m_element_count 
+              == m_particles[pn].m_slot_capacity)
+            grow_particle(pn);
+
+          advected_particle &p(m_particles[pn]);
+          const unsigned slot = p.end_slot();
+          ++p.m_element_count;
+
+          m_element_info[slot] = &einfo;
+          std::fill(connections(slot), connections(slot)+max_faces,
+              mesh_data::element_number(mesh_data::INVALID_ELEMENT));
+          m_start_index[slot] = start_index;
+          m_min_life[slot] = min_life;
+          m_slot_index.set(pn, einfo.m_id, slot);
+          return slot;
+        }
+
+        /** Remove the element in \c slot by moving the particle's last
+         * element into its place. */
+        void remove_element(particle_number pn, unsigned slot)
+        {
+          advected_particle &p(m_particles[pn]);
+          const unsigned last = p.end_slot()-1;
+
+          m_slot_index.erase(pn, m_element_info[slot]->m_id);
+          if (slot != last)
+          {
+            copy_slot(last, slot);
+            m_slot_index.set(pn, m_element_info[slot]->m_id, slot);
+          }
+
+          m_element_info[last] = 0;
+          --p.m_element_count;
+        }
+
+        /** Forget the elements of particle \c pn. The caller is 
+         * responsible for their state vector space. */
+        void clear_particle(particle_number pn)
+        {
+          advected_particle &p(m_particles[pn]);
+          for (unsigned slot = p.m_first_slot; slot < p.end_slot(); ++slot)
           {
-            if (el.m_element_info->m_id == en)
-              return &el;
+            m_slot_index.erase(pn, m_element_info[slot]->m_id);
+            m_element_info[slot] = 0;
           }
-          return 0;
+          p.m_element_count = 0;
         }
 
-        const active_element *find_element(mesh_data::element_number en) const
+        /** Hand the elements of particle \c from over to particle \c to,
+         * which must not have any. */
+        void move_particle(particle_number from, particle_number to)
         {
-          if (en == mesh_data::INVALID_ELEMENT)
-            return 0;
-          BOOST_FOREACH(const active_element &el, m_elements)
+          advected_particle &p(m_particles[from]);
+          for (unsigned slot = p.m_first_slot; slot < p.end_slot(); ++slot)
+          {
+            m_slot_index.erase(from, m_element_info[slot]->m_id);
+            m_slot_index.set(to, m_element_info[slot]->m_id, slot);
+          }
+
+          m_unused_slots += m_particles[to].m_slot_capacity;
+          m_particles[to] = p;
+          p.m_first_slot = slot_count();
+          p.m_element_count = 0;
+          p.m_slot_capacity = 0;
+        }
+
+        void resize(unsigned particle_count)
+        {
+          for (particle_number pn = particle_count; 
+              pn < m_particles.size(); ++pn)
           {
-            if (el.m_element_info->m_id == en)
-              return &el;
+            clear_particle(pn);
+            m_unused_slots += m_particles[pn].m_slot_capacity;
           }
-          return 0;
+
+          m_particles.resize(particle_count, 
+              advected_particle(shape_function(), slot_count()));
+        }
+
+      private:
+        void resize_slots(unsigned new_slot_count)
+        {
+          m_element_info.resize(new_slot_count, 0);
+          m_connections.resize(new_slot_count*max_faces, 
+              mesh_data::element_number(mesh_data::INVALID_ELEMENT));
+          m_start_index.resize(new_slot_count, 0);
+          m_min_life.resize(new_slot_count, 0);
+        }
+
+        void copy_slot(unsigned from, unsigned to)
+        {
+          m_element_info[to] = m_element_info[from];
+          std::copy(connections(from), connections(from)+max_faces,
+              connections(to));
+          m_start_index[to] = m_start_index[from];
+          m_min_life[to] = m_min_life[from];
         }
 
+        void grow_particle(particle_number pn)
+        {
+          advected_particle &p(m_particles[pn]);
+          const unsigned new_capacity = std::max(4u, 2*p.m_slot_capacity);
+
+          if (p.m_first_slot+p.m_slot_capacity == slot_count())
+          {
+            // last range in the arrays, grow in place
+            resize_slots(p.m_first_slot+new_capacity);
+            p.m_slot_capacity = new_capacity;
+            return;
+          }
+
+          const unsigned new_first = slot_count();
+          resize_slots(new_first+new_capacity);
+
+          for (unsigned i = 0; i < p.m_element_count; ++i)
+          {
+            copy_slot(p.m_first_slot+i, new_first+i);
+            m_element_info[p.m_first_slot+i] = 0;
+            m_slot_index.set(pn, m_element_info[new_first+i]->m_id, 
+                new_first+i);
+          }
+
+          m_unused_slots += p.m_slot_capacity;
+          p.m_first_slot = new_first;
+          p.m_slot_capacity = new_capacity;
+
+          if (m_unused_slots > slot_count()/2)
+            compact();
+        }
+
+      public:
+        /** Pack the particles' ranges, leaving each of them its 
+         * current capacity. Changes slot numbers. */
+        void compact()
+        {
+          active_element_pool result;
+          result.m_particles.reserve(m_particles.size());
+
+          unsigned total_capacity = 0;
+          BOOST_FOREACH(const advected_particle &p, m_particles)
+            total_capacity += p.m_slot_capacity;
+          result.resize_slots(total_capacity);
+
+          unsigned next_slot = 0;
+          for (particle_number pn = 0; pn < m_particles.size(); ++pn)
+          {
+            advected_particle p(m_particles[pn]);
+            for (unsigned i = 0; i < p.m_element_count; ++i)
+            {
+              const unsigned slot = next_slot+i;
+              result.m_element_info[slot] = m_element_info[p.m_first_slot+i];
+              std::copy(connections(p.m_first_slot+i), 
+                  connections(p.m_first_slot+i)+max_faces,
+                  result.connections(slot));
+              result.m_start_index[slot] = m_start_index[p.m_first_slot+i];
+              result.m_min_life[slot] = m_min_life[p.m_first_slot+i];
+              result.m_slot_index.set(pn, 
+                  result.m_element_info[slot]->m_id, slot);
+            }
+
+            p.m_first_slot = next_slot;
+            next_slot += p.m_slot_capacity;
+            result.m_particles.push_back(p);
+          }
+
+          m_particles.swap(result.m_particles);
+          m_element_info.swap(result.m_element_info);
+          m_connections.swap(result.m_connections);
+          m_start_index.swap(result.m_start_index);
+          m_min_life.swap(result.m_min_life);
+          m_slot_index.swap(result.m_slot_index);
+          m_unused_slots = 0;
+        }
       };
 
 
 
 
       // particle state for advective -----------------------------------------
+      /** The element structure of advected particles (as opposed to 
+       * their density in m_rho) is the same for the states of all stages
+       * of a time step, unless elements get activated or retired. It is 
+       * therefore shared between states, and copied on write.
+       */
       struct depositor_state
       {
         unsigned                        m_active_elements;
         std::vector<unsigned>           m_freelist;
 
-        std::vector<advected_particle>  m_advected_particles;
+        boost::shared_ptr<active_element_pool> m_pool;
         dyn_vector                      m_rho;
 
         boost::shared_ptr<number_shift_listener> m_rho_dof_shift_listener;
@@ -128,7 +464,7 @@ namespace pyrticle
 
 
         depositor_state()
-          : m_active_elements(0)
+          : m_active_elements(0), m_pool(new active_element_pool)
         { }
 
         template <class NewRhoExpr>
@@ -138,7 +474,7 @@ namespace pyrticle
             boost::shared_ptr<number_shift_listener> rho_dof_sl)
           : m_active_elements(src.m_active_elements),
           m_freelist(src.m_freelist),
-          m_advected_particles(src.m_advected_particles),
+          m_pool(src.m_pool),
           m_rho(new_rho),
           m_rho_dof_shift_listener(rho_dof_sl),
           m_element_activation_counter(src.m_element_activation_counter),
@@ -148,9 +484,19 @@ namespace pyrticle
         virtual ~depositor_state()
         { }
 
+        const active_element_pool &pool() const
+        { return *m_pool; }
+
+        active_element_pool &writable_pool()
+        {
+          if (!m_pool.unique())
+            m_pool.reset(new active_element_pool(*m_pool));
+          return *m_pool;
+        }
+
         unsigned count_advective_particles() const
         {
-          return m_advected_particles.size();
+          return m_pool->m_particles.size();
         }
 
         void resize_rho(unsigned new_size)
@@ -166,7 +512,7 @@ namespace pyrticle
 
         void clear()
         {
-          m_advected_particles.clear();
+          m_pool.reset(new active_element_pool);
           m_freelist.clear();
           m_active_elements = 0;
         }
@@ -189,6 +535,10 @@ namespace pyrticle
       dyn_fortran_matrix              m_filter_matrix;
 
       std::vector<dyn_fortran_matrix> m_local_diff_matrices;
+      /** m_local_diff_matrices, stacked on top of each other in order of
+       * their coordinate.
+       */
+      dyn_fortran_matrix              m_stacked_diff_matrix;
 
       typedef hedge::face_pair<hedge::straight_face> face_pair_type;
       typedef hedge::face_group<face_pair_type> face_group_type;
@@ -196,29 +546,62 @@ namespace pyrticle
       boost::shared_ptr<face_group_type > m_int_face_group;
       boost::shared_ptr<face_group_type > m_bdry_face_group;
 
-      struct face_pair_locator
+      /** What the flux computation needs to know about face fn of
+       * element en, seen from en. Found at 
+       * m_face_table[en*m_faces_per_element+fn].
+       */
+      struct face_table_entry
       {
-        face_group_type const *m_face_group;
-        face_pair_type const *m_face_pair;
-
-        face_pair_locator()
-          : m_face_group(0), m_face_pair(0)
-        { }
-
-        face_pair_locator(
-            face_group_type     const &face_group,
-            face_pair_type      const &face_pair
-            )
-          : m_face_group(&face_group), m_face_pair(&face_pair)
+        hedge::index_lists_t::const_iterator m_index_list;
+        hedge::index_lists_t::const_iterator m_ext_index_list;
+        bounded_vector m_normal;
+        double m_face_jacobian;
+        mesh_data::element_number m_neighbor;
+        bool m_is_boundary;
+        bool m_is_valid;
+
+        face_table_entry()
+          : m_face_jacobian(0), m_neighbor(mesh_data::INVALID_ELEMENT), 
+          m_is_boundary(false), m_is_valid(false)
         { }
       };
 
-      boost::unordered_map<mesh_data::el_face, face_pair_locator> m_el_face_to_face_pair_locator;
+      std::vector<face_table_entry> m_face_table;
 
       double m_activation_threshold;
       double m_kill_threshold;
       double m_upwind_alpha;
 
+      unsigned m_thread_count;
+
+      /** Scratch space for one chunk of particles in calculate_local_div(),
+       * kept between calls. Holds the densities of a block of elements,
+       * their local derivatives, the coefficients that combine those into 
+       * dot(v, grad rho), and where in the state vector they belong.
+       */
+      struct local_div_scratch
+      {
+        dyn_vector m_rho_block;
+        dyn_vector m_derivs_block;
+        dyn_vector m_coefficients;
+        std::vector<unsigned> m_starts;
+
+        void resize(unsigned block_size, unsigned dimensions, unsigned dofs)
+        {
+          if (m_starts.size() == block_size 
+              && m_derivs_block.size() == block_size*dimensions*dofs
+              && m_rho_block.size() == block_size*dofs)
+            return;
+
+          m_rho_block.resize(block_size*dofs, false);
+          m_derivs_block.resize(block_size*dimensions*dofs, false);
+          m_coefficients.resize(block_size*dimensions, false);
+          m_starts.resize(block_size);
+        }
+      };
+
+      mutable std::vector<local_div_scratch> m_local_div_scratch;
+
 
 
 
@@ -239,7 +622,7 @@ namespace pyrticle
           )
         : m_mesh_data(md), m_faces_per_element(0), m_dofs_per_element(0),
         m_activation_threshold(0), m_kill_threshold(0),
-        m_upwind_alpha(1)
+        m_upwind_alpha(1), m_thread_count(1)
       {
         m_faces_per_element = faces_per_element;
         m_dofs_per_element = dofs_per_element;
@@ -260,30 +643,19 @@ namespace pyrticle
         m_int_face_group = int_face_group;
         m_bdry_face_group = bdry_face_group;
 
-        // build m_el_face_to_face_pair_locator
-        BOOST_FOREACH(const hedge::face_pair<hedge::straight_face> &fp,
-            int_face_group->face_pairs)
-        {
-          const hedge::straight_face &f = fp.int_side;
-          m_el_face_to_face_pair_locator
-            [std::make_pair(f.element_id, f.face_id)] =
-            face_pair_locator(*int_face_group, fp);
-
-          const hedge::straight_face &ext_f = fp.ext_side;
-          m_el_face_to_face_pair_locator
-            [std::make_pair(ext_f.element_id, ext_f.face_id)] =
-            face_pair_locator(*int_face_group, fp);
-        }
+        // build m_face_table
+        m_face_table.resize(
+            m_mesh_data.m_element_info.size()*m_faces_per_element);
 
-        BOOST_FOREACH(const face_pair_type &fp,
-            bdry_face_group->face_pairs)
+        BOOST_FOREACH(const face_pair_type &fp, int_face_group->face_pairs)
         {
-          const hedge::straight_face &f = fp.int_side;
-          m_el_face_to_face_pair_locator
-            [std::make_pair(f.element_id, f.face_id)] =
-            face_pair_locator(*bdry_face_group, fp);
+          add_face_table_entry(*int_face_group, fp.int_side, fp.ext_side);
+          add_face_table_entry(*int_face_group, fp.ext_side, fp.int_side);
         }
 
+        BOOST_FOREACH(const face_pair_type &fp, bdry_face_group->face_pairs)
+          add_face_table_entry(*bdry_face_group, fp.int_side, fp.ext_side);
+
         m_activation_threshold = activation_threshold;
         m_kill_threshold = kill_threshold;
         m_upwind_alpha = upwind_alpha;
@@ -292,12 +664,52 @@ namespace pyrticle
 
 
 
+    private:
+      void add_face_table_entry(const face_group_type &fg,
+          const hedge::straight_face &face, 
+          const hedge::straight_face &ext_face)
+      {
+        const unsigned idx = face.element_id*m_faces_per_element
+          + face.face_id;
+        if (face.face_id >= m_faces_per_element 
+            || idx >= m_face_table.size())
+          throw std::runtime_error("face group refers to invalid (el,face)");
+
+        face_table_entry &fte(m_face_table[idx]);
+
+        fte.m_is_boundary = ext_face.element_id == hedge::INVALID_ELEMENT;
+        fte.m_index_list = fg.index_list(face.face_index_list_number);
+        fte.m_ext_index_list = fte.m_is_boundary ? fte.m_index_list 
+          : fg.index_list(ext_face.face_index_list_number);
+        fte.m_normal = face.normal;
+        fte.m_face_jacobian = face.face_jacobian;
+        fte.m_neighbor = fte.m_is_boundary ? mesh_data::INVALID_ELEMENT 
+          : mesh_data::element_number(ext_face.element_id);
+        fte.m_is_valid = true;
+      }
+
+    public:
       void add_local_diff_matrix(unsigned coordinate, const py_matrix &dmat)
       {
         if (coordinate != m_local_diff_matrices.size())
           throw std::runtime_error("local diff matrices added out of order");
 
         m_local_diff_matrices.push_back(dmat);
+
+        // rebuild m_stacked_diff_matrix
+        const unsigned rows = dmat.size1();
+        m_stacked_diff_matrix.resize(
+            rows*m_local_diff_matrices.size(), dmat.size2(), false);
+        for (unsigned axis = 0; axis < m_local_diff_matrices.size(); ++axis)
+        {
+          if (m_local_diff_matrices[axis].size1() != rows
+              || m_local_diff_matrices[axis].size2() != dmat.size2())
+            throw std::runtime_error("local diff matrices differ in shape");
+
+          subrange(m_stacked_diff_matrix, 
+              axis*rows, (axis+1)*rows, 0, dmat.size2()) 
+            = m_local_diff_matrices[axis];
+        }
       }
 
 
@@ -317,17 +729,23 @@ namespace pyrticle
           const ParticleState &ps,
           Target &tgt, boost::python::slice const &pslice) const
       {
+        const active_element_pool &pool(ds.pool());
+
         FOR_ALL_SLICE_INDICES(pslice, ps.particle_count)
         {
           FOR_ALL_SLICE_INDICES_INNER(particle_number, pn);
 
           tgt.begin_particle(pn);
-          BOOST_FOREACH(const active_element &el,
-              ds.m_advected_particles[pn].m_elements)
+          const advected_particle &p(pool.m_particles[pn]);
+          for (unsigned slot = p.m_first_slot; slot < p.end_slot(); ++slot)
+          {
+            const mesh_data::element_info &einfo(*pool.m_element_info[slot]);
+            const unsigned start = pool.m_start_index[slot];
             tgt.add_shape_on_element(
-                el.m_element_info->m_id,
-                el.m_element_info->m_start,
-                subrange(ds.m_rho, el.m_start_index, el.m_start_index+m_dofs_per_element));
+                einfo.m_id,
+                einfo.m_start,
+                subrange(ds.m_rho, start, start+m_dofs_per_element));
+          }
           tgt.end_particle(pn);
         }
       }
@@ -371,55 +789,58 @@ namespace pyrticle
         if (m_kill_threshold == 0)
           throw std::runtime_error("zero kill threshold");
 
-        particle_number pn = 0;
-        BOOST_FOREACH(advected_particle &p, ds.m_advected_particles)
+        active_element_pool &pool(ds.writable_pool());
+
+        for (particle_number pn = 0; pn < pool.m_particles.size(); ++pn)
         {
+          const advected_particle &p(pool.m_particles[pn]);
           double particle_charge = fabs(ps.charges[pn]);
-          for (unsigned i_el = 0; i_el < p.m_elements.size(); ++i_el)
-          {
-            active_element &el = p.m_elements[i_el];
 
-            if (el.m_min_life)
-              --el.m_min_life;
+          unsigned slot = p.m_first_slot;
+          while (slot < p.end_slot())
+          {
+            unsigned &min_life(pool.m_min_life[slot]);
+            if (min_life)
+              --min_life;
 
+            const unsigned start = pool.m_start_index[slot];
             const double element_charge = element_l1(
-                el.m_element_info->m_jacobian,
-                subrange(
-                  ds.m_rho,
-                  el.m_start_index,
-                  el.m_start_index+m_dofs_per_element));
+                pool.m_element_info[slot]->m_jacobian,
+                subrange(ds.m_rho, start, start+m_dofs_per_element));
 
-            if (el.m_min_life == 0  && element_charge / particle_charge < m_kill_threshold)
+            if (min_life == 0  && element_charge / particle_charge < m_kill_threshold)
             {
               // retire this element
-              const hedge::element_number_t en = el.m_element_info->m_id;
+              const hedge::element_number_t en = 
+                pool.m_element_info[slot]->m_id;
 
               // kill connections
               for (hedge::face_number_t fn = 0; fn < m_faces_per_element; ++fn)
               {
-                hedge::element_number_t connected_en = el.m_connections[fn];
-                if (connected_en != hedge::INVALID_ELEMENT)
+                const unsigned connected_slot = pool.find_slot(
+                    pn, pool.connections(slot)[fn]);
+                if (connected_slot != slot_index::invalid_slot())
                 {
-                  active_element &connected_el = *p.find_element(connected_en);
+                  mesh_data::element_number *connected_cnx = 
+                    pool.connections(connected_slot);
 
                   for (hedge::face_number_t cfn = 0; cfn < m_faces_per_element; ++cfn)
                   {
-                    if (connected_el.m_connections[cfn] == en)
-                      connected_el.m_connections[cfn] = hedge::INVALID_ELEMENT;
+                    if (connected_cnx[cfn] == en)
+                      connected_cnx[cfn] = hedge::INVALID_ELEMENT;
                   }
                 }
               }
 
-              deallocate_element(ds, el.m_start_index);
+              deallocate_element(ds, start);
 
-              // kill the element
-              p.m_elements.erase(p.m_elements.begin()+i_el);
+              // kill the element, the particle's last element takes 
+              // its slot
+              pool.remove_element(pn, slot);
             }
             else
-              ++i_el;
+              ++slot;
           }
-
-          ++pn;
         }
       }
 
@@ -428,9 +849,12 @@ namespace pyrticle
 
       void kill_advected_particle(depositor_state &ds, particle_number pn)
       {
-        BOOST_FOREACH(active_element &el,
-            ds.m_advected_particles[pn].m_elements)
-          deallocate_element(ds, el.m_start_index);
+        active_element_pool &pool(ds.writable_pool());
+        const advected_particle &p(pool.m_particles[pn]);
+
+        for (unsigned slot = p.m_first_slot; slot < p.end_slot(); ++slot)
+          deallocate_element(ds, pool.m_start_index[slot]);
+        pool.clear_particle(pn);
       }
 
 
@@ -441,8 +865,11 @@ namespace pyrticle
       {
         for (unsigned i = 0; i < size; ++i)
         {
+          if (from+i == to+i)
+            continue;
+
           kill_advected_particle(ds, to+i);
-          ds.m_advected_particles[to+i] = ds.m_advected_particles[from+i];
+          ds.writable_pool().move_particle(from+i, to+i);
         }
       }
 
@@ -452,33 +879,34 @@ namespace pyrticle
       void note_change_size(depositor_state &ds, unsigned particle_count)
       {
         for (particle_number pn = particle_count;
-            pn < ds.m_advected_particles.size();
+            pn < ds.count_advective_particles();
             ++pn)
           kill_advected_particle(ds, pn);
 
-        ds.m_advected_particles.resize(particle_count);
+        ds.writable_pool().resize(particle_count);
       }
 
 
 
 
       // initialization -----------------------------------------------------
-      void dump_particle(advected_particle const &p) const
+      void dump_particle(const active_element_pool &pool, 
+          particle_number pn) const
       {
+        const advected_particle &p(pool.m_particles[pn]);
         std::cout << "particle, radius " << p.m_shape_function.radius() << std::endl;
-        unsigned i_el = 0;
-        BOOST_FOREACH(const active_element &el, p.m_elements)
+        for (unsigned slot = p.m_first_slot; slot < p.end_slot(); ++slot)
         {
-          std::cout << "#" << el.m_element_info->m_id << " cnx:(";
+          const mesh_data::element_number *cnx = pool.connections(slot);
+
+          std::cout << "#" << pool.m_element_info[slot]->m_id << " cnx:(";
           for (unsigned fn = 0; fn < m_faces_per_element; ++fn)
-            if (el.m_connections[fn] == hedge::INVALID_ELEMENT)
+            if (cnx[fn] == hedge::INVALID_ELEMENT)
               std::cout << "X" << ',';
             else
-              std::cout << el.m_connections[fn]  << ',';
+              std::cout << cnx[fn]  << ',';
 
           std::cout << ")" << std::endl;
-
-          ++i_el;
         }
       }
 
@@ -555,13 +983,15 @@ namespace pyrticle
             m_dofs_per_element*m_mesh_data.m_element_info.size());
         result.clear();
 
-        BOOST_FOREACH(const advected_particle &p, ds.m_advected_particles)
+        const active_element_pool &pool(ds.pool());
+        BOOST_FOREACH(const advected_particle &p, pool.m_particles)
         {
-          BOOST_FOREACH(const active_element &el, p.m_elements)
+          for (unsigned slot = p.m_first_slot; slot < p.end_slot(); ++slot)
           {
-            const mesh_data::element_info &einfo = *el.m_element_info;
+            const mesh_data::element_info &einfo = *pool.m_element_info[slot];
+            const unsigned start = pool.m_start_index[slot];
             noalias(subrange(result, einfo.m_start, einfo.m_end)) +=
-              subrange(pspace, el.m_start_index, el.m_start_index+m_dofs_per_element);
+              subrange(pspace, start, start+m_dofs_per_element);
           }
         }
 
@@ -579,11 +1009,12 @@ namespace pyrticle
             m_dofs_per_element*m_mesh_data.m_element_info.size());
         result.clear();
 
-        BOOST_FOREACH(const advected_particle &p, ds.m_advected_particles)
+        const active_element_pool &pool(ds.pool());
+        BOOST_FOREACH(const advected_particle &p, pool.m_particles)
         {
-          BOOST_FOREACH(const active_element &el, p.m_elements)
+          for (unsigned slot = p.m_first_slot; slot < p.end_slot(); ++slot)
           {
-            const mesh_data::element_info &einfo = *el.m_element_info;
+            const mesh_data::element_info &einfo = *pool.m_element_info[slot];
             noalias(subrange(result, einfo.m_start, einfo.m_end)) +=
               boost::numeric::ublas::scalar_vector<double>(m_dofs_per_element, 1);
           }
@@ -602,14 +1033,14 @@ namespace pyrticle
         private:
           advective_depositor &m_depositor;
           depositor_state &m_dep_state;
-          advected_particle &m_particle;
+          particle_number m_particle_number;
 
         public:
           advected_particle_element_target(
               advective_depositor &dep,
               depositor_state &ds,
-              advected_particle &p)
-            : m_depositor(dep), m_dep_state(ds), m_particle(p)
+              particle_number pn)
+            : m_depositor(dep), m_dep_state(ds), m_particle_number(pn)
           { }
 
           void add_shape_on_element(
@@ -620,18 +1051,16 @@ namespace pyrticle
             const mesh_data::element_info &einfo(
                 m_depositor.m_mesh_data.m_element_info[en]);
 
-            active_element new_element;
-            new_element.m_element_info = &einfo;
-            unsigned start = new_element.m_start_index =
-              m_depositor.allocate_element(m_dep_state);
-            new_element.m_min_life = 0;
+            const unsigned start = m_depositor.allocate_element(m_dep_state);
+            active_element_pool &pool(m_dep_state.writable_pool());
 
+            const shape_function &sf(
+                pool.m_particles[m_particle_number].m_shape_function);
             for (unsigned i = 0; i < m_depositor.m_dofs_per_element; ++i)
               m_dep_state.m_rho[start+i] =
-                m_particle.m_shape_function(
-                    m_depositor.m_mesh_data.mesh_node(einfo.m_start+i)-center);
+                sf(m_depositor.m_mesh_data.mesh_node(einfo.m_start+i)-center);
 
-            m_particle.m_elements.push_back(new_element);
+            pool.add_element(m_particle_number, einfo, start, 0);
           }
       };
 
@@ -644,39 +1073,41 @@ namespace pyrticle
           const ParticleState &ps,
           shape_function sf, particle_number pn)
       {
-        if (pn != ds.m_advected_particles.size())
+        if (pn != ds.count_advective_particles())
           throw std::runtime_error("advected particle added out of sequence");
 
-        advected_particle new_particle;
-        new_particle.m_shape_function = sf;
+        ds.writable_pool().add_particle(sf);
 
         element_finder el_finder(m_mesh_data);
 
-        advected_particle_element_target el_tgt(*this, ds, new_particle);
+        advected_particle_element_target el_tgt(*this, ds, pn);
         el_finder(ps, el_tgt, pn, sf.radius());
 
+        active_element_pool &pool(ds.writable_pool());
+        const advected_particle &p(pool.m_particles[pn]);
+
         // make connections
-        BOOST_FOREACH(active_element &el, new_particle.m_elements)
+        for (unsigned slot = p.m_first_slot; slot < p.end_slot(); ++slot)
         {
-          const mesh_data::element_info &einfo = *el.m_element_info;
+          const mesh_data::element_info &einfo = *pool.m_element_info[slot];
 
           unsigned fn = 0;
           BOOST_FOREACH(const mesh_data::face_info &f, einfo.m_faces)
           {
-            if (new_particle.find_element(f.m_neighbor))
-              el.m_connections[fn] = f.m_neighbor;
+            if (pool.find_slot(pn, f.m_neighbor) != slot_index::invalid_slot())
+              pool.connections(slot)[fn] = f.m_neighbor;
             ++fn;
           }
         }
 
         // scale so the amount of charge is correct
         std::vector<double> unscaled_masses;
-        BOOST_FOREACH(active_element &el, new_particle.m_elements)
+        for (unsigned slot = p.m_first_slot; slot < p.end_slot(); ++slot)
           unscaled_masses.push_back(element_integral(
-                el.m_element_info->m_jacobian,
+                pool.m_element_info[slot]->m_jacobian,
                 subrange(ds.m_rho,
-                  el.m_start_index,
-                  el.m_start_index+m_dofs_per_element)));
+                  pool.m_start_index[slot],
+                  pool.m_start_index[slot]+m_dofs_per_element)));
 
         const double charge = ps.charges[pn];
         const double total_unscaled_mass = std::accumulate(
@@ -686,91 +1117,206 @@ namespace pyrticle
         if (total_unscaled_mass == 0)
         {
           WARN(boost::str(boost::format("deposited initial particle mass is zero"
-                  "(particle %d, #elements=%d)") % pn % new_particle.m_elements.size()));
+                  "(particle %d, #elements=%d)") % pn % p.m_element_count));
           scale = charge;
         }
         else
           scale = charge / total_unscaled_mass;
 
-        BOOST_FOREACH(active_element &el, new_particle.m_elements)
+        for (unsigned slot = p.m_first_slot; slot < p.end_slot(); ++slot)
           subrange(ds.m_rho,
-              el.m_start_index,
-              el.m_start_index+m_dofs_per_element)
+              pool.m_start_index[slot],
+              pool.m_start_index[slot]+m_dofs_per_element)
           *= scale;
-
-        ds.m_advected_particles.push_back(new_particle);
       }
 
 
 
 
       // rhs calculation ----------------------------------------------------
-      py_vector calculate_local_div(
-          depositor_state &ds,
-          const ParticleState &ps,
-          py_vector const &velocities) const
+      /** Apply \a matrix (with gemm's \a matrix_trans) to each of the
+       * first \a element_count element-sized blocks of \a operand and add
+       * the result to the corresponding block of \a result. The elements
+       * are split into one chunk per thread.
+       */
+      void apply_elementwise_matrix(
+          char matrix_trans,
+          const dyn_fortran_matrix &matrix,
+          const double *operand,
+          double *result,
+          unsigned element_count) const
       {
-        const unsigned dofs = ds.m_rho.size();
-        const unsigned active_contiguous_elements =
-          ds.m_active_elements + ds.m_freelist.size();
-
-        py_vector local_div(dofs);
-        local_div.clear();
-
-        // calculate local rst derivatives ----------------------------------
-        dyn_vector rst_derivs(get_dimensions_mesh()*dofs);
-        rst_derivs.clear();
         using namespace boost::numeric::bindings;
         using blas::detail::gemm;
 
-        for (unsigned loc_axis = 0; loc_axis < get_dimensions_mesh(); ++loc_axis)
+        const int chunk_count = std::min(m_thread_count, element_count);
+
+#pragma omp parallel for schedule(static) num_threads(this->m_thread_count)
+        for (int chunk = 0; chunk < chunk_count; ++chunk)
         {
-          const dyn_fortran_matrix &matrix = m_local_diff_matrices.at(loc_axis);
+          const unsigned el_start = 
+            (unsigned long) element_count*chunk/chunk_count;
+          const unsigned el_end = 
+            (unsigned long) element_count*(chunk+1)/chunk_count;
 
           gemm(
-              'N', // "matrix" is row-major
+              matrix_trans,
               'N', // a contiguous array of vectors is column-major
               matrix.size1(),
-              active_contiguous_elements,
+              el_end-el_start,
               matrix.size2(),
               /*alpha*/ 1,
               /*a*/ traits::matrix_storage(matrix),
               /*lda*/ matrix.size2(),
-              /*b*/ traits::vector_storage(ds.m_rho),
+              /*b*/ operand + el_start*m_dofs_per_element,
               /*ldb*/ m_dofs_per_element,
               /*beta*/ 1,
-              /*c*/ traits::vector_storage(rst_derivs) + loc_axis*dofs,
+              /*c*/ result + el_start*m_dofs_per_element,
               /*ldc*/ m_dofs_per_element
               );
         }
+      }
 
-        // combine them into local part of dot(v, grad rho) -----------------
+
+
+
+      /** Compute the local part of dot(v, grad rho) for the 
+       * \a block_elements elements gathered in \a scratch, and store it
+       * in \a local_div.
+       */
+      void calculate_local_div_block(
+          local_div_scratch &scratch,
+          unsigned block_elements,
+          double *local_div) const
+      {
+        using namespace boost::numeric::bindings;
+        using blas::detail::gemm;
+
+        const unsigned dims = get_dimensions_mesh();
+        const unsigned derivs_size = m_stacked_diff_matrix.size1();
+
+        // all rst derivatives of all elements in the block at once
+        gemm(
+            'N',
+            'N', // a contiguous array of vectors is column-major
+            derivs_size,
+            block_elements,
+            m_stacked_diff_matrix.size2(),
+            /*alpha*/ 1,
+            /*a*/ traits::matrix_storage(m_stacked_diff_matrix),
+            /*lda*/ derivs_size,
+            /*b*/ traits::vector_storage(scratch.m_rho_block),
+            /*ldb*/ m_dofs_per_element,
+            /*beta*/ 0,
+            /*c*/ traits::vector_storage(scratch.m_derivs_block),
+            /*ldc*/ derivs_size
+            );
+
+        for (unsigned i_block = 0; i_block < block_elements; ++i_block)
+        {
+          const double *derivs = 
+            traits::vector_storage(scratch.m_derivs_block) 
+            + i_block*derivs_size;
+          const double *coefficients = 
+            traits::vector_storage(scratch.m_coefficients) + i_block*dims;
+          double *el_local_div = local_div + scratch.m_starts[i_block];
+
+          for (unsigned i = 0; i < m_dofs_per_element; ++i)
+          {
+            double result = 0;
+            for (unsigned loc_axis = 0; loc_axis < dims; ++loc_axis)
+              result += coefficients[loc_axis]
+                * derivs[loc_axis*m_dofs_per_element + i];
+            el_local_div[i] = result;
+          }
+        }
+      }
+
+
+
+
+      /** Elements are gathered into blocks, whose local derivatives are
+       * computed by one gemm with m_stacked_diff_matrix and then combined
+       * right away, while they are still in cache. Only active elements
+       * are visited, holes in the state vector are skipped.
+       */
+      py_vector calculate_local_div(
+          depositor_state &ds,
+          const ParticleState &ps,
+          py_vector const &velocities) const
+      {
+        const unsigned dims = get_dimensions_mesh();
+        const unsigned block_size = 32;
+
+        if (m_stacked_diff_matrix.size1() != dims*m_dofs_per_element
+            || m_stacked_diff_matrix.size2() != m_dofs_per_element)
+          throw std::runtime_error("local diff matrices missing or of wrong size");
+
+        py_vector local_div(ds.m_rho.size());
+        local_div.clear();
+
+        using namespace boost::numeric::bindings;
+        const double *rho = traits::vector_storage(ds.m_rho);
+        double *local_div_storage = traits::vector_storage(local_div);
+
+        const active_element_pool &pool(ds.pool());
+        const unsigned particle_count = pool.m_particles.size();
+
+        const int chunk_count = std::min(4*m_thread_count, particle_count);
+        if (m_local_div_scratch.size() < unsigned(chunk_count))
+          m_local_div_scratch.resize(chunk_count);
+
+#pragma omp parallel for schedule(dynamic) num_threads(this->m_thread_count)
+        for (int chunk = 0; chunk < chunk_count; ++chunk)
         {
-          particle_number pn = 0;
-          BOOST_FOREACH(const advected_particle &p, ds.m_advected_particles)
+          local_div_scratch &scratch(m_local_div_scratch[chunk]);
+          scratch.resize(block_size, dims, m_dofs_per_element);
+
+          const particle_number pn_start = 
+            (unsigned long) particle_count*chunk/chunk_count;
+          const particle_number pn_end = 
+            (unsigned long) particle_count*(chunk+1)/chunk_count;
+
+          unsigned block_elements = 0;
+
+          for (particle_number pn = pn_start; pn < pn_end; ++pn)
           {
+            const advected_particle &p(pool.m_particles[pn]);
+
             bounded_vector v = subrange(velocities,
                 ps.vdim()*pn, ps.vdim()*(pn+1));
 
-            BOOST_FOREACH(const active_element &el, p.m_elements)
+            for (unsigned slot = p.m_first_slot; slot < p.end_slot(); ++slot)
             {
-              for (unsigned loc_axis = 0; loc_axis < get_dimensions_mesh(); ++loc_axis)
+              const mesh_data::element_info &einfo = *pool.m_element_info[slot];
+              const unsigned start = pool.m_start_index[slot];
+
+              for (unsigned loc_axis = 0; loc_axis < dims; ++loc_axis)
               {
                 double coeff = 0;
-                for (unsigned glob_axis = 0; glob_axis < get_dimensions_mesh(); ++glob_axis)
+                for (unsigned glob_axis = 0; glob_axis < dims; ++glob_axis)
                   coeff += -v[glob_axis] *
-                    el.m_element_info->m_inverse_map.matrix()(loc_axis, glob_axis);
-
-                subrange(local_div,
-                    el.m_start_index,
-                    el.m_start_index + m_dofs_per_element) += coeff *
-                  subrange(rst_derivs,
-                      loc_axis*dofs + el.m_start_index,
-                      loc_axis*dofs + el.m_start_index + m_dofs_per_element);
+                    einfo.m_inverse_map.matrix()(loc_axis, glob_axis);
+                scratch.m_coefficients[block_elements*dims+loc_axis] = coeff;
+              }
+
+              std::copy(rho + start, rho + start + m_dofs_per_element,
+                  traits::vector_storage(scratch.m_rho_block)
+                  + block_elements*m_dofs_per_element);
+              scratch.m_starts[block_elements] = start;
+
+              if (++block_elements == block_size)
+              {
+                calculate_local_div_block(scratch, block_elements, 
+                    local_div_storage);
+                block_elements = 0;
               }
             }
-            ++pn;
           }
+
+          if (block_elements)
+            calculate_local_div_block(scratch, block_elements, 
+                local_div_storage);
         }
 
         return local_div;
@@ -779,273 +1325,346 @@ namespace pyrticle
 
 
 
-      py_vector calculate_fluxes(
-          depositor_state &ds,
-          const ParticleState &ps,
-          py_vector const &velocities)
+      /** An external element that should become active for a particle
+       * because density flows out of the particle's active elements
+       * into it.
+       */
+      struct element_activation
       {
-        if (m_activation_threshold == 0)
-          throw std::runtime_error("zero activation threshold");
+        particle_number m_particle_number;
+        mesh_data::element_number m_element_number;
 
-        py_vector fluxes(ds.m_rho.size());
-        fluxes.clear();
+        element_activation(particle_number pn, mesh_data::element_number en)
+          : m_particle_number(pn), m_element_number(en)
+        { }
 
-        particle_number pn = 0;
-        BOOST_FOREACH(advected_particle &p, ds.m_advected_particles)
-        {
-          const double shape_peak =
-            p.m_shape_function(
-                boost::numeric::ublas::zero_vector<double>(get_dimensions_mesh()))
-            * ps.charges[pn];
+        bool operator<(const element_activation &other) const
+        { return m_particle_number < other.m_particle_number; }
+      };
 
-          const bounded_vector v = subrange(velocities,
-              ps.vdim()*pn, ps.vdim()*(pn+1));
 
-          for (unsigned i_el = 0; i_el < p.m_elements.size(); ++i_el)
+
+
+      /** Find the outflow faces at which a particle's density exceeds the
+       * activation threshold, in parallel over particles. The result
+       * is ordered by particle, and within a particle by element and face,
+       * so that it does not depend on the thread count.
+       */
+      void find_element_activations(
+          const depositor_state &ds,
+          const ParticleState &ps,
+          py_vector const &velocities,
+          std::vector<element_activation> &activations) const
+      {
+        const active_element_pool &pool(ds.pool());
+        const int particle_count = pool.m_particles.size();
+        const unsigned face_length = m_face_mass_matrix.size1();
+
+#pragma omp parallel num_threads(this->m_thread_count)
+        {
+          std::vector<element_activation> thread_activations;
+
+#pragma omp for schedule(dynamic, 16) nowait
+          for (int pn = 0; pn < particle_count; ++pn)
           {
-            active_element const *el = &p.m_elements[i_el];
+            const advected_particle &p(pool.m_particles[pn]);
 
-            for (hedge::face_number_t fn = 0; fn < m_faces_per_element; ++fn)
-            {
-              const mesh_data::element_number en = el->m_element_info->m_id;
+            const double shape_peak =
+              p.m_shape_function(
+                  boost::numeric::ublas::zero_vector<double>(get_dimensions_mesh()))
+              * ps.charges[pn];
 
-              /* Find correct face instance
-               *
-               * A face_pair represents both sides of a face. It points
-               * to one or two hedge::face instances in its face_group that
-               * carry information about each side of the face.
-               *
-               * The "ext" side of the face_pair may be unpopulated because
-               * of a boundary.
-               *
-               * First, we need to identify which side of the face (en,fn)
-               * identifies, guarding against an unpopulated "ext" side.
-               */
-              bool is_boundary;
-              const face_pair_type::int_side_type *flux_face;
-              const face_pair_type::int_side_type *external_flux_face;
-              hedge::index_lists_t::const_iterator idx_list;
-              hedge::index_lists_t::const_iterator ext_idx_list;
+            const bounded_vector v = subrange(velocities,
+                ps.vdim()*pn, ps.vdim()*(pn+1));
+
+            for (unsigned slot = p.m_first_slot; slot < p.end_slot(); ++slot)
+            {
+              const face_table_entry *el_faces = 
+                &m_face_table[pool.m_element_info[slot]->m_id*m_faces_per_element];
+              const mesh_data::element_number *cnx = pool.connections(slot);
+              const mesh_data::node_number this_base_idx = pool.m_start_index[slot];
 
+              for (hedge::face_number_t fn = 0; fn < m_faces_per_element; ++fn)
               {
-                const face_pair_locator &fp_locator = map_get(
-                    m_el_face_to_face_pair_locator,
-                    std::make_pair(en, fn));
+                // invalid faces are reported by the flux calculation
+                const face_table_entry &fte(el_faces[fn]);
+                if (!fte.m_is_valid || fte.m_is_boundary
+                    || cnx[fn] != mesh_data::INVALID_ELEMENT
+                    || inner_prod(v, fte.m_normal) <= 0)
+                  continue;
 
-                const face_group_type &fg(*fp_locator.m_face_group);
-                const face_pair_type &fp(*fp_locator.m_face_pair);
+                double max_density = 0;
+                for (unsigned i = 0; i < face_length; i++)
+                  max_density = std::max(max_density,
+                      fabs(ds.m_rho[this_base_idx+fte.m_index_list[i]]));
 
-                const face_pair_type::int_side_type &flux_face_a = fp.int_side;
+                if (max_density > m_activation_threshold*fabs(shape_peak))
+                  thread_activations.push_back(
+                      element_activation(pn, fte.m_neighbor));
+              }
+            }
+          }
 
-                const bool is_face_b = en != flux_face_a.element_id;
+#pragma omp critical (adv_element_activations)
+          activations.insert(activations.end(),
+              thread_activations.begin(), thread_activations.end());
+        }
 
-                is_boundary =
-                  fp.ext_side.element_id == hedge::INVALID_ELEMENT;
+        // each particle was handled by a single thread, so this restores
+        // the serial order
+        std::stable_sort(activations.begin(), activations.end());
+      }
 
-                const face_pair_type::ext_side_type *flux_face_b = &fp.ext_side;
 
-                if (is_boundary && is_face_b)
-                  throw std::runtime_error("looking for non-existant cross-boundary element");
 
-                if (is_face_b && en != flux_face_b->element_id)
-                  throw std::runtime_error("el/face lookup failed");
 
-                flux_face = is_face_b ? flux_face_b : &flux_face_a;
-                external_flux_face = is_face_b ? &flux_face_a : flux_face_b;
+      /** Activate the elements found by find_element_activations().
+       * This allocates state vector space and changes the element
+       * structure, so it runs serially.
+       */
+      void activate_elements(depositor_state &ds, 
+          const std::vector<element_activation> &activations)
+      {
+        if (activations.empty())
+          return;
 
-                idx_list = fg.index_list(flux_face->face_index_list_number);
-                ext_idx_list = fg.index_list(external_flux_face->face_index_list_number);
-              }
+        active_element_pool &pool(ds.writable_pool());
 
-              // Find information about this face
-              const double n_dot_v = inner_prod(v, flux_face->normal);
-              const bool inflow = n_dot_v <= 0;
-              bool active = el->m_connections[fn] != mesh_data::INVALID_ELEMENT;
-
-              if (is_boundary && active)
-                throw std::runtime_error("detected boundary non-connection as active");
-
-              const double int_coeff =
-                flux_face->face_jacobian*(-n_dot_v)*(
-                    m_upwind_alpha*(1 - (inflow ? 0 : 1))
-                    +
-                    (1-m_upwind_alpha)*0.5);
-              const double ext_coeff =
-                flux_face->face_jacobian*(-n_dot_v)*(
-                    m_upwind_alpha*-(inflow ? 1 : 0)
-                    +
-                    (1-m_upwind_alpha)*-0.5);
-
-              const mesh_data::node_number this_base_idx = el->m_start_index;
-
-              // activate outflow, if necessary -----------------------------
-              if (!is_boundary && !active && !inflow)
-              {
-                const unsigned face_length = m_face_mass_matrix.size1();
+        BOOST_FOREACH(const element_activation &act, activations)
+        {
+          const particle_number pn = act.m_particle_number;
+          const mesh_data::element_number ext_en = act.m_element_number;
 
-                double max_density = 0;
-                for (unsigned i = 0; i < face_length; i++)
-                  max_density = std::max(max_density,
-                      fabs(ds.m_rho[this_base_idx+idx_list[i]]));
+          // several active elements may have asked for the same one
+          if (pool.find_slot(pn, ext_en) != slot_index::invalid_slot())
+            continue;
 
-                // std::cout << max_density << ' ' << shape_peak << std::endl;
-                if (max_density > m_activation_threshold*fabs(shape_peak))
-                {
-                  // yes, activate the external element
+          const mesh_data::element_info &ext_einfo(
+              m_mesh_data.m_element_info[ext_en]);
 
-                  const hedge::element_number_t ext_en = external_flux_face->element_id;
+          unsigned start = allocate_element(ds);
+          subrange(ds.m_rho, start, start+m_dofs_per_element) =
+            boost::numeric::ublas::zero_vector<double>(m_dofs_per_element);
 
-                  const mesh_data::element_info &ext_einfo(
-                      m_mesh_data.m_element_info[ext_en]);
+          const unsigned ext_slot = pool.add_element(
+              pn, ext_einfo, start, /*min_life*/ 10);
 
-                  active_element ext_element;
-                  ext_element.m_element_info = &ext_einfo;
+          // update connections
+          hedge::face_number_t ext_fn = 0;
+          BOOST_FOREACH(const mesh_data::face_info &ext_face, ext_einfo.m_faces)
+          {
+            const hedge::element_number_t ext_neigh_en = ext_face.m_neighbor;
+            const unsigned ext_neigh_slot = pool.find_slot(pn, ext_neigh_en);
+            if (ext_neigh_slot != slot_index::invalid_slot() 
+                && ext_neigh_slot != ext_slot)
+            {
+              /* We found an active neighbor of our "external" element.
+               *
+               * Notation:
+               *        *
+               *       / \
+               *      /ext_neigh
+               *     *-----*
+               *    / \ext/
+               *   / el\ /
+               *  *-----*
+               *
+               * el: The element whose outflow asked for the activation.
+               * ext: The "external" element that we just activated.
+               * ext_neigh: Neighbor of ext, also part of this
+               *   advected_particle
+               */
 
-                  unsigned start = ext_element.m_start_index = allocate_element(ds);
-                  subrange(ds.m_rho, start, start+m_dofs_per_element) =
-                    boost::numeric::ublas::zero_vector<double>(m_dofs_per_element);
+               // First, tell ext that ext_neigh exists.
+              pool.connections(ext_slot)[ext_fn] = ext_neigh_en;
 
-                  if (ds.m_rho.size() != fluxes.size())
-                  {
-                    // allocate_element enlarged the size of the state vector
-                    // fluxes needs to be changed as well.
-                    py_vector new_fluxes(ds.m_rho.size());
-                    new_fluxes.clear();
-                    noalias(subrange(new_fluxes, 0, fluxes.size())) = fluxes;
-                    fluxes.swap(new_fluxes);
-                  }
+              // Next, tell ext_neigh that ext exists.
+              const mesh_data::element_info &ext_neigh_einfo(
+                  m_mesh_data.m_element_info[ext_neigh_en]);
 
-                  ext_element.m_min_life = 10;
+              mesh_data::face_number ext_index_in_ext_neigh = 0;
+              for (;ext_index_in_ext_neigh < ext_neigh_einfo.m_faces.size()
+                  ;++ext_index_in_ext_neigh)
+                if (ext_neigh_einfo.m_faces[ext_index_in_ext_neigh].m_neighbor
+                    == ext_en)
+                  break;
 
-                  // update connections
-                  hedge::face_number_t ext_fn = 0;
-                  BOOST_FOREACH(const mesh_data::face_info &ext_face, ext_einfo.m_faces)
-                  {
-                    const hedge::element_number_t ext_neigh_en = ext_face.m_neighbor;
-                    active_element *ext_neigh_el = p.find_element(ext_neigh_en);
-                    if (ext_neigh_el)
-                    {
-                      /* We found an active neighbor of our "external" element.
-                       *
-                       * Notation:
-                       *        *
-                       *       / \
-                       *      /ext_neigh
-                       *     *-----*
-                       *    / \ext/
-                       *   / el\ /
-                       *  *-----*
-                       *
-                       * el: The element currently under consideration in the
-                       *   "big" loop.
-                       * ext: The "external" element that we just decided to
-                       *   activate.
-                       * ext_neigh: Neighbor of ext, also part of this
-                       *   advected_particle
-                       */
-
-                       // First, tell ext that ext_neigh exists.
-                      ext_element.m_connections[ext_fn] = ext_neigh_en;
-
-                      // Next, tell ext_neigh that ext exists.
-                      const mesh_data::element_info &ext_neigh_einfo(
-                          m_mesh_data.m_element_info[ext_neigh_en]);
-
-                      mesh_data::face_number ext_index_in_ext_neigh = 0;
-                      for (;ext_index_in_ext_neigh < ext_neigh_einfo.m_faces.size()
-                          ;++ext_index_in_ext_neigh)
-                        if (ext_neigh_einfo.m_faces[ext_index_in_ext_neigh].m_neighbor
-                            == ext_en)
-                          break;
-
-                      if (ext_index_in_ext_neigh == ext_neigh_einfo.m_faces.size())
-                        throw std::runtime_error("ext not found in ext_neigh");
-
-                      ext_neigh_el->m_connections[ext_index_in_ext_neigh] = ext_en;
-                    }
-
-                    ++ext_fn;
-                  }
+              if (ext_index_in_ext_neigh == ext_neigh_einfo.m_faces.size())
+                throw std::runtime_error("ext not found in ext_neigh");
 
-                  p.m_elements.push_back(ext_element);
+              pool.connections(ext_neigh_slot)[ext_index_in_ext_neigh] = ext_en;
+            }
 
-                  // modification of m_elements might have invalidated el,
-                  // refresh it
+            ++ext_fn;
+          }
+        }
+      }
 
-                  el = &p.m_elements[i_el];
 
-                  active = true;
-                }
-              }
 
-              // treat fluxes between active elements -----------------------
-              if (active)
-              {
-                const active_element *ext_el = p.find_element(el->m_connections[fn]);
-                const mesh_data::node_number ext_base_idx = ext_el->m_start_index;
 
-                if (ext_el == 0)
-                {
-                  dump_particle(p);
-                  throw std::runtime_error(
-                      boost::str(boost::format("external element %d of (el:%d,face:%d) for active connection not found")
-                      % el->m_connections[fn] % en % fn).c_str());
-                }
+      void add_particle_fluxes(
+          const depositor_state &ds,
+          const ParticleState &ps,
+          py_vector const &velocities,
+          particle_number pn,
+          py_vector &fluxes) const
+      {
+        const active_element_pool &pool(ds.pool());
+        const advected_particle &p(pool.m_particles[pn]);
 
-                const unsigned face_length = m_face_mass_matrix.size1();
+        const bounded_vector v = subrange(velocities,
+            ps.vdim()*pn, ps.vdim()*(pn+1));
 
-                for (unsigned i = 0; i < face_length; i++)
-                {
-                  const int ili = this_base_idx+idx_list[i];
+        const unsigned face_length = m_face_mass_matrix.size1();
 
-                  hedge::index_lists_t::const_iterator ilj_iterator = idx_list;
-                  hedge::index_lists_t::const_iterator oilj_iterator = ext_idx_list;
+        for (unsigned slot = p.m_first_slot; slot < p.end_slot(); ++slot)
+        {
+          const mesh_data::element_number en = pool.m_element_info[slot]->m_id;
+          const face_table_entry *el_faces = 
+            &m_face_table[en*m_faces_per_element];
+          const mesh_data::node_number this_base_idx = pool.m_start_index[slot];
 
-                  double res_ili_addition = 0;
+          for (hedge::face_number_t fn = 0; fn < m_faces_per_element; ++fn)
+          {
+            const face_table_entry &fte(el_faces[fn]);
+            if (!fte.m_is_valid)
+              throw std::runtime_error("el/face lookup failed");
+
+            const hedge::index_lists_t::const_iterator idx_list = 
+              fte.m_index_list;
+            const hedge::index_lists_t::const_iterator ext_idx_list = 
+              fte.m_ext_index_list;
+
+            // Find information about this face
+            const double n_dot_v = inner_prod(v, fte.m_normal);
+            const bool inflow = n_dot_v <= 0;
+            const mesh_data::element_number connected_en = 
+              pool.connections(slot)[fn];
+            const bool active = connected_en != mesh_data::INVALID_ELEMENT;
+
+            if (fte.m_is_boundary && active)
+              throw std::runtime_error("detected boundary non-connection as active");
+
+            const double int_coeff =
+              fte.m_face_jacobian*(-n_dot_v)*(
+                  m_upwind_alpha*(1 - (inflow ? 0 : 1))
+                  +
+                  (1-m_upwind_alpha)*0.5);
+            const double ext_coeff =
+              fte.m_face_jacobian*(-n_dot_v)*(
+                  m_upwind_alpha*-(inflow ? 1 : 0)
+                  +
+                  (1-m_upwind_alpha)*-0.5);
+
+            // treat fluxes between active elements -------------------------
+            if (active)
+            {
+              const unsigned ext_slot = pool.find_slot(pn, connected_en);
 
-                  for (unsigned j = 0; j < face_length; j++)
-                  {
-                    const double fmm_entry = m_face_mass_matrix(i, j);
+              if (ext_slot == slot_index::invalid_slot())
+              {
+                dump_particle(pool, pn);
+                throw std::runtime_error(
+                    boost::str(boost::format("external element %d of (el:%d,face:%d) for active connection not found")
+                    % connected_en % en % fn).c_str());
+              }
 
-                    const int ilj = this_base_idx+*ilj_iterator++;
-                    const int oilj = ext_base_idx+*oilj_iterator++;
+              const mesh_data::node_number ext_base_idx = pool.m_start_index[ext_slot];
 
-                    res_ili_addition +=
-                      ds.m_rho[ilj]*int_coeff*fmm_entry
-                      +ds.m_rho[oilj]*ext_coeff*fmm_entry;
-                  }
+              for (unsigned i = 0; i < face_length; i++)
+              {
+                const int ili = this_base_idx+idx_list[i];
+
+                hedge::index_lists_t::const_iterator ilj_iterator = idx_list;
+                hedge::index_lists_t::const_iterator oilj_iterator = ext_idx_list;
+
+                double res_ili_addition = 0;
 
-                  fluxes[ili] += res_ili_addition;
+                for (unsigned j = 0; j < face_length; j++)
+                {
+                  const double fmm_entry = m_face_mass_matrix(i, j);
+
+                  const int ilj = this_base_idx+*ilj_iterator++;
+                  const int oilj = ext_base_idx+*oilj_iterator++;
+
+                  res_ili_addition +=
+                    ds.m_rho[ilj]*int_coeff*fmm_entry
+                    +ds.m_rho[oilj]*ext_coeff*fmm_entry;
                 }
+
+                fluxes[ili] += res_ili_addition;
               }
+            }
 
-              // handle zero inflow from inactive neighbors -----------------
-              else if (inflow)
+            // handle zero inflow from inactive neighbors -------------------
+            else if (inflow)
+            {
+              for (unsigned i = 0; i < face_length; i++)
               {
-                const unsigned face_length = m_face_mass_matrix.size1();
+                const int ili = this_base_idx+idx_list[i];
 
-                for (unsigned i = 0; i < face_length; i++)
-                {
-                  const int ili = this_base_idx+idx_list[i];
-
-                  hedge::index_lists_t::const_iterator ilj_iterator = idx_list;
+                hedge::index_lists_t::const_iterator ilj_iterator = idx_list;
 
-                  double res_ili_addition = 0;
+                double res_ili_addition = 0;
 
-                  for (unsigned j = 0; j < face_length; j++)
-                    res_ili_addition += ds.m_rho[this_base_idx+*ilj_iterator++]
-                      *int_coeff
-                      *m_face_mass_matrix(i, j);
+                for (unsigned j = 0; j < face_length; j++)
+                  res_ili_addition += ds.m_rho[this_base_idx+*ilj_iterator++]
+                    *int_coeff
+                    *m_face_mass_matrix(i, j);
 
-                  fluxes[ili] += res_ili_addition;
-                }
+                fluxes[ili] += res_ili_addition;
               }
             }
+          }
+        }
+      }
+
 
+
+
+      /** Activation happens in three phases: the elements to be activated
+       * are found in parallel, then activated serially (since that 
+       * allocates state vector space), and then the fluxes are computed
+       * in parallel on the final element structure. Each particle only
+       * writes to the fluxes of its own elements.
+       */
+      py_vector calculate_fluxes(
+          depositor_state &ds,
+          const ParticleState &ps,
+          py_vector const &velocities)
+      {
+        if (m_activation_threshold == 0)
+          throw std::runtime_error("zero activation threshold");
+
+        std::vector<element_activation> activations;
+        find_element_activations(ds, ps, velocities, activations);
+        activate_elements(ds, activations);
+
+        py_vector fluxes(ds.m_rho.size());
+        fluxes.clear();
+
+        const int particle_count = ds.pool().m_particles.size();
+        std::string error;
+
+#pragma omp parallel for schedule(dynamic, 16) num_threads(this->m_thread_count)
+        for (int pn = 0; pn < particle_count; ++pn)
+        {
+          try
+          {
+            add_particle_fluxes(ds, ps, velocities, pn, fluxes);
+          }
+          catch (std::exception &e)
+          {
+#pragma omp critical (adv_flux_error)
+            if (error.empty())
+              error = e.what();
           }
-          ++pn;
         }
 
+        if (!error.empty())
+          throw std::runtime_error(error);
+
         return fluxes;
       }
 
@@ -1063,34 +1682,30 @@ namespace pyrticle
           ds.m_active_elements + ds.m_freelist.size();
 
         using namespace boost::numeric::bindings;
-        using blas::detail::gemm;
 
-        const dyn_fortran_matrix &matrix = m_inverse_mass_matrix;
-        gemm(
+        apply_elementwise_matrix(
             'T', // "matrix" is row-major
-            'N', // a contiguous array of vectors is column-major
-            matrix.size1(),
-            active_contiguous_elements,
-            matrix.size2(),
-            /*alpha*/ 1,
-            /*a*/ traits::matrix_storage(matrix),
-            /*lda*/ matrix.size2(),
-            /*b*/ traits::vector_storage(operand),
-            /*ldb*/ m_dofs_per_element,
-            /*beta*/ 1,
-            /*c*/ traits::vector_storage(result),
-            /*ldc*/ m_dofs_per_element
-            );
+            m_inverse_mass_matrix,
+            traits::vector_storage(operand),
+            traits::vector_storage(result),
+            active_contiguous_elements);
 
         // perform jacobian scaling
-        BOOST_FOREACH(const advected_particle &p, ds.m_advected_particles)
-          BOOST_FOREACH(const active_element &el, p.m_elements)
+        const active_element_pool &pool(ds.pool());
+        const int particle_count = pool.m_particles.size();
+
+#pragma omp parallel for schedule(dynamic, 16) num_threads(this->m_thread_count)
+        for (int pn = 0; pn < particle_count; ++pn)
+        {
+          const advected_particle &p(pool.m_particles[pn]);
+          for (unsigned slot = p.m_first_slot; slot < p.end_slot(); ++slot)
           {
             subrange(result,
-                el.m_start_index,
-                el.m_start_index+m_dofs_per_element) *=
-            1/el.m_element_info->m_jacobian;
+                pool.m_start_index[slot],
+                pool.m_start_index[slot]+m_dofs_per_element) *=
+            1/pool.m_element_info[slot]->m_jacobian;
           }
+        }
 
         return result;
       }
@@ -1123,31 +1738,19 @@ namespace pyrticle
         if (m_filter_matrix.size1() && m_filter_matrix.size2())
         {
           using namespace boost::numeric::bindings;
-          using blas::detail::gemm;
 
           const unsigned active_contiguous_elements =
             ds.m_active_elements + ds.m_freelist.size();
 
-          const dyn_fortran_matrix &matrix = m_filter_matrix;
-
           dyn_vector new_rho(ds.m_rho.size());
-          new_rho.size();
+          new_rho.clear();
 
-          gemm(
+          apply_elementwise_matrix(
               'N',
-              'N', // a contiguous array of vectors is column-major
-              matrix.size1(),
-              active_contiguous_elements,
-              matrix.size2(),
-              /*alpha*/ 1,
-              /*a*/ traits::matrix_storage(matrix),
-              /*lda*/ matrix.size2(),
-              /*b*/ traits::vector_storage(rhs),
-              /*ldb*/ m_dofs_per_element,
-              /*beta*/ 1,
-              /*c*/ traits::vector_storage(new_rho),
-              /*ldc*/ m_dofs_per_element
-              );
+              m_filter_matrix,
+              traits::vector_storage(rhs),
+              traits::vector_storage(new_rho),
+              active_contiguous_elements);
           return new depositor_state(ds, new_rho, rho_dof_sl);
         }
         else
@@ -35,11 +35,15 @@
 #include <boost/numeric/ublas/banded.hpp>
 #include <boost/numeric/ublas/io.hpp>
 #include <boost/numeric/bindings/traits/ublas_matrix.hpp>
+#include <boost/numeric/bindings/traits/ublas_vector.hpp>
 #include <boost/numeric/bindings/lapack/gesvd.hpp>
 #include <boost/numeric/bindings/lapack/gesdd.hpp>
 #include <boost/numeric/bindings/blas/blas2.hpp>
+#include <boost/numeric/bindings/blas/blas3.hpp>
 #include <pyublas/elementwise_op.hpp>
 #include "dep_shape.hpp"
+#include "monomial.hpp"
+#include "binary_io.hpp"
 #include "grid.hpp"
 #include "dep_grid_base.hpp"
 
@@ -66,6 +70,52 @@ namespace pyrticle
 
 
 
+  /** What grid_depositor::prepare_elements_on_grid() needs to know
+   * about one of hedge's local discretizations.
+   */
+  struct grid_local_discretization
+  {
+    /** Monomials spanning the local polynomial space, which allow
+     * evaluating the modal basis at arbitrary unit points. */
+    local_monomial_discretization m_monomials;
+
+    /** The modal Vandermonde matrix, of size #nodes x #modes. */
+    py_matrix m_vandermonde;
+
+    /** The total polynomial degree of each mode, as used by
+     * basis reduction. */
+    std::vector<unsigned> m_mode_degrees;
+
+    /** A nodal filter applied to the interpolation matrix, if nonempty. */
+    py_matrix m_filter_matrix;
+  };
+
+
+
+
+  /** Diagnostics on the preparation of one element_on_grid. */
+  struct element_preparation_info
+  {
+    /** The number of structured points found before any regularization. */
+    unsigned m_original_point_count;
+    /** The number of modes used in the interpolation matrix. */
+    unsigned m_mode_count;
+    /** The condition number of the scaled structured Vandermonde matrix. */
+    double m_condition;
+    /** The Frobenius norm of pinv(vdm)*vdm - I. */
+    double m_pinv_residual;
+    /** Whether the submethod managed to regularize the Vandermonde matrix. */
+    bool m_regularized;
+
+    element_preparation_info()
+      : m_original_point_count(0), m_mode_count(0),
+      m_condition(0), m_pinv_residual(0), m_regularized(true)
+    { }
+  };
+
+
+
+
   template <class ParticleState, class ShapeFunction, class Brick>
   struct grid_depositor : 
     public grid_targets, 
@@ -85,7 +135,6 @@ namespace pyrticle
 
       // member data --------------------------------------------------------
       std::vector<element_on_grid> m_elements_on_grid;
-      mutable unsigned m_max_el_grid_values;
 
       /** Each brick may have a number of "extra" points to resolve
        * situations where the structured nodes situated on an element
@@ -105,6 +154,18 @@ namespace pyrticle
       dyn_vector m_extra_points;
       std::vector<npy_uint32> m_extra_point_brick_starts;
 
+      /** The extra points, binned into the brick cells containing them:
+       * m_extra_point_cell_points[m_extra_point_cell_starts[gnn]]
+       * up to (but not including) 
+       * m_extra_point_cell_points[m_extra_point_cell_starts[gnn+1]]
+       * are the indices of the extra points in the cell of grid node gnn.
+       *
+       * Built from the above by update_extra_point_index().
+       */
+      std::vector<unsigned> m_extra_point_cell_starts;
+      std::vector<unsigned> m_extra_point_cell_points;
+      unsigned m_indexed_extra_point_count;
+
       /** Average groups for continuity enforcement. 
        *
        * For each averaging group consisting of node indices,
@@ -116,13 +177,86 @@ namespace pyrticle
       std::vector<mesh_data::node_number> m_average_groups;
       std::vector<npy_uint32> m_average_group_starts;
 
+      /** Indices into m_elements_on_grid, ordered so that elements with
+       * equal interpolation matrix shapes are adjacent. The group of
+       * equal shapes starting at m_remap_order[m_remap_group_starts[i]]
+       * ends at m_remap_order[m_remap_group_starts[i+1]].
+       *
+       * Built by prepare_remap().
+       */
+      std::vector<unsigned> m_remap_order;
+      std::vector<unsigned> m_remap_group_starts;
+
+      /** Whether no two entries of m_elements_on_grid belong to the same
+       * mesh element (which the brick submethod may produce), so that 
+       * they may be remapped in parallel without writing the same mesh 
+       * nodes. Built by prepare_remap().
+       */
+      bool m_remap_elements_distinct;
+
+      /** The tiles (in the sense of tiled_grid_vector) that each remap
+       * step reads from, so that it may be skipped if none of them was 
+       * touched by deposition. Those of element_on_grid i are
+       * m_eog_tiles[m_eog_tile_starts[i]] up to (but not including)
+       * m_eog_tiles[m_eog_tile_starts[i+1]], likewise for the rows of
+       * mesh element en in the assembled operator.
+       *
+       * Built by prepare_remap() and assemble_remap_operator().
+       */
+      std::vector<unsigned> m_eog_tile_starts;
+      std::vector<unsigned> m_eog_tiles;
+      std::vector<unsigned> m_remap_element_tile_starts;
+      std::vector<unsigned> m_remap_element_tiles;
+
+      /** Grid storage for the mesh-valued deposition entry points. */
+      tiled_grid_vector m_rho_grid;
+      tiled_grid_vector m_j_grid;
+
+      /** Optionally, the entire grid-to-mesh map, including weight
+       * factors and continuity averaging, as one CSR matrix with a row
+       * per mesh node. If present, remap_grid_to_mesh() uses it instead
+       * of the elementwise matrices.
+       *
+       * Built by assemble_remap_operator().
+       */
+      std::vector<unsigned> m_remap_row_starts;
+      std::vector<grid_node_number> m_remap_columns;
+      std::vector<double> m_remap_values;
+
+      /** Likewise, diag(1/w) * inverse_interpolation * interpolation 
+       * * diag(w) - I for each element, as a CSR matrix with a row per 
+       * (element, grid node) pair. Rows are ordered by grid node, those 
+       * of grid node gnn being m_residual_node_row_starts[gnn] up to 
+       * (but not including) m_residual_node_row_starts[gnn+1].
+       */
+      std::vector<unsigned> m_residual_node_row_starts;
+      std::vector<unsigned> m_residual_row_starts;
+      std::vector<grid_node_number> m_residual_columns;
+      std::vector<double> m_residual_values;
+
+      /** Input to prepare_elements_on_grid(): element number en uses
+       * m_local_discretizations[m_ldis_indices[en]].
+       */
+      std::vector<grid_local_discretization> m_local_discretizations;
+      std::vector<unsigned> m_ldis_indices;
+
+      /** Output of prepare_elements_on_grid(), one entry per
+       * element of m_elements_on_grid. */
+      std::vector<element_preparation_info> m_preparation_info;
+
+      /** The bricks m_elements_on_grid was prepared for, so that
+       * update_elements_on_grid() can tell which bricks changed since.
+       */
+      std::vector<brick_type> m_prepared_bricks;
+
 
 
 
 
       // construction -------------------------------------------------------
       grid_depositor(const mesh_data &md)
-        : base_type(md), m_max_el_grid_values(0)
+        : base_type(md), m_indexed_extra_point_count(0),
+        m_remap_elements_distinct(false)
       { }
 
 
@@ -139,15 +273,32 @@ namespace pyrticle
 
 
 
-      py_vector find_points_in_element(element_on_grid &eog, double scaled_tolerance) const
+      /** Grid depositor targets are indexed by grid node number. */
+      std::pair<unsigned, unsigned> target_index_window(
+          grid_node_number grid_start, grid_node_number grid_end) const
+      { return std::make_pair(unsigned(grid_start), unsigned(grid_end)); }
+
+
+
+
+      /** Find all structured points within \c scaled_tolerance of element
+       * \c en, along with their grid node numbers and weights.
+       *
+       * Each point is weighted by the square root of its cell volume,
+       * so that points from high-resolution bricks do not get an unfair 
+       * advantage in the least-squares fit done by the remapping.
+       */
+      void find_element_points(mesh_data::element_number en, 
+          double scaled_tolerance,
+          std::vector<bounded_vector> &points,
+          std::vector<grid_node_number> &grid_nodes,
+          std::vector<double> &weights) const
       {
         const unsigned mdims = this->m_mesh_data.m_dimensions;
         const mesh_data::element_info &el = 
-          this->m_mesh_data.m_element_info[
-          eog.m_element_number];
+          this->m_mesh_data.m_element_info[en];
 
-        bounded_box el_bbox = this->m_mesh_data.element_bounding_box(
-            eog.m_element_number);
+        bounded_box el_bbox = this->m_mesh_data.element_bounding_box(en);
 
         using boost::numeric::ublas::scalar_vector;
         const scalar_vector<double> tolerance_vec(mdims, scaled_tolerance);
@@ -156,8 +307,9 @@ namespace pyrticle
 
         unsigned gnc = grid_node_count_with_extra();
 
-        std::vector<bounded_vector> points;
-        std::vector<double> weights;
+        points.clear();
+        grid_nodes.clear();
+        weights.clear();
 
         // For each element, find all structured points inside the element.
         BOOST_FOREACH(Brick const &brk, this->m_bricks)
@@ -194,13 +346,26 @@ namespace pyrticle
               grid_node_number gni = it.index();
               if (gni >= gnc)
                 throw std::runtime_error("rec_grid: structured point index out of bounds");
-              eog.m_grid_nodes.push_back(gni);
+              grid_nodes.push_back(gni);
               weights.push_back(sqrt(dV));
             }
 
             ++it;
           }
         }
+      }
+
+
+
+
+      py_vector find_points_in_element(element_on_grid &eog, double scaled_tolerance) const
+      {
+        const unsigned mdims = this->m_mesh_data.m_dimensions;
+
+        std::vector<bounded_vector> points;
+        std::vector<double> weights;
+        find_element_points(eog.m_element_number, scaled_tolerance,
+            points, eog.m_grid_nodes, weights);
 
         eog.m_weight_factors.resize(weights.size());
         std::copy(weights.begin(), weights.end(), eog.m_weight_factors.begin());
@@ -215,289 +380,2388 @@ namespace pyrticle
 
 
 
-      // 1 particle + 1 brick -------------------------------------------------
-      template <class Target>
-      bool deposit_particle_on_one_brick(Target tgt, 
-          const Brick &brk, 
-          const bounded_vector &center,
-          const bounded_box &particle_box,
-          double charge,
-          bool *complete = 0) const
+      // preparation ----------------------------------------------------------
+    private:
+      /** A grid_local_discretization, with everything needed during 
+       * preparation copied out of Python-owned storage, so that it may
+       * be used from several threads at once.
+       */
+      struct prepared_local_discretization
       {
-        const bounded_box intersect_box = 
-          brk.bounding_box().intersect(particle_box);
+        const grid_local_discretization *m_ldis;
 
-        if (complete)
-          *complete = intersect_box == particle_box;
+        dyn_fortran_matrix m_vandermonde;
+        dyn_fortran_matrix m_filter_matrix;
 
-        if (intersect_box.is_empty())
-          return false;
+        /** The modal basis, expanded in terms of the monomials:
+         * mode j is sum_k monomial_k * m_mode_coefficients(k, j). */
+        dyn_fortran_matrix m_mode_coefficients;
 
-        const bounded_int_box particle_brick_index_box = 
-          brk.index_range(intersect_box);
+        /** The inverse of the nodal monomial Vandermonde matrix,
+         * of size #monomials x #nodes. */
+        dyn_fortran_matrix m_inverse_monomial_vandermonde;
+
+        unsigned node_count() const
+        { return m_vandermonde.size1(); }
+
+        unsigned mode_count() const
+        { return m_vandermonde.size2(); }
+      };
+
+
+
+
+      /** The outcome of preparing one element, kept free of Python
+       * objects so that elements can be prepared in parallel.
+       */
+      struct element_preparation
+      {
+        std::vector<bounded_vector> m_points;
+        std::vector<grid_node_number> m_grid_nodes;
+        std::vector<double> m_weights;
+
+        /** The last m_extra_point_count entries of the above are extra
+         * points, whose grid node numbers are assigned at the end. */
+        unsigned m_extra_point_count;
+
+        dyn_fortran_matrix m_interpolation_matrix;
+        dyn_fortran_matrix m_inverse_interpolation_matrix;
+        element_preparation_info m_info;
+
+        element_preparation()
+          : m_extra_point_count(0)
+        { }
+      };
+
+
+
+
+      static void prepare_local_discretization(
+          const grid_local_discretization &ldis,
+          prepared_local_discretization &result)
+      {
+        const py_fortran_matrix &inv_vdm_t = 
+          ldis.m_monomials.m_inverse_vandermonde_t;
+
+        const unsigned node_count = ldis.m_vandermonde.size1();
+
+        if (ldis.m_monomials.m_basis.size() != node_count
+            || inv_vdm_t.size1() != node_count
+            || inv_vdm_t.size2() != node_count)
+          throw std::runtime_error("rec_grid: monomial basis does not match "
+              "vandermonde matrix");
+        if (ldis.m_mode_degrees.size() != ldis.m_vandermonde.size2())
+          throw std::runtime_error("rec_grid: wrong number of mode degrees");
+        if (ldis.m_filter_matrix.size1() 
+            && (ldis.m_filter_matrix.size1() != node_count
+              || ldis.m_filter_matrix.size2() != node_count))
+          throw std::runtime_error("rec_grid: filter matrix has wrong size");
+
+        result.m_ldis = &ldis;
+        result.m_vandermonde = ldis.m_vandermonde;
+        result.m_filter_matrix = ldis.m_filter_matrix;
+        result.m_inverse_monomial_vandermonde = trans(inv_vdm_t);
+        result.m_mode_coefficients = prod(
+            result.m_inverse_monomial_vandermonde, result.m_vandermonde);
+      }
+
+
+
+
+      /** The 2-norm of the map from the unit element to \c el, i.e. the 
+       * reciprocal of the smallest singular value of its inverse.
+       */
+      static double element_map_norm(const mesh_data::element_info &el)
+      {
+        namespace lapack = boost::numeric::bindings::lapack;
+
+        dyn_fortran_matrix a(el.m_inverse_map.matrix());
+        const unsigned n = a.size1();
+        dyn_vector s(n);
+        dyn_fortran_matrix u(n, n), vt(n, n);
+
+        if (lapack::gesdd('S', a, s, u, vt) != 0 || s[n-1] == 0)
+          throw std::runtime_error("rec_grid: degenerate element map");
+        return 1/s[n-1];
+      }
+
+
+
+
+      /** Compute the singular value decomposition of \c a, destroying it. 
+       * If \c a has fewer rows than columns, \c vt is the full square 
+       * V^T, so that its trailing rows span the null space of \c a.
+       *
+       * Returns false if LAPACK does not converge.
+       */
+      static bool singular_value_decomposition(dyn_fortran_matrix &a, 
+          dyn_vector &s, dyn_fortran_matrix &u, dyn_fortran_matrix &vt)
+      {
+        namespace lapack = boost::numeric::bindings::lapack;
 
-        typename Brick::iterator it(brk, particle_brick_index_box);
+        const unsigned m = a.size1(), n = a.size2();
+        s.resize(std::min(m, n), false);
 
-        while (!it.at_end())
+        if (m == 0)
         {
-          tgt.add_shape_value(it.index(), 
-              charge*this->m_shape_function(center-it.point()));
-          ++it;
+          vt = boost::numeric::ublas::identity_matrix<double>(n);
+          return true;
         }
+        else if (m < n)
+        {
+          u.resize(m, m, false);
+          vt.resize(n, n, false);
+          return lapack::gesdd('A', a, s, u, vt) == 0;
+        }
+        else
+        {
+          u.resize(m, n, false);
+          vt.resize(n, n, false);
+          return lapack::gesdd('S', a, s, u, vt) == 0;
+        }
+      }
 
-        // now treat extra points for this brick
-        const unsigned extra_stop 
-          = m_extra_point_brick_starts[brk.number()+1];
-        const grid_node_number fep = m_first_extra_point;
-        const unsigned mdim = this->m_mesh_data.m_dimensions;
 
-        for (unsigned extra_i = m_extra_point_brick_starts[brk.number()];
-            extra_i < extra_stop; ++extra_i)
-          tgt.add_shape_value(fep+extra_i, 
-              charge*this->m_shape_function(
-                center-subrange(
-                  m_extra_points, 
-                  extra_i*mdim,
-                  (extra_i+1)*mdim)));
-        
-        return true;
+
+
+      /** Singular values below this are considered zero. */
+      static double singular_value_threshold(const dyn_vector &s,
+          const dyn_fortran_matrix &a)
+      {
+        return std::numeric_limits<double>::epsilon()
+          * std::max(a.size1(), a.size2()) * s[0];
       }
 
 
 
 
-      // other stuff ----------------------------------------------------------
-      void remap_grid_to_mesh(const py_vector from, py_vector to, 
-          const unsigned offset=0, const unsigned increment=1) const
+      /** Evaluate the monomials at the points of \c prep, with each row
+       * scaled by the corresponding weight, giving a matrix of size 
+       * #points x #monomials.
+       */
+      void evaluate_weighted_monomials(
+          const mesh_data::element_info &el,
+          const prepared_local_discretization &pldis,
+          const element_preparation &prep,
+          dyn_fortran_matrix &result) const
       {
-        const py_vector::const_iterator from_it = from.begin();
+        const std::vector<monomial_basis_function> &basis = 
+          pldis.m_ldis->m_monomials.m_basis;
 
-        if (m_max_el_grid_values == 0)
+        result.resize(prep.m_points.size(), basis.size(), false);
+        for (unsigned i = 0; i < prep.m_points.size(); ++i)
         {
-          BOOST_FOREACH(const element_on_grid &eog, m_elements_on_grid)
-            m_max_el_grid_values = std::max<unsigned>(
-                m_max_el_grid_values,
-                eog.m_grid_nodes.size());
+          const bounded_vector unit_pt = el.m_inverse_map(prep.m_points[i]);
+          for (unsigned k = 0; k < basis.size(); ++k)
+            result(i, k) = prep.m_weights[i] * basis[k](unit_pt);
         }
+      }
 
-        dyn_vector grid_values(m_max_el_grid_values);
 
-        BOOST_FOREACH(const element_on_grid &eog, m_elements_on_grid)
+
+
+      /** The remapping procedure relies on a pseudoinverse minimizing the
+       * pointwise error on all found interpolation points. But if an 
+       * element spans bricks with different resolution, the high-res 
+       * points get an unfair advantage, because there's so many more 
+       * of them. Therefore, each row of the structured Vandermonde matrix
+       * is scaled by its point's weight, as found by find_element_points().
+       *
+       * This computes that scaled Vandermonde matrix for the given
+       * \c modes from the output of evaluate_weighted_monomials().
+       */
+      static void scaled_vandermonde(
+          const prepared_local_discretization &pldis,
+          const std::vector<unsigned> &modes,
+          const dyn_fortran_matrix &monomial_values,
+          dyn_fortran_matrix &result)
+      {
+        using boost::numeric::ublas::column;
+
+        result.resize(monomial_values.size1(), modes.size(), false);
+        for (unsigned j = 0; j < modes.size(); ++j)
+          column(result, j) = prod(monomial_values,
+              column(pldis.m_mode_coefficients, modes[j]));
+      }
+
+
+
+
+      /** Build the interpolation matrices for \c prep from the pseudoinverse
+       * of \c scaled_vdm, given its SVD.
+       */
+      void make_pointwise_interpolation_matrix(
+          mesh_data::element_number en,
+          const prepared_local_discretization &pldis,
+          const std::vector<unsigned> &modes,
+          const dyn_fortran_matrix &monomial_values,
+          const dyn_fortran_matrix &scaled_vdm,
+          const dyn_vector &s, 
+          const dyn_fortran_matrix &u, 
+          const dyn_fortran_matrix &vt,
+          element_preparation &prep) const
+      {
+        using boost::numeric::ublas::column;
+        using boost::numeric::ublas::row;
+        using boost::numeric::ublas::zero_matrix;
+        using boost::numeric::ublas::identity_matrix;
+
+        const unsigned mode_count = modes.size();
+
+        // compute the pseudoinverse of the structured Vandermonde matrix
+        dyn_fortran_matrix svdm_pinv = 
+          zero_matrix<double>(mode_count, scaled_vdm.size1());
+
+        if (s.size())
         {
-          const mesh_data::element_info &el = 
-            this->m_mesh_data.m_element_info[eog.m_element_number];
+          const double thresh = singular_value_threshold(s, scaled_vdm);
+          for (unsigned i = 0; i < s.size(); ++i)
+            if (fabs(s[i]) >= thresh)
+              svdm_pinv += outer_prod(row(vt, i) / s[i], column(u, i));
+        }
 
-          // pick values off the grid
-          const py_vector::const_iterator weights = eog.m_weight_factors.begin();
+        // check that it's reasonable
+        dyn_fortran_matrix pinv_check = prod(svdm_pinv, scaled_vdm);
+        pinv_check -= identity_matrix<double>(mode_count);
+        prep.m_info.m_pinv_residual = norm_frobenius(pinv_check);
 
-          bool had_nonzero = false;
-          for (unsigned i = 0; i < eog.m_grid_nodes.size(); ++i)
-          {
-            double w = weights[i]
-              * from_it[offset + eog.m_grid_nodes[i]*increment];
-            grid_values[i] = w;
+        prep.m_info.m_mode_count = mode_count;
+        prep.m_info.m_condition = s.size() 
+          ? s[0]/s[s.size()-1] 
+          : std::numeric_limits<double>::infinity();
 
-            if (w)
-              had_nonzero = true;
-          }
+        dyn_fortran_matrix el_vdm(pldis.node_count(), mode_count);
+        for (unsigned j = 0; j < mode_count; ++j)
+          column(el_vdm, j) = column(pldis.m_vandermonde, modes[j]);
 
-          // and apply the interpolation matrix
-          if (had_nonzero)
-          {
-            const dyn_fortran_matrix &matrix = eog.m_interpolation_matrix;
-            using namespace boost::numeric::bindings;
-            using blas::detail::gemv;
-            gemv(
-                'N',
-                matrix.size1(),
-                matrix.size2(),
-                /*alpha*/ 1,
-                traits::matrix_storage(matrix),
-                traits::leading_dimension(matrix),
-
-                traits::vector_storage(grid_values), /*incx*/ 1,
-
-                /*beta*/ 1,
-                traits::vector_storage(to) + el.m_start*increment + offset, 
-                /*incy*/ increment);
-          }
+        prep.m_interpolation_matrix = prod(el_vdm, svdm_pinv);
+
+        if (pldis.m_filter_matrix.size1())
+        {
+          const dyn_fortran_matrix unfiltered = prep.m_interpolation_matrix;
+          prep.m_interpolation_matrix = prod(pldis.m_filter_matrix, unfiltered);
         }
 
-        // cross-element continuity enforcement
-        const py_vector::iterator to_it = to.begin() + offset;
+        const dyn_fortran_matrix &imat = prep.m_interpolation_matrix;
+        for (unsigned i = 0; i < imat.size1(); ++i)
+          for (unsigned j = 0; j < imat.size2(); ++j)
+            if (std::isnan(imat(i, j)) || std::isinf(imat(i, j)))
+              throw std::runtime_error(str(boost::format(
+                      "rec_grid: encountered NaN or infinity in element %d's "
+                      "interpolation matrix") % en));
+
+        // With the full basis, the scaled Vandermonde matrix times the
+        // inverse of the nodal one is simply the nodal basis evaluated 
+        // at the (weighted) points.
+        if (mode_count == pldis.mode_count())
+          prep.m_inverse_interpolation_matrix = prod(
+              monomial_values, pldis.m_inverse_monomial_vandermonde);
+        else
+          prep.m_inverse_interpolation_matrix.resize(0, 0, false);
+      }
+
+
+
+
+      static std::vector<unsigned> all_modes(
+          const prepared_local_discretization &pldis)
+      {
+        std::vector<unsigned> result(pldis.mode_count());
+        for (unsigned i = 0; i < result.size(); ++i)
+          result[i] = i;
+        return result;
+      }
+
+
+
+
+      /** If the structured Vandermonde matrix is singular, add "extra 
+       * points" to prevent that, at most \c max_extra_points of them.
+       */
+      void prepare_with_extra_points(
+          mesh_data::element_number en,
+          const prepared_local_discretization &pldis,
+          double scaled_tolerance, unsigned max_extra_points,
+          element_preparation &prep) const
+      {
+        using boost::numeric::ublas::row;
+
+        const mesh_data::element_info &el = 
+          this->m_mesh_data.m_element_info[en];
+        const std::vector<unsigned> modes = all_modes(pldis);
 
-        std::vector<npy_uint32>::const_iterator 
-          ag_starts_first = m_average_group_starts.begin(),
-          ag_starts_last = m_average_group_starts.end();
+        find_element_points(en, scaled_tolerance, 
+            prep.m_points, prep.m_grid_nodes, prep.m_weights);
+        prep.m_info.m_original_point_count = prep.m_points.size();
 
-        npy_uint32 ag_start = 0;
-        npy_uint32 ag_end = *ag_starts_first++;
+        dyn_fortran_matrix monomial_values, scaled_vdm, a, u, vt;
+        dyn_vector s;
 
         while (true)
         {
-          double avg = 0;
-          const std::pair<
-            std::vector<mesh_data::node_number>::const_iterator,
-            std::vector<mesh_data::node_number>::const_iterator
-            > ag_range(
-              m_average_groups.begin()+ag_start,
-              m_average_groups.begin()+ag_end);
-          BOOST_FOREACH(mesh_data::node_number nn, ag_range)
-            avg += to_it[nn*increment];
-          avg /= (ag_end-ag_start);
-
-          BOOST_FOREACH(mesh_data::node_number nn, ag_range)
-            to_it[nn*increment] = avg;
-
-          if (ag_starts_first == ag_starts_last)
+          evaluate_weighted_monomials(el, pldis, prep, monomial_values);
+          scaled_vandermonde(pldis, modes, monomial_values, scaled_vdm);
+
+          a = scaled_vdm;
+          if (!singular_value_decomposition(a, s, u, vt))
+            throw std::runtime_error(str(boost::format(
+                    "rec_grid: SVD did not converge on element %d") % en));
+
+          unsigned zero_index;
+          if (prep.m_points.size() >= pldis.node_count())
+          {
+            // theoretically enough points found
+            const double thresh = singular_value_threshold(s, scaled_vdm);
+            zero_index = 0;
+            while (zero_index < s.size() && fabs(s[zero_index]) >= thresh)
+              ++zero_index;
+
+            if (zero_index == s.size())
+              break;
+          }
+          else
+            // the first row of vt spanning the null space
+            zero_index = s.size();
+
+          if (prep.m_extra_point_count == max_extra_points)
+          {
+            prep.m_info.m_regularized = false;
             break;
+          }
 
-          ag_start = ag_end;
-          ag_end = *ag_starts_first++;
+          // Getting here means that a mode maps to zero on the 
+          // structured grid. Add the element node at which that
+          // mode is largest as an extra point.
+          const dyn_vector zeroed_mode_nodal = prod(
+              pldis.m_vandermonde, row(vt, zero_index));
+          const unsigned max_node_idx = index_norm_inf(zeroed_mode_nodal);
+
+          prep.m_points.push_back(
+              this->m_mesh_data.mesh_node(el.m_start+max_node_idx));
+          prep.m_grid_nodes.push_back(0);
+          prep.m_weights.push_back(1);
+          ++prep.m_extra_point_count;
         }
+
+        make_pointwise_interpolation_matrix(en, pldis, modes, 
+            monomial_values, scaled_vdm, s, u, vt, prep);
       }
 
 
 
 
-      void remap_residual(const py_vector &from, py_vector to, 
-          const unsigned offset=0, const unsigned increment=1) const
+      /** If the structured Vandermonde matrix is singular, enlarge the 
+       * element tolerance until it is not.
+       */
+      void prepare_with_enlargement(
+          mesh_data::element_number en,
+          const prepared_local_discretization &pldis,
+          double el_tolerance, double map_norm,
+          element_preparation &prep) const
       {
-        unsigned max_el_size = 0;
-        BOOST_FOREACH(const mesh_data::element_info &el, 
-            this->m_mesh_data.m_element_info)
-          max_el_size = std::max(max_el_size, el.m_end-el.m_start);
-        dyn_vector mesh_values(max_el_size);
+        const double tolerance_bound = 1.5;
+        const double tolerance_step = 0.03;
 
-        const py_vector::const_iterator from_it = from.begin();
-        const py_vector::iterator to_it = to.begin();
-
-        BOOST_FOREACH(const element_on_grid &eog, m_elements_on_grid)
-        {
-          if (!eog.m_inverse_interpolation_matrix.is_valid())
-            break;
+        const mesh_data::element_info &el = 
+          this->m_mesh_data.m_element_info[en];
+        const std::vector<unsigned> modes = all_modes(pldis);
 
-          const py_vector::const_iterator weights = eog.m_weight_factors.begin();
-          dyn_vector grid_values(eog.m_grid_nodes.size());
+        dyn_fortran_matrix monomial_values, scaled_vdm, a, u, vt;
+        dyn_vector s;
 
-          // pick values off the grid
-          for (unsigned i = 0; i < eog.m_grid_nodes.size(); ++i)
-            grid_values[i] = weights[i]
-              * from_it[offset + eog.m_grid_nodes[i]*increment];
+        double tolerance = el_tolerance;
+        bool have_svd;
 
-          // apply the interpolation matrix
+        while (true)
+        {
+          find_element_points(en, tolerance*map_norm,
+              prep.m_points, prep.m_grid_nodes, prep.m_weights);
+          if (tolerance == el_tolerance)
+            prep.m_info.m_original_point_count = prep.m_points.size();
+
+          have_svd = false;
+          bool bad_vdm = prep.m_points.size() < pldis.node_count();
+          if (!bad_vdm)
           {
-            const dyn_fortran_matrix &matrix = eog.m_interpolation_matrix;
-            using namespace boost::numeric::bindings;
-            using blas::detail::gemv;
-            gemv(
-                'N',
-                matrix.size1(),
-                matrix.size2(),
-                /*alpha*/ 1,
-                traits::matrix_storage(matrix),
-                traits::leading_dimension(matrix),
-
-                traits::vector_storage(grid_values), /*incx*/ 1,
-
-                /*beta*/ 0,
-                traits::vector_storage(mesh_values), 
-                /*incy*/ 1);
+            evaluate_weighted_monomials(el, pldis, prep, monomial_values);
+            scaled_vandermonde(pldis, modes, monomial_values, scaled_vdm);
+
+            a = scaled_vdm;
+            have_svd = singular_value_decomposition(a, s, u, vt);
+            bad_vdm = !have_svd
+              || fabs(s[s.size()-1]) < singular_value_threshold(s, scaled_vdm);
           }
 
-          // apply the inverse interpolation matrix
+          if (!bad_vdm)
+            break;
+
+          tolerance += tolerance_step;
+          if (tolerance >= tolerance_bound)
           {
-            const dyn_fortran_matrix &matrix = eog.m_inverse_interpolation_matrix;
-            using namespace boost::numeric::bindings;
-            using blas::detail::gemv;
-            gemv(
-                'N',
-                matrix.size1(),
-                matrix.size2(),
-                /*alpha*/ 1,
-                traits::matrix_storage(matrix),
-                traits::leading_dimension(matrix),
-
-                traits::vector_storage(mesh_values), 
-                /*incx*/ 1,
-
-                /*beta*/ 0,
-                traits::vector_storage(grid_values), /*incy*/ 1
-                );
+            prep.m_info.m_regularized = false;
+            break;
           }
+        }
+
+        if (!have_svd)
+        {
+          evaluate_weighted_monomials(el, pldis, prep, monomial_values);
+          scaled_vandermonde(pldis, modes, monomial_values, scaled_vdm);
 
-          // add squared residuals back onto the grid
-          for (unsigned i = 0; i < eog.m_grid_nodes.size(); ++i)
-            to_it[offset + eog.m_grid_nodes[i]*increment] +=
-              square(grid_values[i] / weights[i]
-                  - from_it[offset + eog.m_grid_nodes[i]*increment]);
+          a = scaled_vdm;
+          if (!singular_value_decomposition(a, s, u, vt))
+            throw std::runtime_error(str(boost::format(
+                    "rec_grid: SVD did not converge on element %d") % en));
         }
+
+        make_pointwise_interpolation_matrix(en, pldis, modes, 
+            monomial_values, scaled_vdm, s, u, vt, prep);
       }
 
 
 
 
-      // gridded output -----------------------------------------------------
-      boost::tuple<py_vector, py_vector> 
-        deposit_grid_densities(
-            depositor_state &ds,
-            const particle_state &ps,
-            const py_vector &velocities,
-            boost::python::slice const &pslice)
+      /** As long as the structured Vandermonde matrix is badly conditioned,
+       * drop the highest-degree mode that contributes most to its smallest
+       * singular value.
+       */
+      void prepare_with_basis_reduction(
+          mesh_data::element_number en,
+          const prepared_local_discretization &pldis,
+          double scaled_tolerance,
+          element_preparation &prep) const
       {
-        const unsigned gnc = grid_node_count_with_extra();
-        const unsigned vdim = ps.vdim();
+        const mesh_data::element_info &el = 
+          this->m_mesh_data.m_element_info[en];
+        const std::vector<unsigned> &mode_degrees = 
+          pldis.m_ldis->m_mode_degrees;
+        std::vector<unsigned> modes = all_modes(pldis);
 
-        py_vector grid_rho(gnc);
-        npy_intp dims[] = { gnc, vdim };
-        py_vector grid_j(2, dims);
+        find_element_points(en, scaled_tolerance, 
+            prep.m_points, prep.m_grid_nodes, prep.m_weights);
+        prep.m_info.m_original_point_count = prep.m_points.size();
 
-        rho_target<py_vector> rho_tgt(grid_rho);
-        typedef j_target<particle_state::m_vdim, py_vector, py_vector> 
-          j_tgt_t;
-        j_tgt_t j_tgt(grid_j, velocities);
-        chained_target<rho_target<py_vector>, j_tgt_t>
-            tgt(rho_tgt, j_tgt);
+        dyn_fortran_matrix monomial_values, scaled_vdm, a, u, vt;
+        dyn_vector s;
 
-        deposit_densities_on_grid_target(ds, ps, tgt, pslice);
+        evaluate_weighted_monomials(el, pldis, prep, monomial_values);
 
-        return boost::make_tuple(grid_rho, grid_j);
-      }
+        while (true)
+        {
+          scaled_vandermonde(pldis, modes, monomial_values, scaled_vdm);
 
+          unsigned max_degree = 0;
+          BOOST_FOREACH(unsigned mode, modes)
+            max_degree = std::max(max_degree, mode_degrees[mode]);
 
+          unsigned kill_idx = 0;
 
+          a = scaled_vdm;
+          if (!singular_value_decomposition(a, s, u, vt))
+          {
+            // Lacking an SVD, we don't have much guidance on what 
+            // modes to kill. Any of the killable ones will do.
+            while (mode_degrees[modes[kill_idx]] != max_degree)
+              ++kill_idx;
+          }
+          else if (modes.size() > prep.m_points.size() 
+              || fabs(s[0]/s[s.size()-1]) > 10)
+          {
+            // badly conditioned, kill a basis entry
+            const unsigned last_row = vt.size1()-1;
+            double kill_weight = -1;
 
-      py_vector deposit_grid_j(
-          depositor_state &ds,
-          const particle_state &ps,
-          py_vector const &velocities,
-          boost::python::slice const &pslice)
-      {
-        const unsigned gnc = grid_node_count_with_extra();
-        const unsigned vdim = ps.vdim();
+            for (unsigned j = 0; j < modes.size(); ++j)
+              if (mode_degrees[modes[j]] == max_degree
+                  && fabs(vt(last_row, j)) > kill_weight)
+              {
+                kill_idx = j;
+                kill_weight = fabs(vt(last_row, j));
+              }
+          }
+          else
+            break;
 
-        npy_intp dims[] = { gnc, vdim };
-        py_vector grid_j(2, dims);
+          modes.erase(modes.begin()+kill_idx);
 
-        j_target<particle_state::m_vdim, py_vector, py_vector> 
-          j_tgt(grid_j, velocities);
-        deposit_densities_on_grid_target(ds, ps, j_tgt, pslice);
-        return grid_j;
+          if (modes.size() == 1)
+            throw std::runtime_error(str(boost::format(
+                    "rec_grid: basis reduction has killed almost the entire "
+                    "basis on element %d") % en));
+        }
+
+        make_pointwise_interpolation_matrix(en, pldis, modes, 
+            monomial_values, scaled_vdm, s, u, vt, prep);
       }
 
 
 
 
-      py_vector deposit_grid_rho(
-          depositor_state &ds,
-          const particle_state &ps,
-          boost::python::slice const &pslice)
+    private:
+      /** Prepare the elements listed in \c elements, each into its 
+       * entry of \c preps, in parallel.
+       */
+      void prepare_elements(const std::string &submethod,
+          double el_tolerance, unsigned max_extra_points,
+          const std::vector<mesh_data::element_number> &elements,
+          std::vector<element_preparation> &preps) const
       {
-        py_vector grid_rho(grid_node_count_with_extra());
+        enum { extra_points, enlargement, basis_reduction } method;
+        if (submethod == "simplex_extra")
+          method = extra_points;
+        else if (submethod == "simplex_enlarge")
+          method = enlargement;
+        else if (submethod == "simplex_reduce")
+          method = basis_reduction;
+        else
+          throw std::runtime_error("rec_grid: invalid pointwise submethod");
+
+        const mesh_data &md = this->m_mesh_data;
+        const unsigned el_count = md.m_element_info.size();
+
+        if (m_ldis_indices.size() != el_count)
+          throw std::runtime_error("rec_grid: ldis_indices has wrong size");
+
+        std::vector<prepared_local_discretization> pldis(
+            m_local_discretizations.size());
+        for (unsigned i = 0; i < pldis.size(); ++i)
+          prepare_local_discretization(m_local_discretizations[i], pldis[i]);
+
+        const int prep_count = elements.size();
+        std::string error;
+
+#pragma omp parallel for schedule(dynamic, 16) num_threads(this->m_thread_count)
+        for (int i = 0; i < prep_count; ++i)
+        {
+          const mesh_data::element_number en = elements[i];
 
-        rho_target<py_vector> rho_tgt(grid_rho);
-        deposit_densities_on_grid_target(ds, ps, rho_tgt, pslice);
-        return grid_rho;
+          try
+          {
+            if (m_ldis_indices[en] >= pldis.size())
+              throw std::runtime_error("rec_grid: invalid ldis index");
+            const prepared_local_discretization &el_pldis = 
+              pldis[m_ldis_indices[en]];
+
+            const double map_norm = element_map_norm(md.m_element_info[en]);
+
+            switch (method)
+            {
+              case extra_points:
+                prepare_with_extra_points(en, el_pldis, 
+                    el_tolerance*map_norm, max_extra_points, preps[en]);
+                break;
+              case enlargement:
+                prepare_with_enlargement(en, el_pldis, 
+                    el_tolerance, map_norm, preps[en]);
+                break;
+              case basis_reduction:
+                prepare_with_basis_reduction(en, el_pldis, 
+                    el_tolerance*map_norm, preps[en]);
+                break;
+            }
+          }
+          catch (std::exception &e)
+          {
+#pragma omp critical (rec_grid_preparation_error)
+            if (error.empty())
+              error = e.what();
+          }
+        }
+
+        if (!error.empty())
+          throw std::runtime_error(error);
+      }
+
+
+
+
+      /** Number the extra points of all elements, which must not yet 
+       * have grid node numbers, and turn \c preps into 
+       * m_elements_on_grid and m_preparation_info.
+       */
+      void finish_element_preparation(std::vector<element_preparation> &preps)
+      {
+        const unsigned mdims = this->m_mesh_data.m_dimensions;
+        const unsigned el_count = preps.size();
+        const grid_node_number gnc = this->grid_node_count();
+
+        m_extra_points.resize(0);
+        m_extra_point_brick_starts.clear();
+        m_extra_point_cell_starts.clear();
+
+        // Number the extra points by containing brick, and within each
+        // brick by element.
+        std::vector<std::vector<std::pair<unsigned, unsigned> > > 
+          brick_extra_points(this->m_bricks.size());
+        unsigned extra_count = 0;
+
+        for (unsigned en = 0; en < el_count; ++en)
+        {
+          const element_preparation &prep = preps[en];
+          for (unsigned i = prep.m_points.size()-prep.m_extra_point_count;
+              i < prep.m_points.size(); ++i)
+          {
+            unsigned brk_nr = 0;
+            while (brk_nr < this->m_bricks.size() 
+                && !this->m_bricks[brk_nr].bounding_box().contains(
+                  prep.m_points[i], 1e-10))
+              ++brk_nr;
+            if (brk_nr == this->m_bricks.size())
+              throw std::runtime_error("rec_grid: no containing brick "
+                  "found for extra point");
+
+            brick_extra_points[brk_nr].push_back(std::make_pair(en, i));
+            ++extra_count;
+          }
+        }
+
+        m_first_extra_point = gnc;
+        m_extra_points.resize(extra_count*mdims);
+        m_extra_point_brick_starts.push_back(0);
+
+        unsigned extra_i = 0;
+        for (unsigned brk_nr = 0; brk_nr < brick_extra_points.size(); ++brk_nr)
+        {
+          for (unsigned j = 0; j < brick_extra_points[brk_nr].size(); ++j)
+          {
+            element_preparation &prep = preps[brick_extra_points[brk_nr][j].first];
+            const unsigned i = brick_extra_points[brk_nr][j].second;
+
+            prep.m_grid_nodes[i] = gnc + extra_i;
+            subrange(m_extra_points, extra_i*mdims, (extra_i+1)*mdims) = 
+              prep.m_points[i];
+            ++extra_i;
+          }
+          m_extra_point_brick_starts.push_back(extra_i);
+        }
+
+        // create Python-visible data serially
+        m_elements_on_grid.clear();
+        m_elements_on_grid.reserve(el_count);
+        m_preparation_info.clear();
+        m_preparation_info.reserve(el_count);
+
+        for (unsigned en = 0; en < el_count; ++en)
+        {
+          element_preparation &prep = preps[en];
+
+          m_elements_on_grid.push_back(element_on_grid());
+          element_on_grid &eog = m_elements_on_grid.back();
+
+          eog.m_element_number = en;
+          eog.m_grid_nodes.swap(prep.m_grid_nodes);
+          eog.m_weight_factors.resize(prep.m_weights.size());
+          std::copy(prep.m_weights.begin(), prep.m_weights.end(), 
+              eog.m_weight_factors.begin());
+          eog.m_interpolation_matrix.swap(prep.m_interpolation_matrix);
+          if (prep.m_inverse_interpolation_matrix.size1())
+            eog.m_inverse_interpolation_matrix = 
+              py_fortran_matrix(prep.m_inverse_interpolation_matrix);
+
+          m_preparation_info.push_back(prep.m_info);
+        }
+
+        m_prepared_bricks = this->m_bricks;
+      }
+
+
+
+
+    public:
+      /** Build m_elements_on_grid and the extra points from 
+       * m_local_discretizations, using the pointwise projection
+       * \c submethod: one of "simplex_extra", "simplex_enlarge" or 
+       * "simplex_reduce". \c el_tolerance is relative to the size of each
+       * element. Elements are prepared in parallel, using m_thread_count
+       * threads.
+       */
+      void prepare_elements_on_grid(const std::string &submethod,
+          double el_tolerance, unsigned max_extra_points)
+      {
+        const unsigned el_count = this->m_mesh_data.m_element_info.size();
+
+        std::vector<mesh_data::element_number> elements(el_count);
+        for (unsigned en = 0; en < el_count; ++en)
+          elements[en] = en;
+
+        std::vector<element_preparation> preps(el_count);
+        prepare_elements(submethod, el_tolerance, max_extra_points, 
+            elements, preps);
+        finish_element_preparation(preps);
+      }
+
+
+
+
+    private:
+      static bool same_geometry(const Brick &a, const Brick &b)
+      {
+        const unsigned mdims = a.dimensions().size();
+        const bounded_int_vector zero_idx = 
+          boost::numeric::ublas::zero_vector<int>(mdims);
+
+        return std::equal(a.dimensions().begin(), a.dimensions().end(),
+              b.dimensions().begin())
+          && norm_inf(a.origin()-b.origin()) == 0
+          && norm_inf(a.stepwidths()-b.stepwidths()) == 0
+          && norm_inf(a.point(zero_idx)-b.point(zero_idx)) == 0;
+      }
+
+    public:
+      /** After the bricks have been changed, bring m_elements_on_grid 
+       * up to date with them. Only elements that may find structured 
+       * points on a brick that was added or removed since the last 
+       * preparation are prepared again, the others merely have their 
+       * grid nodes renumbered. The arguments must be the ones used for
+       * the previous preparation. 
+       *
+       * Returns the number of elements prepared again.
+       */
+      unsigned update_elements_on_grid(const std::string &submethod,
+          double el_tolerance, unsigned max_extra_points)
+      {
+        const mesh_data &md = this->m_mesh_data;
+        const unsigned mdims = md.m_dimensions;
+        const unsigned el_count = md.m_element_info.size();
+
+        if (m_elements_on_grid.size() != el_count 
+            || m_prepared_bricks.size() == 0)
+          throw std::runtime_error("rec_grid: cannot update elements "
+              "without a previous pointwise preparation");
+
+        const std::vector<brick_type> &old_bricks(m_prepared_bricks);
+        const std::vector<brick_type> &new_bricks(this->m_bricks);
+
+        // match up unchanged bricks, collect the changed ones
+        std::vector<int> old_to_new(old_bricks.size(), -1);
+        std::vector<bool> new_matched(new_bricks.size(), false);
+
+        for (unsigned i = 0; i < old_bricks.size(); ++i)
+          for (unsigned j = 0; j < new_bricks.size(); ++j)
+            if (!new_matched[j] && same_geometry(old_bricks[i], new_bricks[j]))
+            {
+              old_to_new[i] = j;
+              new_matched[j] = true;
+              break;
+            }
+
+        std::vector<bounded_box> changed_boxes;
+        for (unsigned i = 0; i < old_bricks.size(); ++i)
+          if (old_to_new[i] < 0)
+            changed_boxes.push_back(old_bricks[i].bounding_box());
+        for (unsigned j = 0; j < new_bricks.size(); ++j)
+          if (!new_matched[j])
+            changed_boxes.push_back(new_bricks[j].bounding_box());
+
+        // The furthest any submethod looks for points, see 
+        // find_element_points() and prepare_with_enlargement().
+        const double max_tolerance = submethod == "simplex_enlarge" 
+          ? std::max(el_tolerance, 1.5) : el_tolerance;
+
+        std::vector<mesh_data::element_number> changed_elements;
+        for (unsigned en = 0; en < el_count; ++en)
+        {
+          bounded_box search_box = md.element_bounding_box(en);
+
+          using boost::numeric::ublas::scalar_vector;
+          const scalar_vector<double> tolerance_vec(mdims, 
+              max_tolerance*element_map_norm(md.m_element_info[en]));
+          search_box.m_lower -= tolerance_vec;
+          search_box.m_upper += tolerance_vec;
+
+          BOOST_FOREACH(const bounded_box &box, changed_boxes)
+            if (!box.intersect(search_box).is_empty())
+            {
+              changed_elements.push_back(en);
+              break;
+            }
+        }
+
+        // Turn the unchanged elements back into preparations, with
+        // their structured points renumbered and their extra points 
+        // (which are numbered afresh) looked up.
+        std::vector<element_preparation> preps(el_count);
+        std::vector<bool> is_changed(el_count, false);
+        BOOST_FOREACH(mesh_data::element_number en, changed_elements)
+          is_changed[en] = true;
+
+        const grid_node_number old_first_extra = m_first_extra_point;
+
+        for (unsigned en = 0; en < el_count; ++en)
+        {
+          if (is_changed[en])
+            continue;
+
+          element_on_grid &eog = m_elements_on_grid[en];
+          element_preparation &prep = preps[en];
+
+          const unsigned point_count = eog.m_grid_nodes.size();
+          prep.m_points.resize(point_count);
+          prep.m_grid_nodes.resize(point_count);
+
+          for (unsigned i = 0; i < point_count; ++i)
+          {
+            const grid_node_number gnn = eog.m_grid_nodes[i];
+
+            if (gnn >= old_first_extra)
+            {
+              const unsigned extra_i = gnn - old_first_extra;
+              prep.m_points[i] = subrange(m_extra_points,
+                  extra_i*mdims, (extra_i+1)*mdims);
+              ++prep.m_extra_point_count;
+              continue;
+            }
+
+            // bricks are numbered in order of their start indices
+            unsigned brk_nr = 0;
+            while (brk_nr+1 < old_bricks.size()
+                && old_bricks[brk_nr+1].start_index() <= gnn)
+              ++brk_nr;
+
+            if (old_to_new[brk_nr] < 0)
+              throw std::runtime_error("rec_grid: unchanged element "
+                  "uses a removed brick");
+            prep.m_grid_nodes[i] = gnn - old_bricks[brk_nr].start_index()
+              + new_bricks[old_to_new[brk_nr]].start_index();
+          }
+
+          prep.m_weights.assign(
+              eog.m_weight_factors.begin(), eog.m_weight_factors.end());
+          prep.m_interpolation_matrix.swap(eog.m_interpolation_matrix);
+          if (eog.m_inverse_interpolation_matrix.size1())
+            prep.m_inverse_interpolation_matrix = 
+              eog.m_inverse_interpolation_matrix;
+          prep.m_info = m_preparation_info[en];
+        }
+
+        prepare_elements(submethod, el_tolerance, max_extra_points, 
+            changed_elements, preps);
+        finish_element_preparation(preps);
+
+        return changed_elements.size();
+      }
+
+
+
+
+      // preparation cache ----------------------------------------------------
+      /** Bump this whenever the cache format or the preparation 
+       * algorithms change. */
+      static unsigned preparation_cache_version()
+      { return 1; }
+
+      static std::string preparation_cache_magic()
+      { return "pyrticle grid depositor preparation"; }
+
+
+
+
+      /** Save the result of the preparation--elements on grid, extra 
+       * points, average groups and preparation info--to \c filename,
+       * labeled with \c key, which should identify all of its inputs.
+       */
+      void write_preparation_cache(const std::string &filename, 
+          const std::string &key) const
+      {
+        binary_writer out(filename);
+
+        out.write_string(preparation_cache_magic());
+        out.write<boost::uint32_t>(preparation_cache_version());
+        out.write_string(key);
+        out.write<boost::uint32_t>(this->m_mesh_data.m_dimensions);
+        out.write<boost::uint32_t>(this->grid_node_count());
+
+        out.write(m_first_extra_point);
+        out.write_ublas_vector(m_extra_points);
+        out.write_vector(m_extra_point_brick_starts);
+
+        out.write_vector(m_average_groups);
+        out.write_vector(m_average_group_starts);
+
+        out.write<boost::uint64_t>(m_elements_on_grid.size());
+        BOOST_FOREACH(const element_on_grid &eog, m_elements_on_grid)
+        {
+          out.write(eog.m_element_number);
+          out.write_vector(eog.m_grid_nodes);
+          out.write_ublas_vector(eog.m_weight_factors);
+          out.write_matrix(eog.m_interpolation_matrix);
+          out.write_matrix(eog.m_inverse_interpolation_matrix);
+        }
+
+        out.write<boost::uint64_t>(m_preparation_info.size());
+        BOOST_FOREACH(const element_preparation_info &info, m_preparation_info)
+        {
+          out.write(info.m_original_point_count);
+          out.write(info.m_mode_count);
+          out.write(info.m_condition);
+          out.write(info.m_pinv_residual);
+          out.write<boost::uint8_t>(info.m_regularized);
+        }
+      }
+
+
+
+
+      /** Load what write_preparation_cache() saved to \c filename, 
+       * by memory-mapping it. Returns false, leaving the depositor
+       * unchanged, if the file does not exist, is not a valid cache 
+       * file of the current version, or was not written with the same 
+       * \c key and grid.
+       */
+      bool read_preparation_cache(const std::string &filename,
+          const std::string &key)
+      {
+        mapped_file file(filename);
+        if (!file.is_mapped())
+          return false;
+
+        grid_node_number first_extra_point;
+        dyn_vector extra_points;
+        std::vector<npy_uint32> extra_point_brick_starts;
+        std::vector<mesh_data::node_number> average_groups;
+        std::vector<npy_uint32> average_group_starts;
+        std::vector<element_on_grid> elements_on_grid;
+        std::vector<element_preparation_info> preparation_info;
+
+        try
+        {
+          binary_reader in(file.begin(), file.end());
+
+          if (in.read_string() != preparation_cache_magic()
+              || in.read<boost::uint32_t>() != preparation_cache_version()
+              || in.read_string() != key
+              || in.read<boost::uint32_t>() != this->m_mesh_data.m_dimensions
+              || in.read<boost::uint32_t>() != this->grid_node_count())
+            return false;
+
+          first_extra_point = in.read<grid_node_number>();
+          in.read_ublas_vector(extra_points);
+          in.read_vector(extra_point_brick_starts);
+
+          in.read_vector(average_groups);
+          in.read_vector(average_group_starts);
+
+          elements_on_grid.resize(
+              in.read_count(sizeof(mesh_data::element_number)));
+          BOOST_FOREACH(element_on_grid &eog, elements_on_grid)
+          {
+            eog.m_element_number = in.read<mesh_data::element_number>();
+            in.read_vector(eog.m_grid_nodes);
+            in.read_ublas_vector(eog.m_weight_factors);
+            in.read_matrix(eog.m_interpolation_matrix);
+            in.read_matrix(eog.m_inverse_interpolation_matrix);
+          }
+
+          preparation_info.resize(in.read_count(1));
+          BOOST_FOREACH(element_preparation_info &info, preparation_info)
+          {
+            info.m_original_point_count = in.read<unsigned>();
+            info.m_mode_count = in.read<unsigned>();
+            info.m_condition = in.read<double>();
+            info.m_pinv_residual = in.read<double>();
+            info.m_regularized = in.read<boost::uint8_t>();
+          }
+
+          if (!in.at_end())
+            return false;
+        }
+        catch (binary_format_error &)
+        {
+          return false;
+        }
+
+        m_first_extra_point = first_extra_point;
+        m_extra_points.swap(extra_points);
+        m_extra_point_brick_starts.swap(extra_point_brick_starts);
+        m_extra_point_cell_starts.clear();
+        m_average_groups.swap(average_groups);
+        m_average_group_starts.swap(average_group_starts);
+        m_elements_on_grid.swap(elements_on_grid);
+        m_preparation_info.swap(preparation_info);
+        m_prepared_bricks = this->m_bricks;
+        return true;
+      }
+
+
+
+
+      /** Bin the extra points into the cells of their bricks, unless
+       * that is already done.
+       */
+      void update_extra_point_index()
+      {
+        const unsigned mdim = this->m_mesh_data.m_dimensions;
+        const unsigned extra_count = m_extra_points.size() / mdim;
+        const unsigned gnc = this->grid_node_count();
+
+        if (m_extra_point_cell_starts.size() == gnc+1
+            && m_indexed_extra_point_count == extra_count)
+          return;
+
+        std::vector<grid_node_number> extra_point_cells(extra_count);
+        m_extra_point_cell_starts.assign(gnc+1, 0);
+
+        if (m_extra_point_brick_starts.size() > this->m_bricks.size())
+        {
+          BOOST_FOREACH(Brick const &brk, this->m_bricks)
+          {
+            const bounded_int_vector &brk_dims = brk.dimensions();
+
+            for (unsigned extra_i = m_extra_point_brick_starts[brk.number()];
+                extra_i < m_extra_point_brick_starts[brk.number()+1]; ++extra_i)
+            {
+              const bounded_vector pt = subrange(
+                  m_extra_points, extra_i*mdim, (extra_i+1)*mdim);
+
+              // Extra points are assigned to bricks with a little
+              // tolerance, so clamp rather than use which_cell().
+              bounded_int_vector cell = brk.index_range(
+                  bounded_box(pt, pt)).m_lower;
+              for (unsigned i = 0; i < mdim; ++i)
+                cell[i] = std::max(0, std::min(int(cell[i]), int(brk_dims[i])-1));
+
+              const grid_node_number gnn = brk.index(cell);
+              extra_point_cells[extra_i] = gnn;
+              ++m_extra_point_cell_starts[gnn+1];
+            }
+          }
+        }
+
+        std::partial_sum(
+            m_extra_point_cell_starts.begin(), m_extra_point_cell_starts.end(),
+            m_extra_point_cell_starts.begin());
+
+        std::vector<unsigned> cell_fill(
+            m_extra_point_cell_starts.begin(), m_extra_point_cell_starts.end()-1);
+        m_extra_point_cell_points.resize(m_extra_point_cell_starts.back());
+
+        if (m_extra_point_brick_starts.size() > this->m_bricks.size())
+        {
+          BOOST_FOREACH(Brick const &brk, this->m_bricks)
+            for (unsigned extra_i = m_extra_point_brick_starts[brk.number()];
+                extra_i < m_extra_point_brick_starts[brk.number()+1]; ++extra_i)
+              m_extra_point_cell_points[cell_fill[extra_point_cells[extra_i]]++]
+                = extra_i;
+        }
+
+        m_indexed_extra_point_count = extra_count;
+      }
+
+
+
+
+      // 1 particle + 1 brick -------------------------------------------------
+      /** Deposits one particle on the axis-0 runs of grid points handed 
+       * to it by for_each_row_in_sphere(), evaluating the shape function
+       * over a chunk of the run at a time.
+       */
+      template <class Target>
+      class row_depositor
+      {
+        public:
+          static const unsigned chunk_size = 64;
+
+        private:
+          Target &m_target;
+          const Brick &m_brick;
+          const ShapeFunction &m_shape_function;
+          const bounded_vector &m_center;
+          const double m_charge;
+
+        public:
+          row_depositor(Target &tgt, const Brick &brk,
+              const ShapeFunction &sf, const bounded_vector &center,
+              double charge)
+            : m_target(tgt), m_brick(brk), m_shape_function(sf),
+            m_center(center), m_charge(charge)
+          { }
+
+          void operator()(const brick_row &row)
+          {
+            double r_squared[chunk_size];
+            double shape_values[chunk_size];
+
+            bounded_int_vector first = row.m_first;
+
+            for (unsigned chunk_start = 0; chunk_start < row.m_length; 
+                chunk_start += chunk_size)
+            {
+              const unsigned n = std::min(unsigned(chunk_size), row.m_length-chunk_start);
+              first[0] = row.m_first[0] + chunk_start;
+
+              m_brick.row_distances_squared(first, n, m_center, r_squared);
+              m_shape_function.evaluate_squared(r_squared, shape_values, n);
+
+              // axis 0 has unit stride
+              const grid_node_number base = row.m_first_index + chunk_start;
+              for (unsigned k = 0; k < n; ++k)
+                if (shape_values[k])
+                  m_target.add_shape_value(base+k, m_charge*shape_values[k]);
+            }
+          }
+      };
+
+
+
+
+      /** Deposits one particle on the extra points in the cells of the
+       * runs handed to it by for_each_row_in_sphere(). Since cells of a
+       * run are numbered contiguously, so are their extra points.
+       */
+      template <class Target>
+      class extra_point_depositor
+      {
+        private:
+          Target &m_target;
+          const grid_depositor &m_depositor;
+          const bounded_vector &m_center;
+          const double m_charge;
+
+        public:
+          extra_point_depositor(Target &tgt, const grid_depositor &dep,
+              const bounded_vector &center, double charge)
+            : m_target(tgt), m_depositor(dep), m_center(center), 
+            m_charge(charge)
+          { }
+
+          void operator()(const brick_row &row)
+          {
+            const grid_depositor &dep(m_depositor);
+            const unsigned mdim = dep.m_mesh_data.m_dimensions;
+            const unsigned stop = dep.m_extra_point_cell_starts[
+              row.m_first_index+row.m_length];
+
+            for (unsigned i = dep.m_extra_point_cell_starts[row.m_first_index];
+                i < stop; ++i)
+            {
+              const unsigned extra_i = dep.m_extra_point_cell_points[i];
+              m_target.add_shape_value(dep.m_first_extra_point+extra_i, 
+                  m_charge*dep.m_shape_function(
+                    m_center-subrange(
+                      dep.m_extra_points, 
+                      extra_i*mdim,
+                      (extra_i+1)*mdim)));
+            }
+          }
+      };
+
+
+
+
+      template <class Target>
+      bool deposit_particle_on_one_brick(Target tgt, 
+          const Brick &brk, 
+          const bounded_vector &center,
+          const bounded_box &particle_box,
+          double charge,
+          bool *complete = 0) const
+      {
+        const bounded_box intersect_box = 
+          brk.bounding_box().intersect(particle_box);
+
+        if (complete)
+          *complete = intersect_box == particle_box;
+
+        if (intersect_box.is_empty())
+          return false;
+
+        const bounded_int_box particle_brick_index_box = 
+          brk.index_range(intersect_box);
+
+        row_depositor<Target> rdep(
+            tgt, brk, this->m_shape_function, center, charge);
+        for_each_row_in_sphere(brk, particle_brick_index_box, 
+            center, this->m_shape_function.radius(), rdep);
+
+        // now treat extra points for this brick
+        if (m_extra_point_cell_points.size())
+        {
+          // Extra points may sit anywhere in their cell, so widen the
+          // sphere by half a cell diagonal.
+          extra_point_depositor<Target> epdep(tgt, *this, center, charge);
+          for_each_row_in_sphere(brk, particle_brick_index_box, center, 
+              this->m_shape_function.radius() + norm_2(brk.stepwidths())/2,
+              epdep);
+        }
+
+        return true;
+      }
+
+
+
+
+      // remapping -----------------------------------------------------------
+    private:
+      struct shape_less
+      {
+        const std::vector<element_on_grid> &m_eogs;
+
+        shape_less(const std::vector<element_on_grid> &eogs)
+          : m_eogs(eogs)
+        { }
+
+        bool operator()(unsigned a, unsigned b) const
+        {
+          const dyn_fortran_matrix &ma = m_eogs[a].m_interpolation_matrix;
+          const dyn_fortran_matrix &mb = m_eogs[b].m_interpolation_matrix;
+          if (ma.size2() != mb.size2())
+            return ma.size2() < mb.size2();
+          else
+            return ma.size1() < mb.size1();
+        }
+      };
+
+    public:
+      /** To be called once m_elements_on_grid is complete. */
+      void prepare_remap()
+      {
+        const unsigned eog_count = m_elements_on_grid.size();
+
+        m_remap_order.resize(eog_count);
+        for (unsigned i = 0; i < eog_count; ++i)
+          m_remap_order[i] = i;
+
+        const shape_less less(m_elements_on_grid);
+        std::stable_sort(m_remap_order.begin(), m_remap_order.end(), less);
+
+        m_remap_group_starts.clear();
+        for (unsigned i = 0; i < eog_count; ++i)
+          if (i == 0 || less(m_remap_order[i-1], m_remap_order[i]))
+            m_remap_group_starts.push_back(i);
+        m_remap_group_starts.push_back(eog_count);
+
+        std::vector<bool> element_seen(
+            this->m_mesh_data.m_element_info.size(), false);
+        m_remap_elements_distinct = true;
+        BOOST_FOREACH(const element_on_grid &eog, m_elements_on_grid)
+        {
+          if (element_seen[eog.m_element_number])
+          {
+            m_remap_elements_distinct = false;
+            break;
+          }
+          element_seen[eog.m_element_number] = true;
+        }
+
+        m_eog_tile_starts.assign(1, 0);
+        m_eog_tiles.clear();
+        BOOST_FOREACH(const element_on_grid &eog, m_elements_on_grid)
+          append_tile_list(eog.m_grid_nodes.begin(), eog.m_grid_nodes.end(),
+              m_eog_tile_starts, m_eog_tiles);
+      }
+
+
+
+
+    private:
+      /** Append the distinct tiles holding the grid nodes in [first, last)
+       * as one more entry to a list of tile lists. */
+      template <class It>
+      static void append_tile_list(It first, It last,
+          std::vector<unsigned> &tile_starts, std::vector<unsigned> &tiles)
+      {
+        const unsigned start = tiles.size();
+        for (; first != last; ++first)
+          tiles.push_back(*first / tiled_grid_vector::tile_nodes());
+
+        std::sort(tiles.begin()+start, tiles.end());
+        tiles.erase(std::unique(tiles.begin()+start, tiles.end()), 
+            tiles.end());
+        tile_starts.push_back(tiles.size());
+      }
+
+      static bool any_tile_touched(const tiled_grid_vector &grid,
+          const std::vector<unsigned> &tile_starts, 
+          const std::vector<unsigned> &tiles, unsigned i)
+      {
+        for (unsigned k = tile_starts[i]; k < tile_starts[i+1]; ++k)
+          if (grid.is_touched(tiles[k]))
+            return true;
+        return false;
+      }
+
+    public:
+
+
+
+
+    private:
+      typedef std::vector<std::pair<grid_node_number, double> > sparse_row;
+
+      static void compress_row(sparse_row &row)
+      {
+        std::sort(row.begin(), row.end());
+
+        sparse_row::iterator out = row.begin();
+        for (sparse_row::const_iterator it = row.begin(); it != row.end(); ++it)
+        {
+          if (out != row.begin() && (out-1)->first == it->first)
+            (out-1)->second += it->second;
+          else
+            *out++ = *it;
+        }
+        row.erase(out, row.end());
+      }
+
+      static void append_csr_row(const sparse_row &row,
+          std::vector<unsigned> &row_starts,
+          std::vector<grid_node_number> &columns,
+          std::vector<double> &values)
+      {
+        BOOST_FOREACH(const sparse_row::value_type &entry, row)
+        {
+          columns.push_back(entry.first);
+          values.push_back(entry.second);
+        }
+        row_starts.push_back(columns.size());
+      }
+
+    public:
+      /** Assemble the CSR remap and residual operators. To be called once 
+       * m_elements_on_grid and the average groups are complete.
+       */
+      void assemble_remap_operator()
+      {
+        const unsigned node_count = this->m_mesh_data.node_count();
+
+        // elementwise rows
+        std::vector<sparse_row> rows(node_count);
+
+        BOOST_FOREACH(const element_on_grid &eog, m_elements_on_grid)
+        {
+          const mesh_data::element_info &el = 
+            this->m_mesh_data.m_element_info[eog.m_element_number];
+          const dyn_fortran_matrix &matrix = eog.m_interpolation_matrix;
+
+          for (unsigned i = 0; i < matrix.size1(); ++i)
+          {
+            sparse_row &row = rows[el.m_start+i];
+            for (unsigned j = 0; j < matrix.size2(); ++j)
+              if (matrix(i, j))
+                row.push_back(std::make_pair(eog.m_grid_nodes[j],
+                      matrix(i, j)*eog.m_weight_factors[j]));
+          }
+        }
+
+        // continuity averaging: each node of an averaging group gets
+        // the mean of the group's rows
+        {
+          npy_uint32 ag_start = 0;
+          BOOST_FOREACH(npy_uint32 ag_end, m_average_group_starts)
+          {
+            if (ag_start != ag_end)
+            {
+              sparse_row avg_row;
+              for (npy_uint32 i = ag_start; i < ag_end; ++i)
+              {
+                const sparse_row &row = rows[m_average_groups[i]];
+                avg_row.insert(avg_row.end(), row.begin(), row.end());
+              }
+
+              const double scale = 1./(ag_end-ag_start);
+              BOOST_FOREACH(sparse_row::value_type &entry, avg_row)
+                entry.second *= scale;
+
+              for (npy_uint32 i = ag_start; i < ag_end; ++i)
+                rows[m_average_groups[i]] = avg_row;
+            }
+            ag_start = ag_end;
+          }
+        }
+
+        m_remap_row_starts.assign(1, 0);
+        m_remap_columns.clear();
+        m_remap_values.clear();
+
+        BOOST_FOREACH(sparse_row &row, rows)
+        {
+          compress_row(row);
+          append_csr_row(row, 
+              m_remap_row_starts, m_remap_columns, m_remap_values);
+        }
+
+        m_remap_element_tile_starts.assign(1, 0);
+        m_remap_element_tiles.clear();
+        BOOST_FOREACH(const mesh_data::element_info &el, 
+            this->m_mesh_data.m_element_info)
+          append_tile_list(
+              m_remap_columns.begin()+m_remap_row_starts[el.m_start],
+              m_remap_columns.begin()+m_remap_row_starts[el.m_end],
+              m_remap_element_tile_starts, m_remap_element_tiles);
+
+        // residual operator
+        std::vector<std::pair<grid_node_number, sparse_row> > residual_rows;
+
+        BOOST_FOREACH(const element_on_grid &eog, m_elements_on_grid)
+        {
+          if (!eog.m_inverse_interpolation_matrix.is_valid())
+            break;
+
+          const dyn_fortran_matrix &interp = eog.m_interpolation_matrix;
+          const py_fortran_matrix &inv_interp = 
+            eog.m_inverse_interpolation_matrix;
+          const py_vector &weights = eog.m_weight_factors;
+
+          const dyn_matrix roundtrip = prod(inv_interp.as_ublas(), interp);
+
+          for (unsigned i = 0; i < roundtrip.size1(); ++i)
+          {
+            sparse_row row;
+            for (unsigned j = 0; j < roundtrip.size2(); ++j)
+            {
+              const double value = roundtrip(i, j)*weights[j]/weights[i]
+                - (i == j ? 1 : 0);
+              if (value)
+                row.push_back(std::make_pair(eog.m_grid_nodes[j], value));
+            }
+            compress_row(row);
+            residual_rows.push_back(std::make_pair(eog.m_grid_nodes[i], row));
+          }
+        }
+
+        std::stable_sort(residual_rows.begin(), residual_rows.end(),
+            first_less());
+
+        const unsigned gnc = grid_node_count_with_extra();
+        m_residual_node_row_starts.assign(gnc+1, 0);
+        m_residual_row_starts.assign(1, 0);
+        m_residual_columns.clear();
+        m_residual_values.clear();
+
+        for (unsigned i = 0; i < residual_rows.size(); ++i)
+        {
+          ++m_residual_node_row_starts[residual_rows[i].first+1];
+          append_csr_row(residual_rows[i].second, m_residual_row_starts,
+              m_residual_columns, m_residual_values);
+        }
+
+        std::partial_sum(
+            m_residual_node_row_starts.begin(), m_residual_node_row_starts.end(),
+            m_residual_node_row_starts.begin());
+      }
+
+    private:
+      struct first_less
+      {
+        template <class Pair>
+        bool operator()(const Pair &a, const Pair &b) const
+        { return a.first < b.first; }
+      };
+
+    public:
+
+
+
+
+      /** Remap \c components interleaved grid quantities (such as rho 
+       * and the components of j) in \c from to the mesh, adding them to 
+       * \c to, and then enforce continuity across elements.
+       *
+       * Both \c from and \c to are node-major, as are numpy arrays of 
+       * shape (node_count, components). On each element, all components
+       * are treated by one GEMM.
+       */
+      void remap_grid_to_mesh(const py_vector from, py_vector to, 
+          const unsigned components) const
+      { remap_grid_values_to_mesh(from.begin(), to, components, 0); }
+
+
+
+
+      /** Like remap_grid_to_mesh(), but skip the elements whose grid 
+       * nodes all lie in tiles of \c from that are not touched.
+       */
+      void remap_tiled_grid_to_mesh(const tiled_grid_vector &from, 
+          py_vector &to) const
+      { 
+        remap_grid_values_to_mesh(
+            from.values(), to, from.components(), &from); 
+      }
+
+
+
+
+    private:
+      template <class FromIt>
+      void remap_grid_values_to_mesh(const FromIt from_it, py_vector &to, 
+          const unsigned components, const tiled_grid_vector *touched) const
+      {
+        if (m_remap_row_starts.size())
+        {
+          remap_grid_values_to_mesh_assembled(
+              from_it, to, components, touched);
+          return;
+        }
+
+        if (m_remap_group_starts.size() == 0)
+          throw std::runtime_error("rec_grid: prepare_remap() was not called");
+
+        const py_vector::iterator to_it = to.begin();
+        double *to_storage = 
+          boost::numeric::bindings::traits::vector_storage(to);
+
+        const unsigned group_count = m_remap_group_starts.size()-1;
+        const int avg_group_count = m_average_group_starts.size();
+
+        // Elements with several elements_on_grid accumulate into the same
+        // mesh nodes from different shape groups, so remap those serially.
+#pragma omp parallel num_threads(this->m_thread_count) \
+        if (m_remap_elements_distinct)
+        {
+          dyn_vector grid_values;
+
+#pragma omp for schedule(dynamic)
+          for (int group = 0; group < int(group_count); ++group)
+          {
+            const unsigned group_start = m_remap_group_starts[group];
+            const unsigned group_end = m_remap_group_starts[group+1];
+
+            // all matrices in this group share their shape
+            const dyn_fortran_matrix &group_matrix = 
+              m_elements_on_grid[m_remap_order[group_start]]
+              .m_interpolation_matrix;
+            const unsigned el_nodes = group_matrix.size1();
+            const unsigned grid_nodes = group_matrix.size2();
+
+            if (grid_values.size() < components*grid_nodes)
+              grid_values.resize(components*grid_nodes, false);
+
+            for (unsigned i_eog = group_start; i_eog < group_end; ++i_eog)
+            {
+              if (touched && !any_tile_touched(*touched, 
+                    m_eog_tile_starts, m_eog_tiles, m_remap_order[i_eog]))
+                continue;
+
+              const element_on_grid &eog = m_elements_on_grid[
+                m_remap_order[i_eog]];
+              const mesh_data::element_info &el = 
+                this->m_mesh_data.m_element_info[eog.m_element_number];
+
+              // pick values off the grid, as a [components x grid_nodes]
+              // column-major matrix
+              const py_vector::const_iterator weights = 
+                eog.m_weight_factors.begin();
+
+              bool had_nonzero = false;
+              for (unsigned i = 0; i < grid_nodes; ++i)
+              {
+                const double weight = weights[i];
+                const FromIt node_values = 
+                  from_it + eog.m_grid_nodes[i]*components;
+
+                for (unsigned c = 0; c < components; ++c)
+                {
+                  const double w = weight * node_values[c];
+                  grid_values[i*components+c] = w;
+
+                  if (w)
+                    had_nonzero = true;
+                }
+              }
+
+              // and apply the interpolation matrix:
+              // to^T += grid_values * matrix^T
+              if (had_nonzero)
+              {
+                const dyn_fortran_matrix &matrix = eog.m_interpolation_matrix;
+                using namespace boost::numeric::bindings;
+                using blas::detail::gemm;
+                gemm(
+                    'N',
+                    'T',
+                    components,
+                    el_nodes,
+                    grid_nodes,
+                    /*alpha*/ 1,
+                    /*a*/ traits::vector_storage(grid_values),
+                    /*lda*/ components,
+                    /*b*/ traits::matrix_storage(matrix),
+                    /*ldb*/ traits::leading_dimension(matrix),
+                    /*beta*/ 1,
+                    /*c*/ to_storage + el.m_start*components,
+                    /*ldc*/ components
+                    );
+              }
+            }
+          }
+
+          // cross-element continuity enforcement
+          //
+          // Each node belongs to at most one averaging group, so the
+          // groups may be treated in parallel.
+#pragma omp for
+          for (int ag = 0; ag < avg_group_count; ++ag)
+          {
+            const npy_uint32 ag_start = ag == 0 ? 0 : m_average_group_starts[ag-1];
+            const npy_uint32 ag_end = m_average_group_starts[ag];
+
+            if (ag_start == ag_end)
+              continue;
+
+            for (unsigned c = 0; c < components; ++c)
+            {
+              double avg = 0;
+              for (npy_uint32 i = ag_start; i < ag_end; ++i)
+                avg += to_it[m_average_groups[i]*components + c];
+              avg /= (ag_end-ag_start);
+
+              for (npy_uint32 i = ag_start; i < ag_end; ++i)
+                to_it[m_average_groups[i]*components + c] = avg;
+            }
+          }
+        }
+      }
+
+
+
+
+      /** The same as remap_grid_values_to_mesh(), but using the 
+       * assembled operator, applied to all components in one sweep over
+       * its rows.
+       */
+      template <class FromIt>
+      void remap_grid_values_to_mesh_assembled(const FromIt from_it, 
+          py_vector &to, const unsigned components, 
+          const tiled_grid_vector *touched) const
+      {
+        const py_vector::iterator to_it = to.begin();
+
+        if (touched)
+        {
+          // skip the rows of elements that only read untouched tiles
+          const int element_count = this->m_mesh_data.m_element_info.size();
+
+#pragma omp parallel for schedule(static) num_threads(this->m_thread_count)
+          for (int en = 0; en < element_count; ++en)
+          {
+            if (!any_tile_touched(*touched, 
+                  m_remap_element_tile_starts, m_remap_element_tiles, en))
+              continue;
+
+            const mesh_data::element_info &el = 
+              this->m_mesh_data.m_element_info[en];
+            for (unsigned row = el.m_start; row < el.m_end; ++row)
+              apply_remap_row(from_it, to_it, components, row);
+          }
+        }
+        else
+        {
+          const int row_count = m_remap_row_starts.size()-1;
+
+#pragma omp parallel for schedule(static) num_threads(this->m_thread_count)
+          for (int row = 0; row < row_count; ++row)
+            apply_remap_row(from_it, to_it, components, row);
+        }
+      }
+
+
+
+
+      template <class FromIt>
+      void apply_remap_row(const FromIt from_it, 
+          const py_vector::iterator to_it, const unsigned components,
+          const unsigned row) const
+      {
+        const py_vector::iterator row_it = to_it + row*components;
+
+        for (unsigned k = m_remap_row_starts[row]; 
+            k < m_remap_row_starts[row+1]; ++k)
+        {
+          const double value = m_remap_values[k];
+          const FromIt col_it = from_it + m_remap_columns[k]*components;
+
+          for (unsigned c = 0; c < components; ++c)
+            row_it[c] += value*col_it[c];
+        }
+      }
+
+    public:
+
+
+
+
+      /** Compute the squared difference between each grid value in 
+       * \c from and its round trip to the mesh and back, and add them
+       * onto \c to. Both are node-major with \c components values per 
+       * grid node.
+       */
+      void remap_residual(const py_vector &from, py_vector to, 
+          const unsigned components) const
+      {
+        if (m_residual_node_row_starts.size())
+        {
+          remap_residual_assembled(from, to, components);
+          return;
+        }
+
+        unsigned max_el_size = 0;
+        BOOST_FOREACH(const mesh_data::element_info &el, 
+            this->m_mesh_data.m_element_info)
+          max_el_size = std::max(max_el_size, el.m_end-el.m_start);
+        dyn_vector mesh_values(max_el_size);
+
+        const py_vector::const_iterator from_it = from.begin();
+        const py_vector::iterator to_it = to.begin();
+
+        for (unsigned offset = 0; offset < components; ++offset)
+        {
+          const unsigned increment = components;
+
+          BOOST_FOREACH(const element_on_grid &eog, m_elements_on_grid)
+          {
+            if (!eog.m_inverse_interpolation_matrix.is_valid())
+              break;
+
+            const py_vector::const_iterator weights = eog.m_weight_factors.begin();
+            dyn_vector grid_values(eog.m_grid_nodes.size());
+
+            // pick values off the grid
+            for (unsigned i = 0; i < eog.m_grid_nodes.size(); ++i)
+              grid_values[i] = weights[i]
+                * from_it[offset + eog.m_grid_nodes[i]*increment];
+
+            // apply the interpolation matrix
+            {
+              const dyn_fortran_matrix &matrix = eog.m_interpolation_matrix;
+              using namespace boost::numeric::bindings;
+              using blas::detail::gemv;
+              gemv(
+                  'N',
+                  matrix.size1(),
+                  matrix.size2(),
+                  /*alpha*/ 1,
+                  traits::matrix_storage(matrix),
+                  traits::leading_dimension(matrix),
+
+                  traits::vector_storage(grid_values), /*incx*/ 1,
+
+                  /*beta*/ 0,
+                  traits::vector_storage(mesh_values), 
+                  /*incy*/ 1);
+            }
+
+            // apply the inverse interpolation matrix
+            {
+              const dyn_fortran_matrix &matrix = eog.m_inverse_interpolation_matrix;
+              using namespace boost::numeric::bindings;
+              using blas::detail::gemv;
+              gemv(
+                  'N',
+                  matrix.size1(),
+                  matrix.size2(),
+                  /*alpha*/ 1,
+                  traits::matrix_storage(matrix),
+                  traits::leading_dimension(matrix),
+
+                  traits::vector_storage(mesh_values), 
+                  /*incx*/ 1,
+
+                  /*beta*/ 0,
+                  traits::vector_storage(grid_values), /*incy*/ 1
+                  );
+            }
+
+            // add squared residuals back onto the grid
+            for (unsigned i = 0; i < eog.m_grid_nodes.size(); ++i)
+              to_it[offset + eog.m_grid_nodes[i]*increment] +=
+                square(grid_values[i] / weights[i]
+                    - from_it[offset + eog.m_grid_nodes[i]*increment]);
+          }
+        }
+      }
+
+
+
+
+      /** The same as remap_residual(), but computing each residual
+       * in one pass over a row of the assembled residual operator.
+       */
+      void remap_residual_assembled(const py_vector &from, py_vector &to,
+          const unsigned components) const
+      {
+        const py_vector::const_iterator from_it = from.begin();
+        const py_vector::iterator to_it = to.begin();
+        const int gnc = m_residual_node_row_starts.size()-1;
+
+#pragma omp parallel num_threads(this->m_thread_count)
+        {
+          dyn_vector residual(components);
+
+#pragma omp for schedule(static)
+          for (int gnn = 0; gnn < gnc; ++gnn)
+          {
+            for (unsigned row = m_residual_node_row_starts[gnn]; 
+                row < m_residual_node_row_starts[gnn+1]; ++row)
+            {
+              residual.clear();
+
+              for (unsigned k = m_residual_row_starts[row]; 
+                  k < m_residual_row_starts[row+1]; ++k)
+              {
+                const double value = m_residual_values[k];
+                const py_vector::const_iterator col_it = 
+                  from_it + m_residual_columns[k]*components;
+
+                for (unsigned c = 0; c < components; ++c)
+                  residual[c] += value*col_it[c];
+              }
+
+              for (unsigned c = 0; c < components; ++c)
+                to_it[gnn*components + c] += square(residual[c]);
+            }
+          }
+        }
+      }
+
+
+
+
+      // convolution deposition ---------------------------------------------
+      /** For deposition by convolution, each brick is extended by this
+       * many grid points on each side, so that the shape function 
+       * centered at any of its own points stays within the extension.
+       */
+      unsigned convolution_padding(brick_number bn) const
+      {
+        const bounded_vector &h = this->m_bricks[bn].stepwidths();
+        const double radius = this->m_shape_function.radius();
+
+        unsigned result = 0;
+        for (unsigned i = 0; i < h.size(); ++i)
+          result = std::max(result, unsigned(ceil(radius/h[i])));
+        return result+1;
+      }
+
+
+
+
+      unsigned padded_grid_node_count() const
+      {
+        std::vector<padded_brick> pbricks;
+        make_padded_bricks(pbricks);
+        if (pbricks.size() == 0)
+          return 0;
+        else
+          return pbricks.back().m_start_index + pbricks.back().node_count();
+      }
+
+
+
+
+    private:
+      /** A brick extended by convolution_padding() points on each side.
+       * Padded bricks are numbered like the bricks, and their points
+       * are numbered consecutively, axis 0 first, as for bricks.
+       */
+      struct padded_brick
+      {
+        unsigned m_start_index;
+        unsigned m_padding;
+        bounded_int_vector m_dimensions;
+        bounded_int_vector m_strides;
+
+        unsigned node_count() const
+        {
+          return m_strides[m_strides.size()-1]
+            * m_dimensions[m_dimensions.size()-1];
+        }
+      };
+
+      void make_padded_bricks(std::vector<padded_brick> &result) const
+      {
+        result.clear();
+        unsigned start_index = 0;
+
+        BOOST_FOREACH(Brick const &brk, this->m_bricks)
+        {
+          const unsigned mdim = brk.dimensions().size();
+
+          padded_brick pbrk;
+          pbrk.m_start_index = start_index;
+          pbrk.m_padding = convolution_padding(brk.number());
+          pbrk.m_dimensions = brk.dimensions();
+          pbrk.m_strides.resize(mdim);
+
+          unsigned stride = 1;
+          for (unsigned i = 0; i < mdim; ++i)
+          {
+            pbrk.m_dimensions[i] += 2*pbrk.m_padding;
+            pbrk.m_strides[i] = stride;
+            stride *= pbrk.m_dimensions[i];
+          }
+
+          result.push_back(pbrk);
+          start_index += pbrk.node_count();
+        }
+      }
+
+      /** Find the cell of the padded brick lattice containing \c pt,
+       * i.e. the lattice point below \c pt along each axis, and the 
+       * fractional position of \c pt within that cell. Returns false
+       * if the cell is not entirely in the padded brick.
+       */
+      static bool find_padded_cell(const Brick &brk, const padded_brick &pbrk,
+          const bounded_vector &pt,
+          bounded_int_vector &cell, bounded_vector &fractions)
+      {
+        const unsigned mdim = pt.size();
+        cell.resize(mdim);
+        fractions.resize(mdim);
+
+        for (unsigned i = 0; i < mdim; ++i)
+        {
+          const double u = (pt[i]-brk.origin()[i])/brk.stepwidths()[i] 
+            - 0.5 + pbrk.m_padding;
+          const double u_floor = floor(u);
+          if (u_floor < 0 || u_floor+1 >= pbrk.m_dimensions[i])
+            return false;
+
+          cell[i] = int(u_floor);
+          fractions[i] = u-u_floor;
+        }
+        return true;
+      }
+
+      /** Return the multilinear weight of corner \c corner (a bit 
+       * field, one bit per axis) of a cell, along with its index.
+       */
+      static double cell_corner(const padded_brick &pbrk, 
+          const bounded_int_vector &cell, const bounded_vector &fractions,
+          unsigned corner, unsigned &index)
+      {
+        double weight = 1;
+        index = pbrk.m_start_index;
+        for (unsigned i = 0; i < cell.size(); ++i)
+        {
+          const bool upper = corner & (1<<i);
+          weight *= upper ? fractions[i] : 1-fractions[i];
+          index += (cell[i] + (upper ? 1 : 0))*pbrk.m_strides[i];
+        }
+        return weight;
+      }
+
+      /** Deposit each particle with cloud-in-cell weights onto every
+       * padded brick that contains its center or that of one of its 
+       * periodic images.
+       */
+      template <class Target>
+      void deposit_cic_on_padded_bricks(const particle_state &ps,
+          Target tgt, boost::python::slice const &pslice) const
+      {
+        const unsigned dim_x = ps.xdim();
+        const unsigned mdim = this->m_mesh_data.m_dimensions;
+
+        std::vector<padded_brick> pbricks;
+        make_padded_bricks(pbricks);
+
+        // offsets of all periodic images, the identity first
+        std::vector<bounded_vector> image_offsets(1, 
+            boost::numeric::ublas::zero_vector<double>(mdim));
+        for (unsigned axis = 0; axis < mdim; ++axis)
+        {
+          const mesh_data::periodicity_axis &p_axis(
+             this->m_mesh_data.m_periodicities[axis]);
+          if (p_axis.m_min == p_axis.m_max)
+            continue;
+
+          const unsigned prev_count = image_offsets.size();
+          for (unsigned i = 0; i < prev_count; ++i)
+            for (int sign = -1; sign <= 1; sign += 2)
+            {
+              bounded_vector offset = image_offsets[i];
+              offset[axis] += sign*(p_axis.m_max-p_axis.m_min);
+              image_offsets.push_back(offset);
+            }
+        }
+
+        bounded_int_vector cell;
+        bounded_vector fractions;
+
+        FOR_ALL_SLICE_INDICES(pslice, ps.particle_count)
+        {
+          FOR_ALL_SLICE_INDICES_INNER(particle_number, pn);
+
+          const bounded_vector center = subrange(
+              ps.positions, pn*dim_x, (pn+1)*dim_x);
+          const double charge = ps.charges[pn];
+
+          tgt.begin_particle(pn);
+          BOOST_FOREACH(const bounded_vector &offset, image_offsets)
+          {
+            const bounded_vector image_center = center + offset;
+
+            for (unsigned bn = 0; bn < pbricks.size(); ++bn)
+            {
+              if (!find_padded_cell(this->m_bricks[bn], pbricks[bn], 
+                    image_center, cell, fractions))
+                continue;
+
+              for (unsigned corner = 0; corner < (1u<<mdim); ++corner)
+              {
+                unsigned index;
+                const double weight = cell_corner(
+                    pbricks[bn], cell, fractions, corner, index);
+                tgt.add_shape_value(index, charge*weight);
+              }
+            }
+          }
+          tgt.end_particle(pn);
+        }
+      }
+
+    public:
+      /** Return the shape function sampled at the grid point offsets of
+       * brick \c bn, laid out like the padded brick, with offsets taken 
+       * modulo its dimensions (as needed for circular convolution).
+       */
+      py_vector convolution_kernel(brick_number bn) const
+      {
+        std::vector<padded_brick> pbricks;
+        make_padded_bricks(pbricks);
+        const padded_brick &pbrk = pbricks[bn];
+        const Brick &brk = this->m_bricks[bn];
+        const unsigned mdim = pbrk.m_dimensions.size();
+        const int reach = pbrk.m_padding;
+
+        py_vector result(pbrk.node_count());
+        result.clear();
+
+        bounded_int_vector offset(mdim);
+        for (unsigned i = 0; i < mdim; ++i)
+          offset[i] = -reach;
+
+        while (true)
+        {
+          double r_squared = 0;
+          unsigned index = 0;
+          for (unsigned i = 0; i < mdim; ++i)
+          {
+            const double dx = offset[i]*brk.stepwidths()[i];
+            r_squared += dx*dx;
+
+            const int dim_i = pbrk.m_dimensions[i];
+            index += ((offset[i]+dim_i) % dim_i)*pbrk.m_strides[i];
+          }
+
+          double value;
+          this->m_shape_function.evaluate_squared(&r_squared, &value, 1);
+          result[index] = value;
+
+          // advance the offset, axis 0 fastest
+          unsigned i = 0;
+          while (i < mdim && ++offset[i] > reach)
+            offset[i++] = -reach;
+          if (i == mdim)
+            break;
+        }
+
+        return result;
+      }
+
+
+
+
+      /** Copy the unpadded part of each padded brick in \c padded into
+       * \c grid, and interpolate the extra point values multilinearly
+       * from the padded brick they belong to. Both hold \c components
+       * values per point.
+       */
+      void sample_padded_grid(const py_vector &padded, py_vector grid,
+          unsigned components) const
+      {
+        const unsigned mdim = this->m_mesh_data.m_dimensions;
+
+        std::vector<padded_brick> pbricks;
+        make_padded_bricks(pbricks);
+
+        if (pbricks.size() 
+            && padded.size() != components*(pbricks.back().m_start_index
+              + pbricks.back().node_count()))
+          throw std::runtime_error("padded grid has wrong size");
+        if (grid.size() != components*grid_node_count_with_extra())
+          throw std::runtime_error("grid has wrong size");
+
+        py_vector::const_iterator padded_it = padded.begin();
+        py_vector::iterator grid_it = grid.begin();
+
+        BOOST_FOREACH(Brick const &brk, this->m_bricks)
+        {
+          const padded_brick &pbrk = pbricks[brk.number()];
+
+          // axis 0 has unit stride in both, so copy a row at a time
+          bounded_int_box row_starts(
+              boost::numeric::ublas::zero_vector<int>(mdim), 
+              brk.dimensions());
+          row_starts.m_upper[0] = 1;
+          const unsigned row_length = components*brk.dimensions()[0];
+
+          for (brick_iterator<Brick> it(brk, row_starts); !it.at_end(); ++it)
+          {
+            unsigned padded_index = pbrk.m_start_index;
+            for (unsigned i = 0; i < mdim; ++i)
+              padded_index += ((*it)[i]+pbrk.m_padding)*pbrk.m_strides[i];
+
+            std::copy(
+                padded_it + components*padded_index,
+                padded_it + components*padded_index + row_length,
+                grid_it + components*it.index());
+          }
+        }
+
+        if (m_extra_point_brick_starts.size() <= this->m_bricks.size())
+          return;
+
+        bounded_int_vector cell;
+        bounded_vector fractions;
+
+        BOOST_FOREACH(Brick const &brk, this->m_bricks)
+        {
+          const padded_brick &pbrk = pbricks[brk.number()];
+
+          for (unsigned extra_i = m_extra_point_brick_starts[brk.number()];
+              extra_i < m_extra_point_brick_starts[brk.number()+1]; ++extra_i)
+          {
+            const bounded_vector pt = subrange(
+                m_extra_points, extra_i*mdim, (extra_i+1)*mdim);
+
+            if (!find_padded_cell(brk, pbrk, pt, cell, fractions))
+              throw std::runtime_error("extra point outside of its padded brick");
+
+            const unsigned grid_base = 
+              components*(m_first_extra_point+extra_i);
+            for (unsigned c = 0; c < components; ++c)
+              grid[grid_base+c] = 0;
+
+            for (unsigned corner = 0; corner < (1u<<mdim); ++corner)
+            {
+              unsigned index;
+              const double weight = cell_corner(
+                  pbrk, cell, fractions, corner, index);
+              for (unsigned c = 0; c < components; ++c)
+                grid[grid_base+c] += weight*padded[components*index+c];
+            }
+          }
+        }
+      }
+
+
+
+
+      /** Like deposit_grid_densities(), but with cloud-in-cell weights
+       * onto the padded bricks, for subsequent convolution with 
+       * convolution_kernel().
+       */
+      boost::tuple<py_vector, py_vector> 
+        deposit_padded_grid_densities(
+            const particle_state &ps,
+            const py_vector &velocities,
+            boost::python::slice const &pslice) const
+      {
+        const unsigned pgnc = padded_grid_node_count();
+        const unsigned vdim = ps.vdim();
+
+        py_vector grid_rho(pgnc);
+        npy_intp dims[] = { pgnc, vdim };
+        py_vector grid_j(2, dims);
+
+        rho_target<py_vector> rho_tgt(grid_rho);
+        typedef j_target<particle_state::m_vdim, py_vector, py_vector> 
+          j_tgt_t;
+        j_tgt_t j_tgt(grid_j, velocities);
+        chained_target<rho_target<py_vector>, j_tgt_t>
+            tgt(rho_tgt, j_tgt);
+
+        deposit_cic_on_padded_bricks(ps, tgt, pslice);
+        return boost::make_tuple(grid_rho, grid_j);
+      }
+
+
+
+
+      py_vector deposit_padded_grid_j(
+          const particle_state &ps,
+          py_vector const &velocities,
+          boost::python::slice const &pslice) const
+      {
+        const unsigned pgnc = padded_grid_node_count();
+        const unsigned vdim = ps.vdim();
+
+        npy_intp dims[] = { pgnc, vdim };
+        py_vector grid_j(2, dims);
+
+        j_target<particle_state::m_vdim, py_vector, py_vector> 
+          j_tgt(grid_j, velocities);
+        deposit_cic_on_padded_bricks(ps, j_tgt, pslice);
+        return grid_j;
+      }
+
+
+
+
+      py_vector deposit_padded_grid_rho(
+          const particle_state &ps,
+          boost::python::slice const &pslice) const
+      {
+        py_vector grid_rho(padded_grid_node_count());
+
+        rho_target<py_vector> rho_tgt(grid_rho);
+        deposit_cic_on_padded_bricks(ps, rho_tgt, pslice);
+        return grid_rho;
+      }
+
+
+
+
+      // gridded output -----------------------------------------------------
+      boost::tuple<py_vector, py_vector> 
+        deposit_grid_densities(
+            depositor_state &ds,
+            const particle_state &ps,
+            const py_vector &velocities,
+            boost::python::slice const &pslice)
+      {
+        const unsigned gnc = grid_node_count_with_extra();
+        const unsigned vdim = ps.vdim();
+
+        py_vector grid_rho(gnc);
+        npy_intp dims[] = { gnc, vdim };
+        py_vector grid_j(2, dims);
+
+        rho_target<py_vector> rho_tgt(grid_rho);
+        typedef j_target<particle_state::m_vdim, py_vector, py_vector> 
+          j_tgt_t;
+        j_tgt_t j_tgt(grid_j, velocities);
+        chained_target<rho_target<py_vector>, j_tgt_t>
+            tgt(rho_tgt, j_tgt);
+
+        update_extra_point_index();
+        deposit_densities_on_grid_target(ds, ps, tgt, pslice);
+
+        return boost::make_tuple(grid_rho, grid_j);
+      }
+
+
+
+
+      py_vector deposit_grid_j(
+          depositor_state &ds,
+          const particle_state &ps,
+          py_vector const &velocities,
+          boost::python::slice const &pslice)
+      {
+        const unsigned gnc = grid_node_count_with_extra();
+        const unsigned vdim = ps.vdim();
+
+        npy_intp dims[] = { gnc, vdim };
+        py_vector grid_j(2, dims);
+
+        j_target<particle_state::m_vdim, py_vector, py_vector> 
+          j_tgt(grid_j, velocities);
+        update_extra_point_index();
+        deposit_densities_on_grid_target(ds, ps, j_tgt, pslice);
+        return grid_j;
+      }
+
+
+
+
+      py_vector deposit_grid_rho(
+          depositor_state &ds,
+          const particle_state &ps,
+          boost::python::slice const &pslice)
+      {
+        py_vector grid_rho(grid_node_count_with_extra());
+
+        rho_target<py_vector> rho_tgt(grid_rho);
+        update_extra_point_index();
+        deposit_densities_on_grid_target(ds, ps, rho_tgt, pslice);
+        return grid_rho;
+      }
+
+
+
+
+      // mesh output --------------------------------------------------------
+      /** Deposit onto the grid and remap to the mesh. The grid storage
+       * is kept across calls, and only the tiles touched by the particles 
+       * are cleared and remapped.
+       */
+      boost::tuple<py_vector, py_vector> 
+        deposit_densities(
+            depositor_state &ds,
+            const particle_state &ps,
+            const py_vector &velocities,
+            boost::python::slice const &pslice)
+      {
+        const unsigned gnc = grid_node_count_with_extra();
+        const unsigned vdim = ps.vdim();
+
+        m_rho_grid.resize(gnc, 1);
+        m_j_grid.resize(gnc, vdim);
+
+        rho_target<tiled_grid_vector> rho_tgt(m_rho_grid);
+        typedef j_target<particle_state::m_vdim, tiled_grid_vector, py_vector> 
+          j_tgt_t;
+        j_tgt_t j_tgt(m_j_grid, velocities);
+        chained_target<rho_target<tiled_grid_vector>, j_tgt_t>
+            tgt(rho_tgt, j_tgt);
+
+        update_extra_point_index();
+        deposit_densities_on_grid_target(ds, ps, tgt, pslice);
+
+        py_vector rho(this->m_mesh_data.node_count());
+        rho.clear();
+        npy_intp dims[] = { this->m_mesh_data.node_count(), vdim };
+        py_vector j(2, dims);
+        j.clear();
+
+        remap_tiled_grid_to_mesh(m_rho_grid, rho);
+        remap_tiled_grid_to_mesh(m_j_grid, j);
+        return boost::make_tuple(rho, j);
+      }
+
+
+
+
+      py_vector deposit_j(
+          depositor_state &ds,
+          const particle_state &ps,
+          py_vector const &velocities,
+          boost::python::slice const &pslice)
+      {
+        const unsigned vdim = ps.vdim();
+        m_j_grid.resize(grid_node_count_with_extra(), vdim);
+
+        j_target<particle_state::m_vdim, tiled_grid_vector, py_vector> 
+          j_tgt(m_j_grid, velocities);
+        update_extra_point_index();
+        deposit_densities_on_grid_target(ds, ps, j_tgt, pslice);
+
+        npy_intp dims[] = { this->m_mesh_data.node_count(), vdim };
+        py_vector j(2, dims);
+        j.clear();
+        remap_tiled_grid_to_mesh(m_j_grid, j);
+        return j;
+      }
+
+
+
+
+      py_vector deposit_rho(
+          depositor_state &ds,
+          const particle_state &ps,
+          boost::python::slice const &pslice)
+      {
+        m_rho_grid.resize(grid_node_count_with_extra(), 1);
+
+        rho_target<tiled_grid_vector> rho_tgt(m_rho_grid);
+        update_extra_point_index();
+        deposit_densities_on_grid_target(ds, ps, rho_tgt, pslice);
+
+        py_vector rho(this->m_mesh_data.node_count());
+        rho.clear();
+        remap_tiled_grid_to_mesh(m_rho_grid, rho);
+        return rho;
       }
   };
 }
@@ -24,6 +24,9 @@
 
 
 
+#include <algorithm>
+#include <numeric>
+#include <vector>
 #include "bases.hpp"
 #include "meshdata.hpp"
 #include "tools.hpp"
@@ -34,6 +37,93 @@
 
 namespace pyrticle
 {
+  /** Node-major grid storage with \c components values per grid node
+   * that keeps track of which tiles of tile_nodes() consecutive grid
+   * nodes have been written since the last clear().
+   *
+   * The storage itself is kept across depositions, so that clear() only
+   * needs to zero the tiles touched last time, and so that consumers
+   * (such as the remap) can skip untouched tiles altogether.
+   */
+  class tiled_grid_vector
+  {
+    private:
+      unsigned m_components;
+      std::vector<double> m_values;
+      std::vector<char> m_touched;
+
+    public:
+      static unsigned tile_nodes()
+      { return 256; }
+
+      tiled_grid_vector()
+        : m_components(1)
+      { }
+
+      void resize(unsigned node_count, unsigned components)
+      {
+        if (m_values.size() == node_count*components
+            && m_components == components)
+          return;
+
+        m_components = components;
+        m_values.assign(node_count*components, 0);
+        m_touched.assign((node_count+tile_nodes()-1)/tile_nodes(), 0);
+      }
+
+      void clear()
+      {
+        const unsigned tile_size = m_components*tile_nodes();
+
+        for (unsigned tile = 0; tile < m_touched.size(); ++tile)
+          if (m_touched[tile])
+          {
+            const unsigned end = std::min<unsigned>(
+                (tile+1)*tile_size, m_values.size());
+            std::fill(m_values.begin()+tile*tile_size,
+                m_values.begin()+end, 0.);
+            m_touched[tile] = 0;
+          }
+      }
+
+      unsigned components() const
+      { return m_components; }
+
+      bool is_touched(unsigned tile) const
+      { return m_touched[tile]; }
+
+      const double *values() const
+      { return m_values.size() ? &m_values[0] : 0; }
+
+      /** Marks the tile of each entry it hands out as touched. Threads
+       * writing concurrently must write entries of disjoint tiles, since
+       * the touched flags are not synchronized.
+       */
+      class iterator
+      {
+        private:
+          tiled_grid_vector *m_vector;
+
+        public:
+          iterator(tiled_grid_vector &v)
+            : m_vector(&v)
+          { }
+
+          double &operator[](unsigned idx) const
+          {
+            tiled_grid_vector &v(*m_vector);
+            v.m_touched[idx/(v.m_components*tile_nodes())] = 1;
+            return v.m_values[idx];
+          }
+      };
+
+      iterator begin()
+      { return iterator(*this); }
+  };
+
+
+
+
   struct grid_targets
   {
     template <class VecType>
@@ -55,6 +145,19 @@ namespace pyrticle
 
         void end_particle(particle_number pn)
         { }
+
+        // tiled deposition support
+        static const unsigned tile_components = 1;
+
+        void add_to_tile(double *tile_values, const double q_shapeval) const
+        { tile_values[0] += q_shapeval; }
+
+        void add_tile_values(unsigned vec_idx, const double *tile_values)
+        { 
+          // skip empty halo entries, so as not to touch tiled targets
+          if (tile_values[0])
+            m_target[vec_idx] += tile_values[0]; 
+        }
     };
 
 
@@ -94,6 +197,23 @@ namespace pyrticle
 
         void end_particle(particle_number pn)
         { }
+
+        // tiled deposition support
+        static const unsigned tile_components = DimensionsVelocity;
+
+        void add_to_tile(double *tile_values, const double q_shapeval) const
+        {
+          for (unsigned axis = 0; axis < DimensionsVelocity; axis++)
+            tile_values[axis] += m_scale_factors[axis]*q_shapeval;
+        }
+
+        void add_tile_values(unsigned vec_idx, const double *tile_values)
+        {
+          unsigned const base = vec_idx*DimensionsVelocity;
+          for (unsigned axis = 0; axis < DimensionsVelocity; axis++)
+            if (tile_values[axis])
+              m_target[base+axis] += tile_values[axis];
+        }
     };
 
 
@@ -129,6 +249,22 @@ namespace pyrticle
           m_target1.end_particle(pn);
           m_target2.end_particle(pn);
         }
+
+        // tiled deposition support
+        static const unsigned tile_components = 
+          T1::tile_components + T2::tile_components;
+
+        void add_to_tile(double *tile_values, const double q_shapeval) const
+        {
+          m_target1.add_to_tile(tile_values, q_shapeval);
+          m_target2.add_to_tile(tile_values+T1::tile_components, q_shapeval);
+        }
+
+        void add_tile_values(unsigned vec_idx, const double *tile_values)
+        {
+          m_target1.add_tile_values(vec_idx, tile_values);
+          m_target2.add_tile_values(vec_idx, tile_values+T1::tile_components);
+        }
     };
 
 
@@ -141,6 +277,79 @@ namespace pyrticle
     {
       return chained_target<T1, T2>(target1, target2);
     }
+
+
+
+
+    /** The private storage of one tile_target. */
+    struct tile_buffer
+    {
+      unsigned m_window_start, m_window_end;
+      std::vector<double> m_values;
+      std::vector<unsigned> m_overflow_indices;
+      std::vector<double> m_overflow_values;
+    };
+
+
+
+
+    /** Reconstruction target for tiled deposition. 
+     *
+     * Contributions of a tile's particles to target indices in 
+     * [m_window_start, m_window_end) (the tile plus its halo) are 
+     * collected in the tile's buffer, all others (other bricks, periodic
+     * images, extra points) in an overflow list. Both are added to
+     * the wrapped target later.
+     *
+     * Targets are passed around by value, so the buffer is referenced,
+     * not owned.
+     */
+    template <class Target>
+    class tile_target
+    {
+      public:
+        static const unsigned components = Target::tile_components;
+
+      private:
+        Target m_target;
+        tile_buffer *m_buffer;
+
+      public:
+        tile_target(const Target &tgt, tile_buffer &buffer)
+          : m_target(tgt), m_buffer(&buffer)
+        { 
+          buffer.m_values.assign(
+              components*(buffer.m_window_end-buffer.m_window_start), 0);
+          buffer.m_overflow_indices.clear();
+          buffer.m_overflow_values.clear();
+        }
+
+        void begin_particle(particle_number pn)
+        { m_target.begin_particle(pn); }
+
+        void add_shape_value(unsigned vec_idx, double q_shapeval)
+        { 
+          tile_buffer &buf(*m_buffer);
+
+          if (vec_idx >= buf.m_window_start && vec_idx < buf.m_window_end)
+            m_target.add_to_tile(
+                &buf.m_values[components*(vec_idx-buf.m_window_start)],
+                q_shapeval);
+          else
+          {
+            buf.m_overflow_indices.push_back(vec_idx);
+            buf.m_overflow_values.resize(
+                buf.m_overflow_values.size()+components, 0);
+            m_target.add_to_tile(
+                &buf.m_overflow_values[
+                  buf.m_overflow_values.size()-components],
+                q_shapeval);
+          }
+        }
+
+        void end_particle(particle_number pn)
+        { m_target.end_particle(pn); }
+    };
   };
 
 
@@ -187,11 +396,25 @@ namespace pyrticle
       std::vector<brick_type> m_bricks;
       shape_function m_shape_function;
 
+      /** If larger than one, deposition is split into tiles that
+       * are deposited in parallel.
+       */
+      unsigned m_thread_count;
+
+    private:
+      /** Bricks are appended and replaced from Python, which modifies
+       * m_bricks directly. This is therefore (re)built lazily, whenever
+       * the bricks differ from the ones it was built from.
+       */
+      brick_overlap_index m_brick_index;
+
+    public:
+
 
 
 
       grid_depositor_base(const mesh_data &md)
-        : m_mesh_data(md)
+        : m_mesh_data(md), m_thread_count(1)
       { }
 
 
@@ -209,6 +432,28 @@ namespace pyrticle
 
 
 
+      void update_brick_index()
+      {
+        if (!m_brick_index.is_current(m_bricks))
+          m_brick_index.rebuild(m_bricks);
+      }
+
+
+
+
+      /** Find the bricks whose bounding boxes overlap \c box. Requires
+       * an up-to-date brick index, see update_brick_index().
+       */
+      void find_overlapping_bricks(const bounded_box &box,
+          std::vector<brick_number> &result) const
+      { m_brick_index.find_overlapping(box, result); }
+
+
+
+
+      /** \c candidates is scratch space for the brick lookup, passed in
+       * so that it may be reused across particles.
+       */
       template <class Target>
       void deposit_single_particle_with_cache(
           depositor_state &ds,
@@ -216,9 +461,14 @@ namespace pyrticle
           Target tgt,
           particle_number pn,
           bounded_vector const &center,
-          bounded_box const &particle_box)
+          bounded_box const &particle_box,
+          std::vector<brick_number> &candidates) const
       {
         brick_number &bn_cache(ds.m_particle_brick_numbers[pn]);
+
+        // the bricks may have changed since the cache was filled
+        if (bn_cache >= m_bricks.size())
+          bn_cache = 0;
         const brick_type &last_brick = m_bricks[bn_cache];
 
         bool is_complete;
@@ -229,12 +479,15 @@ namespace pyrticle
 
         if (!is_complete)
         {
-          BOOST_FOREACH(brick_type const &brk, m_bricks)
+          m_brick_index.find_overlapping(particle_box, candidates);
+
+          BOOST_FOREACH(brick_number bn, candidates)
           {
             // don't re-target the cached brick
-            if (brk.number() == last_brick.number())
+            if (bn == last_brick.number())
               continue;
 
+            const brick_type &brk = m_bricks[bn];
             if (static_cast<const Derived *>(this)->deposit_particle_on_one_brick(
                   tgt, brk, center, particle_box, ps.charges[pn])
                 && !does_intersect_cached)
@@ -242,7 +495,7 @@ namespace pyrticle
               // We did not intersect the cached brick, but we
               // found a brick that we *did* intersect with.
               // Update the cache.
-              bn_cache = brk.number();
+              bn_cache = bn;
             }
           }
         }
@@ -255,11 +508,14 @@ namespace pyrticle
       void deposit_single_particle_without_cache(Target tgt,
           bounded_vector const &center,
           bounded_box const &particle_box,
-          const double charge)
+          const double charge,
+          std::vector<brick_number> &candidates) const
       {
-        BOOST_FOREACH(brick_type const &brk, m_bricks)
+        m_brick_index.find_overlapping(particle_box, candidates);
+
+        BOOST_FOREACH(brick_number bn, candidates)
           static_cast<const Derived *>(this)->deposit_particle_on_one_brick(
-              tgt, brk, center, particle_box, charge);
+              tgt, m_bricks[bn], center, particle_box, charge);
       }
 
 
@@ -291,7 +547,8 @@ namespace pyrticle
           bounded_vector const &center,
           bounded_box const &particle_box,
           axis_bitfield abf,
-          periodicity_set &pset)
+          periodicity_set &pset,
+          std::vector<brick_number> &candidates) const
       {
         using boost::numeric::ublas::zero_vector;
 
@@ -300,12 +557,12 @@ namespace pyrticle
         if (abf == 0)
         {
           deposit_single_particle_with_cache(
-              ds, ps, tgt, pn, center, particle_box);
+              ds, ps, tgt, pn, center, particle_box, candidates);
         }
         else
         {
           deposit_single_particle_without_cache(
-              tgt, center, particle_box, ps.charges[pn]);
+              tgt, center, particle_box, ps.charges[pn], candidates);
         }
         pset.push_back(abf);
 
@@ -330,7 +587,7 @@ namespace pyrticle
                 bounded_box(
                   particle_box.m_lower+per_offset,
                   particle_box.m_upper+per_offset),
-                abf_plus_this, pset);
+                abf_plus_this, pset, candidates);
           }
           else if (particle_box.m_upper[axis] > p_axis.m_max)
           {
@@ -341,7 +598,7 @@ namespace pyrticle
                 bounded_box(
                   particle_box.m_lower+per_offset,
                   particle_box.m_upper+per_offset),
-                abf_plus_this, pset);
+                abf_plus_this, pset, candidates);
           }
         }
       }
@@ -351,33 +608,282 @@ namespace pyrticle
 
 
       template <class Target>
-      void deposit_densities_on_grid_target(
+      void deposit_single_particle(
           depositor_state &ds, const particle_state &ps,
-          Target tgt, boost::python::slice const &pslice)
+          Target tgt, particle_number pn,
+          const double shape_radius,
+          std::vector<brick_number> &candidates) const
       {
         const unsigned dim_x = ps.xdim();
         const unsigned dim_m = m_mesh_data.m_dimensions;
 
         using boost::numeric::ublas::scalar_vector;
-        const scalar_vector<double> shape_extent(
-            dim_m, m_shape_function.radius());
+        const scalar_vector<double> shape_extent(dim_m, shape_radius);
+
+        tgt.begin_particle(pn);
+        const bounded_vector center = subrange(
+            ps.positions, pn*dim_x, (pn+1)*dim_x);
+
+        bounded_box particle_box(
+            center - shape_extent, 
+            center + shape_extent);
+
+        periodicity_set pset;
+        deposit_periodic_copies(ds, ps, tgt, pn, center, particle_box, 0, pset,
+            candidates);
+        tgt.end_particle(pn);
+      }
+
+
+
+
+      template <class Target>
+      void deposit_densities_on_grid_target(
+          depositor_state &ds, const particle_state &ps,
+          Target tgt, boost::python::slice const &pslice)
+      {
+        update_brick_index();
+
+        if (m_thread_count > 1 && m_bricks.size())
+        {
+          deposit_densities_on_grid_target_tiled(ds, ps, tgt, pslice);
+          return;
+        }
+
+        const double shape_radius = m_shape_function.radius();
+        std::vector<brick_number> candidates;
 
         FOR_ALL_SLICE_INDICES(pslice, ps.particle_count)
         {
           FOR_ALL_SLICE_INDICES_INNER(particle_number, pn);
+          deposit_single_particle(ds, ps, tgt, pn, shape_radius, candidates);
+        }
+      }
+
+
+
+
+      // tiled parallel deposition --------------------------------------------
+      /** A slab of a brick, cut across its last axis, and thus a 
+       * contiguous range of grid nodes. Its window adds a halo of grid 
+       * nodes the shape function may reach from particles centered in 
+       * the slab.
+       */
+      struct deposition_tile
+      {
+        brick_number m_brick;
+        grid_node_number m_window_start, m_window_end;
+      };
+
+      void make_deposition_tiles(
+          std::vector<deposition_tile> &tiles,
+          std::vector<unsigned> &brick_tile_starts,
+          std::vector<unsigned> &brick_slab_widths) const
+      {
+        const unsigned wanted_tiles = 4*m_thread_count;
+        const unsigned total_nodes = std::max(1u, grid_node_count());
+
+        tiles.clear();
+        brick_tile_starts.clear();
+        brick_slab_widths.clear();
+
+        BOOST_FOREACH(brick_type const &brk, m_bricks)
+        {
+          const unsigned last = brk.dimensions().size()-1;
+          const unsigned layers = brk.dimensions()[last];
+          const unsigned layer_size = brk.strides()[last];
+
+          const unsigned halo = unsigned(ceil(
+                m_shape_function.radius()/brk.stepwidths()[last])) + 1;
+
+          const unsigned slabs = std::max(1u, 
+              unsigned(double(wanted_tiles)*brk.node_count()/total_nodes + 0.5));
+          const unsigned slab_width = std::max(halo, 
+              (layers+slabs-1)/slabs);
+
+          brick_tile_starts.push_back(tiles.size());
+          brick_slab_widths.push_back(slab_width);
+
+          for (unsigned l = 0; l < layers; l += slab_width)
+          {
+            deposition_tile tile;
+            tile.m_brick = brk.number();
+
+            const unsigned lower = l < halo ? 0 : l-halo;
+            const unsigned upper = std::min(layers, l+slab_width+halo);
+
+            // map to the derived depositor's target index space
+            std::pair<unsigned, unsigned> window = 
+              static_cast<const Derived *>(this)->target_index_window(
+                  brk.start_index() + lower*layer_size,
+                  brk.start_index() + upper*layer_size);
+            tile.m_window_start = window.first;
+            tile.m_window_end = std::max(window.first, window.second);
+
+            tiles.push_back(tile);
+          }
+        }
+        brick_tile_starts.push_back(tiles.size());
+      }
+
+
 
-          tgt.begin_particle(pn);
-          const bounded_vector center = subrange(
-              ps.positions, pn*dim_x, (pn+1)*dim_x);
 
-          bounded_box particle_box(
-              center - shape_extent, 
-              center + shape_extent);
+      /** Return the tile into which particle \c pn should go, or
+       * \c tiles.size() if its center is not inside any brick.
+       */
+      unsigned find_particle_tile(
+          const depositor_state &ds, const particle_state &ps,
+          particle_number pn,
+          const std::vector<unsigned> &brick_tile_starts,
+          const std::vector<unsigned> &brick_slab_widths,
+          std::vector<brick_number> &candidates) const
+      {
+        const unsigned dim_x = ps.xdim();
+        const bounded_vector center = subrange(
+            ps.positions, pn*dim_x, (pn+1)*dim_x);
+
+        brick_number bn = ds.m_particle_brick_numbers[pn];
+        if (bn >= m_bricks.size() 
+            || !m_bricks[bn].bounding_box().contains(center, 0))
+        {
+          m_brick_index.find_overlapping(bounded_box(center, center), candidates);
+
+          bool found = false;
+          BOOST_FOREACH(brick_number cand_bn, candidates)
+            if (m_bricks[cand_bn].bounding_box().contains(center, 0))
+            {
+              bn = cand_bn;
+              found = true;
+              break;
+            }
 
-          periodicity_set pset;
-          deposit_periodic_copies(ds, ps, tgt, pn, center, particle_box, 0, pset);
-          tgt.end_particle(pn);
+          if (!found)
+            return brick_tile_starts.back();
         }
+
+        const brick_type &brk = m_bricks[bn];
+        const unsigned last = brk.dimensions().size()-1;
+        const int layer = std::max(0, std::min(
+              int(brk.dimensions()[last])-1,
+              int(floor((center[last]-brk.origin()[last])
+                  / brk.stepwidths()[last]))));
+
+        return brick_tile_starts[bn] + layer/brick_slab_widths[bn];
+      }
+
+
+
+
+      template <class Target>
+      void deposit_densities_on_grid_target_tiled(
+          depositor_state &ds, const particle_state &ps,
+          Target tgt, boost::python::slice const &pslice)
+      {
+        std::vector<deposition_tile> tiles;
+        std::vector<unsigned> brick_tile_starts, brick_slab_widths;
+        make_deposition_tiles(tiles, brick_tile_starts, brick_slab_widths);
+
+        const unsigned tile_count = tiles.size();
+        const double shape_radius = m_shape_function.radius();
+
+        // sort particles by tile, the last "tile" holds the particles
+        // outside all bricks
+        std::vector<particle_number> particles;
+        std::vector<unsigned> particle_tiles;
+        std::vector<unsigned> tile_starts(tile_count+2, 0);
+        {
+          std::vector<brick_number> candidates;
+
+          FOR_ALL_SLICE_INDICES(pslice, ps.particle_count)
+          {
+            FOR_ALL_SLICE_INDICES_INNER(particle_number, pn);
+            particles.push_back(pn);
+
+            const unsigned tile = find_particle_tile(ds, ps, pn,
+                brick_tile_starts, brick_slab_widths, candidates);
+            particle_tiles.push_back(tile);
+            ++tile_starts[tile+1];
+          }
+        }
+
+        std::partial_sum(tile_starts.begin(), tile_starts.end(), 
+            tile_starts.begin());
+
+        std::vector<particle_number> sorted_particles(particles.size());
+        {
+          std::vector<unsigned> tile_fill(
+              tile_starts.begin(), tile_starts.end()-1);
+          for (unsigned i = 0; i < particles.size(); ++i)
+            sorted_particles[tile_fill[particle_tiles[i]]++] = particles[i];
+        }
+
+        // deposit each tile into its own buffer
+        typedef grid_targets::tile_target<Target> tile_tgt_t;
+        const unsigned components = tile_tgt_t::components;
+
+        std::vector<grid_targets::tile_buffer> buffers(tile_count);
+
+#pragma omp parallel for schedule(dynamic) num_threads(m_thread_count)
+        for (int tile_i = 0; tile_i < int(tile_count); ++tile_i)
+        {
+          grid_targets::tile_buffer &buf(buffers[tile_i]);
+          buf.m_window_start = tiles[tile_i].m_window_start;
+          buf.m_window_end = tiles[tile_i].m_window_end;
+
+          tile_tgt_t tile_tgt(tgt, buf);
+          std::vector<brick_number> candidates;
+
+          for (unsigned i = tile_starts[tile_i]; i < tile_starts[tile_i+1]; ++i)
+            deposit_single_particle(ds, ps, tile_tgt, sorted_particles[i],
+                shape_radius, candidates);
+        }
+
+        // Reduce the tile buffers, including their overlapping halos.
+        // Each thread owns a range of target indices, so that no two
+        // threads write the same entry. The ranges are made up of whole 
+        // tiled_grid_vector tiles, so that no two threads write the 
+        // same touched flag either.
+        unsigned index_end = 0;
+        BOOST_FOREACH(const deposition_tile &tile, tiles)
+          index_end = std::max(index_end, unsigned(tile.m_window_end));
+
+        const unsigned index_granule = tiled_grid_vector::tile_nodes();
+        const unsigned index_granules = 
+          (index_end+index_granule-1)/index_granule;
+        const int index_chunks = 4*m_thread_count;
+
+#pragma omp parallel for num_threads(m_thread_count)
+        for (int chunk = 0; chunk < index_chunks; ++chunk)
+        {
+          Target chunk_tgt(tgt);
+          const unsigned chunk_start = std::min(index_end, index_granule 
+              * unsigned((double(index_granules)*chunk)/index_chunks));
+          const unsigned chunk_end = std::min(index_end, index_granule 
+              * unsigned((double(index_granules)*(chunk+1))/index_chunks));
+
+          BOOST_FOREACH(const grid_targets::tile_buffer &buf, buffers)
+          {
+            const unsigned start = std::max(chunk_start, buf.m_window_start);
+            const unsigned end = std::min(chunk_end, buf.m_window_end);
+
+            for (unsigned idx = start; idx < end; ++idx)
+              chunk_tgt.add_tile_values(idx, 
+                  &buf.m_values[components*(idx-buf.m_window_start)]);
+          }
+        }
+
+        BOOST_FOREACH(const grid_targets::tile_buffer &buf, buffers)
+          for (unsigned i = 0; i < buf.m_overflow_indices.size(); ++i)
+            tgt.add_tile_values(buf.m_overflow_indices[i],
+                &buf.m_overflow_values[components*i]);
+
+        // particles outside all bricks
+        std::vector<brick_number> candidates;
+        for (unsigned i = tile_starts[tile_count]; 
+            i < tile_starts[tile_count+1]; ++i)
+          deposit_single_particle(ds, ps, tgt, sorted_particles[i],
+              shape_radius, candidates);
       }
   };
 }
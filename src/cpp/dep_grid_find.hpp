@@ -24,6 +24,8 @@
 
 
 
+#include <limits>
+#include <numeric>
 #include "grid.hpp"
 #include "dep_grid_base.hpp"
 
@@ -57,6 +59,15 @@ namespace pyrticle
       node_number_list_starts_t m_node_number_list_starts;
       node_number_lists_t m_node_number_lists;
 
+      /** The coordinates of mesh node m_node_number_lists[i] are
+       * m_node_coordinates[i*xdim] up to (but not including)
+       * m_node_coordinates[(i+1)*xdim], so that the nodes of a run of 
+       * cells may be streamed through without gathering from the mesh.
+       *
+       * Built from the above by update_node_coordinates().
+       */
+      std::vector<double> m_node_coordinates;
+
 
 
 
@@ -67,6 +78,232 @@ namespace pyrticle
 
 
 
+      // setup ----------------------------------------------------------------
+    private:
+      /** Find the grid cells containing \c pt, returning their number.
+       * The first one found is stored in \c first_cell, all of them are
+       * appended to \c all_cells, if given.
+       */
+      unsigned find_node_cells(const bounded_vector &pt,
+          std::vector<brick_number> &candidates,
+          grid_node_number &first_cell,
+          std::vector<grid_node_number> *all_cells = 0) const
+      {
+        unsigned count = 0;
+        bounded_int_vector cell;
+
+        this->find_overlapping_bricks(bounded_box(pt, pt), candidates);
+        BOOST_FOREACH(brick_number bn, candidates)
+        {
+          const brick_type &brk = this->m_bricks[bn];
+          if (brk.find_cell(pt, cell))
+          {
+            const grid_node_number gnn = brk.index(cell);
+            if (count++ == 0)
+              first_cell = gnn;
+            if (all_cells)
+              all_cells->push_back(gnn);
+          }
+        }
+
+        return count;
+      }
+
+
+
+
+    public:
+      /** Bin each mesh node into the grid cells containing it, filling 
+       * m_node_number_list_starts and m_node_number_lists. Node numbers
+       * within each cell are ascending. A node on the boundary of
+       * several bricks is binned into each of them.
+       *
+       * Finding the cells is done in parallel, using m_thread_count
+       * threads, followed by a counting sort by cell.
+       */
+      void bin_mesh_nodes()
+      {
+        m_node_coordinates.clear();
+
+        const mesh_data &md = this->m_mesh_data;
+        const int node_count = md.node_count();
+        const unsigned gnc = this->grid_node_count();
+
+        this->update_brick_index();
+
+        std::vector<grid_node_number> node_cells(node_count, 
+            std::numeric_limits<grid_node_number>::max());
+        std::vector<unsigned> node_cell_counts(node_count);
+
+#pragma omp parallel num_threads(this->m_thread_count)
+        {
+          std::vector<brick_number> candidates;
+
+#pragma omp for schedule(static)
+          for (int nn = 0; nn < node_count; ++nn)
+            node_cell_counts[nn] = find_node_cells(
+                md.mesh_node(nn), candidates, node_cells[nn]);
+        }
+
+        // Count the nodes in each cell. Nodes in more than one cell
+        // are rare, so their cells are simply looked up again.
+        std::vector<brick_number> candidates;
+        std::vector<grid_node_number> multi_cells;
+
+        m_node_number_list_starts.assign(gnc+1, 0);
+        for (int nn = 0; nn < node_count; ++nn)
+        {
+          if (node_cell_counts[nn] == 1)
+            ++m_node_number_list_starts[node_cells[nn]+1];
+          else if (node_cell_counts[nn] == 0)
+            throw std::runtime_error("dep_grid_find: unassigned mesh nodes found. "
+                "you should specify a mesh_margin when generating bricks");
+          else
+          {
+            multi_cells.clear();
+            find_node_cells(md.mesh_node(nn), candidates, 
+                node_cells[nn], &multi_cells);
+            BOOST_FOREACH(grid_node_number gnn, multi_cells)
+              ++m_node_number_list_starts[gnn+1];
+          }
+        }
+
+        std::partial_sum(
+            m_node_number_list_starts.begin(), m_node_number_list_starts.end(),
+            m_node_number_list_starts.begin());
+
+        std::vector<unsigned> cell_fill(
+            m_node_number_list_starts.begin(), m_node_number_list_starts.end()-1);
+        m_node_number_lists.resize(m_node_number_list_starts.back());
+
+        for (int nn = 0; nn < node_count; ++nn)
+        {
+          if (node_cell_counts[nn] == 1)
+            m_node_number_lists[cell_fill[node_cells[nn]]++] = nn;
+          else
+          {
+            multi_cells.clear();
+            find_node_cells(md.mesh_node(nn), candidates, 
+                node_cells[nn], &multi_cells);
+            BOOST_FOREACH(grid_node_number gnn, multi_cells)
+              m_node_number_lists[cell_fill[gnn]++] = nn;
+          }
+        }
+
+        update_node_coordinates();
+      }
+
+
+
+
+      /** Copy the mesh node coordinates into cell order, unless
+       * that is already done.
+       */
+      void update_node_coordinates()
+      {
+        const unsigned xdim = particle_state::m_xdim;
+
+        if (m_node_coordinates.size() == xdim*m_node_number_lists.size())
+          return;
+
+        m_node_coordinates.resize(xdim*m_node_number_lists.size());
+        std::vector<double>::iterator coord_it = m_node_coordinates.begin();
+        BOOST_FOREACH(mesh_data::node_number nn, m_node_number_lists)
+        {
+          const mesh_data::const_mesh_node_type node = 
+            this->m_mesh_data.mesh_node(nn);
+          coord_it = std::copy(node.begin(), node.end(), coord_it);
+        }
+      }
+
+
+
+
+      /** Return the range of mesh node numbers that the grid nodes 
+       * [grid_start, grid_end) deposit onto, for tiled deposition.
+       *
+       * Mesh node numbers need not be spatially ordered, so that range 
+       * may span most of the mesh. If it is much wider than the number
+       * of nodes actually reached, return an empty window, which sends 
+       * all of the tile's contributions to its overflow list instead of 
+       * a mostly empty, mesh-sized buffer.
+       */
+      std::pair<unsigned, unsigned> target_index_window(
+          grid_node_number grid_start, grid_node_number grid_end) const
+      {
+        static const unsigned max_window_factor = 4;
+
+        const node_number_lists_t::const_iterator
+          first = m_node_number_lists.begin() 
+          + m_node_number_list_starts[grid_start],
+          last = m_node_number_lists.begin() 
+          + m_node_number_list_starts[grid_end];
+
+        if (first == last)
+          return std::make_pair(0u, 0u);
+
+        const unsigned window_start = *std::min_element(first, last);
+        const unsigned window_end = *std::max_element(first, last) + 1;
+
+        if (window_end - window_start 
+            > max_window_factor * unsigned(last - first))
+          return std::make_pair(0u, 0u);
+
+        return std::make_pair(window_start, window_end);
+      }
+
+
+
+
+      /** Deposit one particle on the nodes of the cells 
+       * [first_cell, first_cell+cell_count), whose nodes (and their 
+       * coordinates) are contiguous, evaluating the shape function over 
+       * a chunk of nodes at a time.
+       */
+      template <class Target>
+      void deposit_particle_on_cell_run(Target &tgt,
+          grid_node_number first_cell, unsigned cell_count,
+          const bounded_vector &center, double charge) const
+      {
+        static const unsigned chunk_size = 64;
+        const unsigned xdim = particle_state::m_xdim;
+
+        double r_squared[chunk_size];
+        double shape_values[chunk_size];
+
+        const unsigned run_start = m_node_number_list_starts[first_cell];
+        const unsigned run_end = m_node_number_list_starts[first_cell+cell_count];
+
+        for (unsigned chunk_start = run_start; chunk_start < run_end; 
+            chunk_start += chunk_size)
+        {
+          const unsigned n = std::min(chunk_size, run_end-chunk_start);
+          const double *coords = &m_node_coordinates[chunk_start*xdim];
+
+          for (unsigned k = 0; k < n; ++k)
+          {
+            double r2 = 0;
+            for (unsigned d = 0; d < xdim; ++d)
+            {
+              const double dx = center[d] - coords[k*xdim+d];
+              r2 += dx*dx;
+            }
+            r_squared[k] = r2;
+          }
+
+          this->m_shape_function.evaluate_squared(r_squared, shape_values, n);
+
+          const mesh_data::node_number *node_numbers = 
+            &m_node_number_lists[chunk_start];
+          for (unsigned k = 0; k < n; ++k)
+            if (shape_values[k])
+              tgt.add_shape_value(node_numbers[k], charge*shape_values[k]);
+        }
+      }
+
+
+
+
       template <class Target>
       bool deposit_particle_on_one_brick(Target tgt, 
           const brick &brk, 
@@ -87,23 +324,19 @@ namespace pyrticle
         const bounded_int_box particle_brick_index_box = 
           brk.index_range(intersect_box);
 
-        brick::iterator it(brk, particle_brick_index_box);
+        // Cells along axis 0 are numbered contiguously, so iterate over
+        // the first cells of the axis-0 runs and handle a run at a time.
+        bounded_int_box run_starts_box = particle_brick_index_box;
+        run_starts_box.m_upper[0] = run_starts_box.m_lower[0]+1;
+        const unsigned run_length = particle_brick_index_box.m_upper[0]
+          - particle_brick_index_box.m_lower[0];
+
+        brick::iterator it(brk, run_starts_box);
 
         while (!it.at_end())
         {
-          BOOST_FOREACH(mesh_data::node_number nn, std::make_pair(
-            m_node_number_lists.begin() 
-            + m_node_number_list_starts[it.index()],
-            m_node_number_lists.begin() 
-            + m_node_number_list_starts[it.index()+1])
-              )
-          {
-            tgt.add_shape_value(nn, 
-                charge*this->m_shape_function(center
-                  - this->m_mesh_data.mesh_node(nn))
-                );
-          }
-
+          deposit_particle_on_cell_run(tgt, it.index(), run_length, 
+              center, charge);
           ++it;
         }
         
@@ -135,6 +368,7 @@ namespace pyrticle
         chained_target<rho_target<py_vector>, j_tgt_t>
             tgt(rho_tgt, j_tgt);
 
+        update_node_coordinates();
         this->deposit_densities_on_grid_target(ds, ps, tgt, pslice);
 
         return boost::make_tuple(rho, j);
@@ -157,6 +391,7 @@ namespace pyrticle
 
         j_target<particle_state::m_vdim, py_vector, py_vector> 
           j_tgt(j, velocities);
+        update_node_coordinates();
         this->deposit_densities_on_grid_target(ds, ps, j_tgt, pslice);
         return j;
       }
@@ -172,6 +407,7 @@ namespace pyrticle
         py_vector rho(this->m_mesh_data.node_count());
 
         rho_target<py_vector> rho_tgt(rho);
+        update_node_coordinates();
         this->deposit_densities_on_grid_target(ds, ps, rho_tgt, pslice);
         return rho;
       }
@@ -63,9 +63,6 @@ namespace pyrticle
           m_state = m_bounds.m_upper;
       }
 
-      virtual ~brick_iterator()
-      { }
-
       const bounded_int_vector &operator*() const
       { return m_state; }
 
@@ -101,7 +98,7 @@ namespace pyrticle
 
 
     public:
-      virtual brick_iterator &operator++()
+      brick_iterator &operator++()
       {
         const unsigned i = 0; // silently assuming non-zero size here
 
@@ -267,15 +264,26 @@ namespace pyrticle
         return result;
       }
 
-      bounded_int_vector which_cell(const bounded_vector &pt) const
+      /** Like which_cell(), but return false instead of throwing
+       * if \c pt is outside of this brick.
+       */
+      bool find_cell(const bounded_vector &pt, bounded_int_vector &result) const
       {
-        bounded_int_vector result = pyublas::unary_op<int_floor>::apply(
+        result = pyublas::unary_op<int_floor>::apply(
               element_div(pt-m_origin, m_stepwidths));
         
         for (unsigned i = 0; i < result.size(); ++i)
           if (result[i] < 0 || result[i] >= m_dimensions[i])
-            throw std::invalid_argument("point is out of this brick's bounds");
+            return false;
 
+        return true;
+      }
+
+      bounded_int_vector which_cell(const bounded_vector &pt) const
+      {
+        bounded_int_vector result;
+        if (!find_cell(pt, result))
+          throw std::invalid_argument("point is out of this brick's bounds");
         return result;
       }
 
@@ -330,6 +338,42 @@ namespace pyrticle
             );
       }
 
+      /** The largest distance along each axis by which a grid point may
+       * deviate from the center of its cell.
+       */
+      bounded_vector point_slack() const
+      { return zero_vector(m_dimensions.size()); }
+
+      /** Store in \c result the squared distances from \c center of the
+       * \c length grid points starting at \c first along axis 0.
+       *
+       * Like point_slack(), this is deliberately non-virtual, so that
+       * brick-type templates such as for_each_row_in_sphere() get
+       * the statically right one.
+       */
+      void row_distances_squared(
+          const bounded_int_vector &first, unsigned length,
+          const bounded_vector &center, double *result) const
+      {
+        double perp_squared = 0;
+        for (unsigned i = 1; i < m_dimensions.size(); ++i)
+        {
+          const double dx = m_origin_plus_half[i] 
+            + first[i]*m_stepwidths[i] - center[i];
+          perp_squared += dx*dx;
+        }
+
+        const double x0 = m_origin_plus_half[0] 
+          + first[0]*m_stepwidths[0] - center[0];
+        const double h = m_stepwidths[0];
+
+        for (unsigned k = 0; k < length; ++k)
+        {
+          const double dx = x0 + k*h;
+          result[k] = perp_squared + dx*dx;
+        }
+      }
+
       typedef brick_iterator<brick> iterator;
       
       iterator get_iterator(bounded_int_box const &bounds) const
@@ -349,6 +393,7 @@ namespace pyrticle
       typedef brick super;
       std::vector<bounded_vector> m_point_origins;
       std::vector<bounded_vector> m_axis0_offsets;
+      double m_jiggle_radius;
 
     public:
       jiggly_brick(
@@ -358,7 +403,8 @@ namespace pyrticle
           bounded_vector origin,
           bounded_int_vector dimensions,
           double jiggle_radius)
-        : super(number, start_index, stepwidths, origin, dimensions)
+        : super(number, start_index, stepwidths, origin, dimensions),
+        m_jiggle_radius(fabs(jiggle_radius))
       { 
         boost::variate_generator<
           boost::mt19937, 
@@ -395,6 +441,45 @@ namespace pyrticle
           % point_origin_count;
       }
 
+      bounded_vector point_slack() const
+      { return m_jiggle_radius*m_stepwidths; }
+
+      void row_distances_squared(
+          const bounded_int_vector &first, unsigned length,
+          const bounded_vector &center, double *result) const
+      {
+        // The point origin cycles along axis 0, so there are only
+        // point_origin_count distinct perpendicular distances.
+        double perp_squared[point_origin_count];
+        double x0[point_origin_count];
+
+        for (unsigned o = 0; o < point_origin_count; ++o)
+        {
+          const bounded_vector &po = m_point_origins[o];
+
+          perp_squared[o] = 0;
+          for (unsigned i = 1; i < m_dimensions.size(); ++i)
+          {
+            const double dx = po[i] + first[i]*m_stepwidths[i] - center[i];
+            perp_squared[o] += dx*dx;
+          }
+
+          x0[o] = po[0] + first[0]*m_stepwidths[0] - center[0];
+        }
+
+        const double h = m_stepwidths[0];
+        unsigned o = origin_index(first);
+
+        for (unsigned k = 0; k < length; ++k)
+        {
+          const double dx = x0[o] + k*h;
+          result[k] = perp_squared[o] + dx*dx;
+
+          if (++o == point_origin_count)
+            o = 0;
+        }
+      }
+
       class iterator : public brick_iterator<jiggly_brick>
       {
         private:
@@ -422,8 +507,8 @@ namespace pyrticle
 
             if (m_state[0] < m_bounds.m_upper[0])
             {
-              m_origin_index = (m_origin_index + 1) % point_origin_count;
               m_point += m_brick.m_axis0_offsets[m_origin_index];
+              m_origin_index = (m_origin_index + 1) % point_origin_count;
               m_index += m_brick.strides()[0];
             }
             else
@@ -447,6 +532,300 @@ namespace pyrticle
       iterator get_iterator(bounded_box const &bounds) const
       { return iterator(*this, index_range(bounds)); }
   };
+
+
+
+
+  // row-span iteration -------------------------------------------------------
+  /** A contiguous run of grid points along axis 0 of a brick. */
+  struct brick_row
+  {
+    bounded_int_vector m_first;
+    grid_node_number m_first_index;
+    unsigned m_length;
+  };
+
+
+
+
+  /** Call \c visitor with each axis-0 run of grid points of \c brk
+   * within \c bounds, clipped to the points that may lie within 
+   * \c radius of \c center.
+   *
+   * The clipping is conservative by the brick's point_slack().
+   */
+  template <class Brick, class RowVisitor>
+  void for_each_row_in_sphere(const Brick &brk,
+      const bounded_int_box &bounds,
+      const bounded_vector &center, const double radius,
+      RowVisitor &visitor)
+  {
+    if (bounds.is_empty())
+      return;
+
+    const unsigned dims = brk.dimensions().size();
+    const bounded_vector &h = brk.stepwidths();
+    const bounded_vector cell_center_origin = brk.origin() + h/2;
+    const bounded_vector slack = brk.point_slack();
+    const double radius_squared = radius*radius;
+
+    brick_row row;
+    row.m_first = bounds.m_lower;
+
+    while (true)
+    {
+      // distance from center to the row, across axes 1..dims-1
+      double perp_squared = 0;
+      for (unsigned i = 1; i < dims; ++i)
+      {
+        const double dx = std::max(0.,
+            fabs(cell_center_origin[i] + row.m_first[i]*h[i] - center[i])
+            - slack[i]);
+        perp_squared += dx*dx;
+      }
+
+      if (perp_squared <= radius_squared)
+      {
+        const double half_chord = sqrt(radius_squared-perp_squared) + slack[0];
+        const int lower = std::max(int(bounds.m_lower[0]), int(ceil(
+              (center[0] - half_chord - cell_center_origin[0])/h[0])));
+        const int upper = std::min(int(bounds.m_upper[0]), int(floor(
+              (center[0] + half_chord - cell_center_origin[0])/h[0]))+1);
+
+        if (lower < upper)
+        {
+          row.m_first[0] = lower;
+          row.m_first_index = brk.index(row.m_first);
+          row.m_length = upper-lower;
+          visitor(row);
+        }
+      }
+
+      unsigned i = 1;
+      while (i < dims)
+      {
+        if (++row.m_first[i] < bounds.m_upper[i])
+          break;
+        row.m_first[i] = bounds.m_lower[i];
+        ++i;
+      }
+      if (i >= dims)
+        break;
+    }
+  }
+
+
+
+
+  /** A coarse uniform bin grid over the bounding boxes of a set of bricks,
+   * listing for each bin the bricks that overlap it.
+   *
+   * This lets a particle find the (few) bricks its shape function support
+   * intersects without looking at every brick.
+   */
+  class brick_overlap_index
+  {
+    public:
+      static const unsigned max_bins_per_axis = 32;
+
+    private:
+      /** The numbers and bounding boxes of the bricks the index was
+       * built from, see is_current().
+       */
+      std::vector<brick_number> m_brick_numbers;
+      std::vector<bounded_box> m_brick_boxes;
+
+      bounded_vector m_origin;
+      bounded_vector m_bin_widths;
+      bounded_int_vector m_bin_counts;
+      bounded_int_vector m_bin_strides;
+
+      /** The bricks overlapping bin \c i are
+       * m_bin_bricks[m_bin_starts[i]:m_bin_starts[i+1]].
+       */
+      std::vector<unsigned> m_bin_starts;
+      std::vector<brick_number> m_bin_bricks;
+
+    public:
+      unsigned brick_count() const
+      { return m_brick_boxes.size(); }
+
+      /** Whether the index was built from bricks with the same numbers
+       * and bounding boxes as \c bricks.
+       */
+      template <class Brick>
+      bool is_current(const std::vector<Brick> &bricks) const
+      {
+        if (bricks.size() != m_brick_boxes.size())
+          return false;
+
+        for (unsigned i = 0; i < bricks.size(); ++i)
+          if (bricks[i].number() != m_brick_numbers[i]
+              || bricks[i].bounding_box() != m_brick_boxes[i])
+            return false;
+
+        return true;
+      }
+
+      template <class Brick>
+      void rebuild(const std::vector<Brick> &bricks)
+      {
+        m_brick_numbers.clear();
+        m_brick_boxes.clear();
+        BOOST_FOREACH(const Brick &brk, bricks)
+        {
+          m_brick_numbers.push_back(brk.number());
+          m_brick_boxes.push_back(brk.bounding_box());
+        }
+
+        m_bin_starts.clear();
+        m_bin_bricks.clear();
+
+        if (bricks.size() == 0)
+          return;
+
+        const unsigned dims = bricks[0].dimensions().size();
+
+        // find the overall extent and the smallest brick along each axis
+        bounded_box bounds = bricks[0].bounding_box();
+        bounded_vector min_extent = bounds.m_upper - bounds.m_lower;
+
+        BOOST_FOREACH(const Brick &brk, bricks)
+        {
+          const bounded_box brk_box = brk.bounding_box();
+          for (unsigned i = 0; i < dims; ++i)
+          {
+            bounds.m_lower[i] = std::min(bounds.m_lower[i], brk_box.m_lower[i]);
+            bounds.m_upper[i] = std::max(bounds.m_upper[i], brk_box.m_upper[i]);
+            min_extent[i] = std::min(min_extent[i],
+                brk_box.m_upper[i] - brk_box.m_lower[i]);
+          }
+        }
+
+        m_origin = bounds.m_lower;
+        m_bin_widths.resize(dims);
+        m_bin_counts.resize(dims);
+        m_bin_strides.resize(dims);
+
+        unsigned bin_count = 1;
+        for (unsigned i = 0; i < dims; ++i)
+        {
+          const double extent = bounds.m_upper[i] - bounds.m_lower[i];
+          const unsigned n = std::max(1, std::min(int(max_bins_per_axis), 
+                int(ceil(extent/min_extent[i]))));
+
+          m_bin_counts[i] = n;
+          m_bin_widths[i] = extent/n;
+          m_bin_strides[i] = bin_count;
+          bin_count *= n;
+        }
+
+        // counting sort of (bin, brick) pairs
+        std::vector<unsigned> counts(bin_count, 0);
+        for (unsigned pass = 0; pass < 2; ++pass)
+        {
+          if (pass == 1)
+          {
+            m_bin_starts.resize(bin_count+1);
+            m_bin_starts[0] = 0;
+            for (unsigned b = 0; b < bin_count; ++b)
+              m_bin_starts[b+1] = m_bin_starts[b] + counts[b];
+            m_bin_bricks.resize(m_bin_starts.back());
+            std::copy(m_bin_starts.begin(), m_bin_starts.end()-1,
+                counts.begin());
+          }
+
+          BOOST_FOREACH(const Brick &brk, bricks)
+          {
+            const bounded_int_box bins = bin_range(brk.bounding_box());
+            if (bins.is_empty())
+              continue;
+
+            bounded_int_vector state = bins.m_lower;
+            while (true)
+            {
+              const unsigned b = inner_prod(state, m_bin_strides);
+              if (pass == 0)
+                ++counts[b];
+              else
+                m_bin_bricks[counts[b]++] = brk.number();
+
+              unsigned i = 0;
+              while (i < dims)
+              {
+                if (++state[i] < bins.m_upper[i])
+                  break;
+                state[i] = bins.m_lower[i];
+                ++i;
+              }
+              if (i == dims)
+                break;
+            }
+          }
+        }
+      }
+
+      /** Clear \c result and fill it with the numbers of all bricks that
+       * may intersect \c box, in ascending order and without duplicates.
+       */
+      void find_overlapping(const bounded_box &box, 
+          std::vector<brick_number> &result) const
+      {
+        result.clear();
+        if (m_bin_starts.size() == 0)
+          return;
+
+        const unsigned dims = m_bin_counts.size();
+        const bounded_int_box bins = bin_range(box);
+        if (bins.is_empty())
+          return;
+
+        bounded_int_vector state = bins.m_lower;
+        while (true)
+        {
+          const unsigned b = inner_prod(state, m_bin_strides);
+          result.insert(result.end(),
+              m_bin_bricks.begin() + m_bin_starts[b],
+              m_bin_bricks.begin() + m_bin_starts[b+1]);
+
+          unsigned i = 0;
+          while (i < dims)
+          {
+            if (++state[i] < bins.m_upper[i])
+              break;
+            state[i] = bins.m_lower[i];
+            ++i;
+          }
+          if (i == dims)
+            break;
+        }
+
+        std::sort(result.begin(), result.end());
+        result.erase(std::unique(result.begin(), result.end()), result.end());
+      }
+
+    private:
+      /** Return the (clamped) range of bins touched by \c box. The range
+       * errs on the side of inclusion.
+       */
+      bounded_int_box bin_range(const bounded_box &box) const
+      {
+        const unsigned dims = m_bin_counts.size();
+        const bounded_int_vector d_vector(dims);
+        bounded_int_box result(d_vector, d_vector);
+
+        for (unsigned i = 0; i < dims; ++i)
+        {
+          const int lower = int(floor((box.m_lower[i]-m_origin[i])/m_bin_widths[i]));
+          const int upper = int(floor((box.m_upper[i]-m_origin[i])/m_bin_widths[i]))+1;
+
+          result.m_lower[i] = std::max(lower, 0);
+          result.m_upper[i] = std::min(upper, int(m_bin_counts[i]));
+        }
+
+        return result;
+      }
+  };
 }
 
 
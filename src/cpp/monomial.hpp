@@ -0,0 +1,121 @@
+// Pyrticle - Particle in Cell in Python
+// Monomial bases on the unit element
+// Copyright (C) 2007 Andreas Kloeckner
+// 
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+
+
+
+#ifndef _AHFDYUA_PYRTICLE_MONOMIAL_HPP_INCLUDED
+#define _AHFDYUA_PYRTICLE_MONOMIAL_HPP_INCLUDED
+
+
+
+
+#include <cmath>
+#include <vector>
+#include <boost/foreach.hpp>
+#include <boost/assign/list_of.hpp> 
+#include "tools.hpp"
+
+
+
+
+namespace pyrticle
+{
+  struct monomial_basis_function
+  {
+    /* exponents in each coordinate direction */
+    std::vector<unsigned> m_exponents;
+
+    monomial_basis_function(const std::vector<unsigned> &exponents)
+      : m_exponents(exponents)
+    { }
+
+    monomial_basis_function(unsigned i, unsigned j)
+    { m_exponents = boost::assign::list_of(i)(j); }
+
+    monomial_basis_function(unsigned i, unsigned j, unsigned k)
+    { m_exponents = boost::assign::list_of(i)(j)(k); }
+
+    template <class VecType>
+    const double operator()(const VecType &v) const
+    {
+      double result = 1;
+      unsigned i = 0;
+      BOOST_FOREACH(unsigned exp, m_exponents)
+        result *= pow(v[i++], exp);
+
+      return result;
+    }
+  };
+
+
+
+
+  struct local_monomial_discretization
+  {
+    static const unsigned max_supported_degree = 20;
+
+    std::vector<monomial_basis_function> m_basis;
+
+    /* inverse of the transposed nodal Vandermonde matrix */
+    py_fortran_matrix m_inverse_vandermonde_t;
+
+    unsigned max_degree() const
+    {
+      unsigned result = 0;
+      BOOST_FOREACH(const monomial_basis_function &bf, m_basis)
+        BOOST_FOREACH(unsigned exp, bf.m_exponents)
+          result = std::max(result, exp);
+      return result;
+    }
+
+    /** Evaluate all basis functions at \c unit_pt into \c result.
+     *
+     * Rather than calling pow() for every exponent, this builds a table
+     * of coordinate powers up to \c max_degree by repeated multiplication
+     * and forms each monomial as a product of table entries.
+     */
+    template <unsigned Dimensions, class VecType, class OutputIterator>
+    void evaluate_basis(const VecType &unit_pt, 
+        const unsigned max_degree,
+        OutputIterator result) const
+    {
+      double powers[Dimensions][max_supported_degree+1];
+
+      for (unsigned d = 0; d < Dimensions; ++d)
+      {
+        powers[d][0] = 1;
+        for (unsigned exp = 1; exp <= max_degree; ++exp)
+          powers[d][exp] = powers[d][exp-1] * unit_pt[d];
+      }
+
+      BOOST_FOREACH(const monomial_basis_function &bf, m_basis)
+      {
+        double value = 1;
+        for (unsigned d = 0; d < Dimensions; ++d)
+          value *= powers[d][bf.m_exponents[d]];
+        *result++ = value;
+      }
+    }
+  };
+}
+
+
+
+
+#endif
@@ -28,14 +28,25 @@
 #include "bases.hpp"
 #include "dep_target.hpp"
 #include "particle_state.hpp"
+#include "push_fields.hpp"
 
 
 
 
 namespace pyrticle
 {
-  template <unsigned DimensionsVelocity, class FX, class FY, class FZ>
-  class force_averaging_target
+  /** Averages all six E and B components against the particle's shape
+   * in one pass per element, and accumulates the resulting electric and
+   * magnetic forces.
+   *
+   * The weighted shape (shape times integral weights) is formed only once
+   * per element and reused for the charge integral, all field components
+   * and, if requested, their squares. Field values are read from
+   * an interleaved_field_block, so that each element's fields are
+   * one contiguous run of memory.
+   */
+  template <unsigned DimensionsVelocity>
+  class field_averaging_target
   {
     public:
       static const unsigned field_components = 3;
@@ -43,94 +54,132 @@ namespace pyrticle
               boost::numeric::ublas::bounded_array<double, field_components> >
                 field_vector_t;
 
-    protected:
-      particle_number m_current_particle;
+    private:
       const mesh_data &m_mesh_data;
       const dyn_vector &m_integral_weights;
-      const FX       &m_fx;
-      const FY       &m_fy;
-      const FZ       &m_fz;
-      py_vector      m_particlewise_field;
-      py_vector      m_field_stddev;
-      field_vector_t m_qfield_accumulator;
-      double         m_qfield_square_accumulator;
-      double         m_particle_charge;
+
+      const interleaved_field_block &m_fields;
+
+      const py_vector &m_velocities;
+      py_vector::const_iterator m_charges;
+
+      py_vector &m_el_force;
+      py_vector &m_mag_force;
+
+      py_vector m_particlewise_e;
+      py_vector m_particlewise_b;
+      py_vector m_e_stddev;
+      py_vector m_b_stddev;
+
+      stats_gatherer<double> *m_e_normalization_stats;
+      stats_gatherer<double> *m_b_normalization_stats;
+
+      dyn_vector m_weighted_shape;
+
+      field_vector_t m_qe_accumulator;
+      field_vector_t m_qb_accumulator;
+      double m_qe_square_accumulator;
+      double m_qb_square_accumulator;
+      double m_particle_charge;
 
     public:
-      force_averaging_target(
+      field_averaging_target(
           const mesh_data &md,
           const dyn_vector &integral_weights,
-          const FX &fx, const FY &fy, const FZ &fz,
-          py_vector particlewise_field,
-          py_vector field_stddev
+          const interleaved_field_block &fields,
+          const py_vector &velocities,
+          const py_vector &charges,
+          py_vector &el_force,
+          py_vector &mag_force,
+          py_vector particlewise_e,
+          py_vector particlewise_b,
+          py_vector e_stddev,
+          py_vector b_stddev,
+          stats_gatherer<double> *e_normalization_stats,
+          stats_gatherer<double> *b_normalization_stats
           )
         : 
-          m_current_particle(INVALID_PARTICLE), 
           m_mesh_data(md),
           m_integral_weights(integral_weights),
-          m_fx(fx), m_fy(fy), m_fz(fz),
-          m_particlewise_field(particlewise_field),
-          m_field_stddev(field_stddev),
-          m_qfield_accumulator(field_components),
-          m_qfield_square_accumulator(0),
+          m_fields(fields),
+          m_velocities(velocities),
+          m_charges(charges.begin()),
+          m_el_force(el_force),
+          m_mag_force(mag_force),
+          m_particlewise_e(particlewise_e),
+          m_particlewise_b(particlewise_b),
+          m_e_stddev(e_stddev),
+          m_b_stddev(b_stddev),
+          m_e_normalization_stats(e_normalization_stats),
+          m_b_normalization_stats(b_normalization_stats),
+          m_weighted_shape(integral_weights.size()),
+          m_qe_accumulator(field_components),
+          m_qb_accumulator(field_components),
+          m_qe_square_accumulator(0),
+          m_qb_square_accumulator(0),
           m_particle_charge(0)
       { 
-        if (m_field_stddev.is_valid() && !m_particlewise_field.is_valid())
+        if ((m_e_stddev.is_valid() && !m_particlewise_e.is_valid())
+            || (m_b_stddev.is_valid() && !m_particlewise_b.is_valid()))
           throw std::runtime_error("cannot acquire field stddev without acquiring mean field");
       }
 
       void begin_particle(particle_number pn)
       {
-        m_current_particle = pn;
-        m_qfield_accumulator.clear();
-        m_qfield_square_accumulator = 0;
+        m_qe_accumulator.clear();
+        m_qb_accumulator.clear();
+        m_qe_square_accumulator = 0;
+        m_qb_square_accumulator = 0;
         m_particle_charge = 0;
       }
 
-      template <class RhoExpression>
-      double weigh_field_component(
-          const py_vector &field, 
+    private:
+      template <bool WithSquares>
+      void gather_fields(
           const mesh_data::node_number start_idx, 
-          const RhoExpression &rho_contrib)
+          const unsigned node_count,
+          const double jacobian)
       {
-        return inner_prod(
-              subrange(field, start_idx, start_idx+rho_contrib.size()),
-              element_prod(rho_contrib, m_integral_weights));
-      }
+        double qex = 0, qey = 0, qez = 0;
+        double qbx = 0, qby = 0, qbz = 0;
+        double qe_sq = 0, qb_sq = 0;
 
-      template <class RhoExpression>
-      double weigh_field_component(
-          const zero_vector &field, 
-          const mesh_data::node_number start_idx, 
-          const RhoExpression &rho_contrib)
-      {
-        return 0;
-      }
+        dyn_vector::const_iterator w = m_weighted_shape.begin();
+        const double *f = m_fields.node(start_idx);
 
-      template <class RhoExpression>
-      double weigh_field_component_squared(
-          const py_vector &field, 
-          const mesh_data::node_number start_idx, 
-          const RhoExpression &rho_contrib)
-      {
-        boost::numeric::ublas::vector_range<const py_vector>
-          field_range(field, 
-              boost::numeric::ublas::range(start_idx, start_idx+rho_contrib.size()));
+        for (unsigned i = 0; i < node_count; 
+            ++i, ++w, f += interleaved_field_block::field_components)
+        {
+          const double ex = f[0], ey = f[1], ez = f[2];
+          const double bx = f[3], by = f[4], bz = f[5];
 
-        return inner_prod(
-            element_prod(field_range, field_range),
-            element_prod(rho_contrib, m_integral_weights));
-      }
+          qex += ex * *w; qey += ey * *w; qez += ez * *w;
+          qbx += bx * *w; qby += by * *w; qbz += bz * *w;
 
-      template <class RhoExpression>
-      double weigh_field_component_squared(
-          const zero_vector &field, 
-          const mesh_data::node_number start_idx, 
-          const RhoExpression &rho_contrib)
-      {
-        return 0;
+          if (WithSquares)
+          {
+            qe_sq += (ex*ex + ey*ey + ez*ez) * *w;
+            qb_sq += (bx*bx + by*by + bz*bz) * *w;
+          }
+        }
+
+        // Important: recall that these result in an average normalized
+        // to the particle's charge.
+        m_qe_accumulator[0] += jacobian*qex;
+        m_qe_accumulator[1] += jacobian*qey;
+        m_qe_accumulator[2] += jacobian*qez;
+        m_qb_accumulator[0] += jacobian*qbx;
+        m_qb_accumulator[1] += jacobian*qby;
+        m_qb_accumulator[2] += jacobian*qbz;
+
+        if (WithSquares)
+        {
+          m_qe_square_accumulator += jacobian*qe_sq;
+          m_qb_square_accumulator += jacobian*qb_sq;
+        }
       }
 
+    public:
       template <class RhoExpression>
       void add_shape_on_element(
           const mesh_data::element_number en, 
@@ -139,194 +188,100 @@ namespace pyrticle
           )
       {
         const double jacobian = m_mesh_data.m_element_info[en].m_jacobian;
+        const unsigned node_count = rho_contrib.size();
 
-        // Important: recall that these result in an average normalized
-        // to the particle's charge.
-        field_vector_t qfield(field_components);
-        qfield[0] = jacobian*weigh_field_component(m_fx, start_idx, rho_contrib);
-        qfield[1] = jacobian*weigh_field_component(m_fy, start_idx, rho_contrib);
-        qfield[2] = jacobian*weigh_field_component(m_fz, start_idx, rho_contrib);
+        if (m_weighted_shape.size() != node_count)
+          m_weighted_shape.resize(node_count, false);
+        noalias(m_weighted_shape) = element_prod(rho_contrib, m_integral_weights);
 
-        m_qfield_accumulator += qfield;
+        m_particle_charge += jacobian * sum(m_weighted_shape);
 
-        m_particle_charge += jacobian * inner_prod(rho_contrib, m_integral_weights);
-
-        if (m_particlewise_field.is_valid())
-        {
-          subrange(m_particlewise_field, 
-              m_current_particle*field_components, 
-              (m_current_particle+1)*field_components) += qfield;
-          if (m_field_stddev.is_valid())
-          {
-            m_qfield_square_accumulator += 
-              jacobian*(
-                  weigh_field_component_squared(m_fx, start_idx, rho_contrib)
-                  + weigh_field_component_squared(m_fy, start_idx, rho_contrib)
-                  + weigh_field_component_squared(m_fz, start_idx, rho_contrib));
-          }
-        }
+        if (m_e_stddev.is_valid() || m_b_stddev.is_valid())
+          gather_fields<true>(start_idx, node_count, jacobian);
+        else
+          gather_fields<false>(start_idx, node_count, jacobian);
       }
 
-      void end_particle(particle_number pn)
-      { 
-        if (m_particlewise_field.is_valid())
-        {
-          boost::numeric::ublas::vector_range<py_vector>
-            particle_field(m_particlewise_field, 
-                boost::numeric::ublas::range(
-                  pn*field_components, 
-                  (pn+1)*field_components));
+    private:
+      void store_particlewise_field(particle_number pn,
+          const field_vector_t &qfield, 
+          double square_accumulator,
+          py_vector &particlewise_field, 
+          py_vector &field_stddev)
+      {
+        if (!particlewise_field.is_valid())
+          return;
 
-          if (m_particle_charge == 0)
-          {
-            WARN(str(boost::format(
-                    "average pusher: particle %d had zero reconstructed charge") % pn
-                  ));
-            m_field_stddev[pn] = 0;
-            return;
-          }
+        boost::numeric::ublas::vector_range<py_vector>
+          particle_field(particlewise_field, 
+              boost::numeric::ublas::range(
+                pn*field_components, 
+                (pn+1)*field_components));
 
-          particle_field /= m_particle_charge;
+        particle_field = qfield/m_particle_charge;
 
-          if (m_field_stddev.is_valid())
-          {
-            const double squared_mean = m_qfield_square_accumulator/m_particle_charge;
-            const double mean_squared = inner_prod(particle_field, particle_field);
+        if (field_stddev.is_valid())
+        {
+          const double squared_mean = square_accumulator/m_particle_charge;
+          const double mean_squared = inner_prod(particle_field, particle_field);
 
-            double variance = squared_mean - mean_squared;
-            if (variance < 0)
+          double variance = squared_mean - mean_squared;
+          if (variance < 0)
+          {
+            if (fabs(variance) > squared_mean * 1e-3)
             {
-              if (fabs(variance) > squared_mean * 1e-3)
-              {
-                std::cout 
-                 << boost::format("squared_mean (%g) > mean_squared (%g) in calculating stddev, variance=%g")
-                 % squared_mean % mean_squared % variance
-                 << std::endl;
-              }
-              m_field_stddev[pn] = 0;
+              std::cout 
+               << boost::format("squared_mean (%g) > mean_squared (%g) in calculating stddev, variance=%g")
+               % squared_mean % mean_squared % variance
+               << std::endl;
             }
-            else
-              m_field_stddev[pn] = sqrt(variance);
+            field_stddev[pn] = 0;
           }
+          else
+            field_stddev[pn] = sqrt(variance);
         }
       }
 
-  };
-
-
-
-
-  template <unsigned DimensionsVelocity, class FX, class FY, class FZ>
-  class el_force_averaging_target : 
-    public force_averaging_target<DimensionsVelocity, FX, FY, FZ>
-  {
-    private:
-      typedef force_averaging_target<DimensionsVelocity, FX, FY, FZ> super;
-      stats_gatherer<double> *m_normalization_stats;
-      py_vector::const_iterator m_charges;
-      py_vector  &m_result;
-
     public:
-      el_force_averaging_target(
-          const mesh_data &md,
-          const dyn_vector &integral_weights,
-          const FX &fx, const FY &fy, const FZ &fz,
-          py_vector particlewise_field,
-          py_vector field_stddev,
-          stats_gatherer<double> *normalization_stats,
-          const py_vector &charges,
-          py_vector &result
-          )
-        : 
-          super(md, integral_weights, 
-              fx, fy, fz, 
-              particlewise_field, field_stddev),
-          m_normalization_stats(normalization_stats),
-          m_charges(charges.begin()),
-          m_result(result)
-      { }
-
       void end_particle(particle_number pn)
-      {
-        super::end_particle(pn);
-
-        unsigned 
-          pstart = pn*DimensionsVelocity,
-          pend = (pn+1)*DimensionsVelocity;
-
-        if (this->m_particle_charge == 0)
+      { 
+        if (m_particle_charge == 0)
+        {
+          if (m_particlewise_e.is_valid() || m_particlewise_b.is_valid())
+            WARN(str(boost::format(
+                    "average pusher: particle %d had zero reconstructed charge") % pn
+                  ));
+          if (m_e_stddev.is_valid())
+            m_e_stddev[pn] = 0;
+          if (m_b_stddev.is_valid())
+            m_b_stddev[pn] = 0;
           return;
+        }
 
-        const double scale = m_charges[pn]/this->m_particle_charge;
-
-        if (m_normalization_stats)
-          m_normalization_stats->add(scale);
-
-        noalias(subrange(m_result, pstart, pend)) += 
-          scale*subrange(
-              this->m_qfield_accumulator,
-              0, DimensionsVelocity);
-      }
-  };
-
-
-
-
-  template <unsigned DimensionsVelocity, class FX, class FY, class FZ>
-  class mag_force_averaging_target : 
-    public force_averaging_target<DimensionsVelocity, FX, FY, FZ>
-  {
-    private:
-      typedef force_averaging_target<DimensionsVelocity, FX, FY, FZ> super;
-      const py_vector &m_velocities;
-      
-      stats_gatherer<double> *m_normalization_stats;
-      py_vector::const_iterator m_charges;
-      py_vector &m_result;
-
-    public:
-      mag_force_averaging_target(
-          const mesh_data &md,
-          const dyn_vector &integral_weights,
-          const FX &fx, const FY &fy, const FZ &fz,
-          const py_vector &velocities,
-          py_vector particlewise_field,
-          py_vector field_stddev,
-          stats_gatherer<double> *normalization_stats,
-          const py_vector &charges,
-          py_vector &result
-          )
-        : 
-          super(md, integral_weights, 
-              fx, fy, fz, 
-              particlewise_field, field_stddev), 
-          m_velocities(velocities),
-          m_normalization_stats(normalization_stats),
-          m_charges(charges.begin()),
-          m_result(result)
-      { }
-
-      void end_particle(particle_number pn)
-      {
-        super::end_particle(pn);
+        store_particlewise_field(pn, m_qe_accumulator, m_qe_square_accumulator,
+            m_particlewise_e, m_e_stddev);
+        store_particlewise_field(pn, m_qb_accumulator, m_qb_square_accumulator,
+            m_particlewise_b, m_b_stddev);
 
         unsigned 
           pstart = pn*DimensionsVelocity,
           pend = (pn+1)*DimensionsVelocity;
 
-        if (this->m_particle_charge == 0)
-          return;
+        const double scale = m_charges[pn]/m_particle_charge;
 
-        const double scale = m_charges[pn]/this->m_particle_charge;
+        if (m_e_normalization_stats)
+          m_e_normalization_stats->add(scale);
+        if (m_b_normalization_stats)
+          m_b_normalization_stats->add(scale);
 
-        if (m_normalization_stats)
-          m_normalization_stats->add(scale);
+        noalias(subrange(m_el_force, pstart, pend)) += 
+          scale*subrange(m_qe_accumulator, 0, DimensionsVelocity);
 
-        noalias(subrange(m_result, pstart, pend)) += 
+        noalias(subrange(m_mag_force, pstart, pend)) += 
           subrange(
               scale*cross<bounded_vector>(
                 subrange(m_velocities, pstart, pend), 
-                this->m_qfield_accumulator),
+                m_qb_accumulator),
               0, DimensionsVelocity);
       }
   };
@@ -340,6 +295,7 @@ namespace pyrticle
     private:
       dyn_vector m_integral_weights;
       const mesh_data &m_mesh_data;
+      interleaved_field_block m_fields;
 
     public:
       typedef ParticleState particle_state;
@@ -367,9 +323,8 @@ namespace pyrticle
       // force calculation --------------------------------------------------
       // why all these template arguments? In 2D and 1D,
       // instead of passing a py_vector, you may simply
-      // pass a zero_vector, and the field averaging machinery
-      // will statically know to not even compute anything, 
-      // and just return zero.
+      // pass a zero_vector, and the field repacking
+      // will statically know to just store zeros.
       template <class EX, class EY, class EZ, 
                class BX, class BY, class BZ,
                class Depositor>
@@ -386,12 +341,10 @@ namespace pyrticle
       {
         const unsigned vdim = particle_state::vdim();
 
-        typedef el_force_averaging_target
-          <particle_state::m_vdim, EX, EY, EZ> el_tgt_t;
-        typedef mag_force_averaging_target
-          <particle_state::m_vdim, BX, BY, BZ> mag_tgt_t;
+        typedef field_averaging_target
+          <particle_state::m_vdim> force_tgt_t;
 
-        const unsigned field_components = el_tgt_t::field_components;
+        const unsigned field_components = force_tgt_t::field_components;
         const unsigned pcount = ps.particle_count;
 
         npy_intp res_dims[] = { ps.particle_count, vdim };
@@ -415,16 +368,16 @@ namespace pyrticle
           vis_b_stddev = py_vector(zero_vector(pcount));
         }
 
-        el_tgt_t el_tgt(m_mesh_data, m_integral_weights,
-            ex, ey, ez, vis_e, vis_e_stddev, 
+        m_fields.repack(ex, ey, ez, bx, by, bz, m_mesh_data.node_count());
+
+        force_tgt_t force_tgt(m_mesh_data, m_integral_weights,
+            m_fields,
+            velocities, ps.charges,
+            el_force, mag_force,
+            vis_e, vis_b, vis_e_stddev, vis_b_stddev, 
             &pu_st.m_e_normalization_stats,
-            ps.charges, el_force);
-        mag_tgt_t mag_tgt(m_mesh_data, m_integral_weights,
-            bx, by, bz, velocities, vis_b, vis_b_stddev, 
-            &pu_st.m_b_normalization_stats,
-            ps.charges, mag_force);
+            &pu_st.m_b_normalization_stats);
 
-        chained_deposition_target<el_tgt_t, mag_tgt_t> force_tgt(el_tgt, mag_tgt);
         dep.deposit_densities_on_target(ds, ps, force_tgt, boost::python::slice());
 
         if (vis_listener)
@@ -439,6 +392,57 @@ namespace pyrticle
 
         return py_vector(2, res_dims, el_force+mag_force);
       }
+
+
+
+
+      /** Store the averaged E and B fields seen by each particle into 
+       * \c e and \c b, three components per particle.
+       */
+      template <class EX, class EY, class EZ, 
+               class BX, class BY, class BZ,
+               class Depositor>
+      void particle_fields(
+          const EX &ex, const EY &ey, const EZ &ez,
+          const BX &bx, const BY &by, const BZ &bz,
+          const particle_state &ps,
+          pusher_state &pu_st,
+          const Depositor &dep,
+          typename Depositor::depositor_state &ds,
+          const py_vector &velocities,
+          py_vector e, py_vector b
+          )
+      {
+        typedef field_averaging_target
+          <particle_state::m_vdim> force_tgt_t;
+
+        const unsigned field_components = force_tgt_t::field_components;
+
+        if (e.size() < field_components*ps.particle_count 
+            || b.size() < field_components*ps.particle_count)
+          throw std::runtime_error("particle field arrays too small");
+
+        e.clear();
+        b.clear();
+
+        npy_intp res_dims[] = { ps.particle_count, particle_state::vdim() };
+        py_vector el_force(2, res_dims);
+        py_vector mag_force(2, res_dims);
+        el_force.clear();
+        mag_force.clear();
+
+        m_fields.repack(ex, ey, ez, bx, by, bz, m_mesh_data.node_count());
+
+        force_tgt_t force_tgt(m_mesh_data, m_integral_weights,
+            m_fields,
+            velocities, ps.charges,
+            el_force, mag_force,
+            e, b, py_vector(), py_vector(), 
+            &pu_st.m_e_normalization_stats,
+            &pu_st.m_b_normalization_stats);
+
+        dep.deposit_densities_on_target(ds, ps, force_tgt, boost::python::slice());
+      }
   };
 }
 
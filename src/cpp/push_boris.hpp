@@ -0,0 +1,195 @@
+// Pyrticle - Particle in Cell in Python
+// Relativistic Boris/Vay leapfrog particle push
+// Copyright (C) 2008 Andreas Kloeckner
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+
+
+
+#ifndef _AFHHAHZ_PYRTICLE_PUSH_BORIS_HPP_INCLUDED
+#define _AFHHAHZ_PYRTICLE_PUSH_BORIS_HPP_INCLUDED
+
+
+
+
+#include <cmath>
+#include "tools.hpp"
+#include "meshdata.hpp"
+#include "particle_state.hpp"
+
+
+
+
+namespace pyrticle
+{
+  /** Rotate and accelerate the normalized momentum \c u = gamma*v by one
+   * step, using Boris' scheme. \c pe and \c pb are E and B, each scaled
+   * by q*dt/(2m).
+   */
+  inline bounded_vector boris_momentum_update(
+      const bounded_vector &u,
+      const bounded_vector &pe, const bounded_vector &pb,
+      const double c2)
+  {
+    const bounded_vector u_minus = u + pe;
+    const double gamma_minus = sqrt(1 + inner_prod(u_minus, u_minus)/c2);
+
+    const bounded_vector t = pb/gamma_minus;
+    const bounded_vector s = 2*t/(1+inner_prod(t, t));
+
+    const bounded_vector u_prime = u_minus + cross(u_minus, t);
+    return u_minus + cross(u_prime, s) + pe;
+  }
+
+
+
+
+  /** Like boris_momentum_update(), but using the scheme of J.-L. Vay,
+   * Phys. Plasmas 15, 056701 (2008), which preserves the E x B drift
+   * at large gamma.
+   */
+  inline bounded_vector vay_momentum_update(
+      const bounded_vector &u,
+      const bounded_vector &pe, const bounded_vector &pb,
+      const double c2)
+  {
+    const double gamma = sqrt(1 + inner_prod(u, u)/c2);
+
+    const bounded_vector u_prime = u + 2*pe + cross(u, pb)/gamma;
+    const double gamma_prime_2 = 1 + inner_prod(u_prime, u_prime)/c2;
+
+    const double tau_2 = inner_prod(pb, pb);
+    const double u_star = inner_prod(u_prime, pb)/sqrt(c2);
+    const double sigma = gamma_prime_2 - tau_2;
+
+    const double gamma_new = sqrt(
+        (sigma + sqrt(sigma*sigma + 4*(tau_2 + u_star*u_star)))/2);
+
+    const bounded_vector t = pb/gamma_new;
+    const double s = 1/(1+inner_prod(t, t));
+
+    return s*(u_prime + inner_prod(u_prime, t)*t + cross(u_prime, t));
+  }
+
+
+
+
+  /** Advance the momentum of particle \c pn in \c ps in place by a step
+   * of length \c dt, and return its new normalized momentum gamma*v.
+   */
+  template <class ParticleState>
+  inline bounded_vector update_particle_momentum(
+      ParticleState &ps, const particle_number pn,
+      const py_vector &e, const py_vector &b,
+      const double dt, const double c2, const bool use_vay)
+  {
+    const unsigned vdim = ps.vdim();
+    const double m = ps.masses[pn];
+    const double qdt_2m = ps.charges[pn]*dt/(2*m);
+
+    // momenta may have fewer than three components--pad with zeros
+    bounded_vector u = zero_vector(3);
+    for (unsigned i = 0; i < vdim; ++i)
+      u[i] = ps.momenta[pn*vdim+i]/m;
+
+    const bounded_vector pe = qdt_2m*subrange(e, 3*pn, 3*(pn+1));
+    const bounded_vector pb = qdt_2m*subrange(b, 3*pn, 3*(pn+1));
+
+    const bounded_vector u_new = use_vay
+      ? vay_momentum_update(u, pe, pb, c2)
+      : boris_momentum_update(u, pe, pb, c2);
+
+    for (unsigned i = 0; i < vdim; ++i)
+      ps.momenta[pn*vdim+i] = m*u_new[i];
+
+    return u_new;
+  }
+
+
+
+
+  /** Advance the momenta and positions of all particles in \c ps in place
+   * by one leapfrog step of length \c dt, and then update their containing
+   * elements.
+   *
+   * \c e and \c b hold three field components per particle, as returned
+   * by the pushers' particle_fields(). Momenta are understood to lag the
+   * positions by half a step, see boris_momentum_push().
+   */
+  template <class ParticleState>
+  void boris_push(
+      const mesh_data &mesh,
+      ParticleState &ps,
+      const py_vector &e, const py_vector &b,
+      const double dt,
+      const double vacuum_c,
+      const bool use_vay,
+      const boundary_hit_listener &bhit_listener,
+      find_event_counters &counters)
+  {
+    const unsigned xdim = ps.xdim();
+    const double c2 = vacuum_c*vacuum_c;
+
+    if (e.size() < 3*ps.particle_count || b.size() < 3*ps.particle_count)
+      throw std::runtime_error("boris_push: field arrays too small");
+
+    for (particle_number pn = 0; pn < ps.particle_count; ++pn)
+    {
+      const bounded_vector u_new = update_particle_momentum(
+          ps, pn, e, b, dt, c2, use_vay);
+
+      const double gamma_new = sqrt(1 + inner_prod(u_new, u_new)/c2);
+
+      for (unsigned i = 0; i < xdim; ++i)
+        ps.positions[pn*xdim+i] += dt*u_new[i]/gamma_new;
+    }
+
+    // Relocation is done in a separate sweep, since boundary hits
+    // may renumber particles, which would invalidate the per-particle
+    // field indexing above.
+    update_containing_elements(mesh, ps, bhit_listener, counters);
+  }
+
+
+
+
+  /** Advance only the momenta of all particles in \c ps by a step of
+   * length \c dt, leaving their positions alone. With \c dt = -dt_push/2,
+   * this sets up the half-step lag that boris_push() expects for momenta
+   * given at the same time as the positions.
+   */
+  template <class ParticleState>
+  void boris_momentum_push(
+      ParticleState &ps,
+      const py_vector &e, const py_vector &b,
+      const double dt,
+      const double vacuum_c,
+      const bool use_vay)
+  {
+    const double c2 = vacuum_c*vacuum_c;
+
+    if (e.size() < 3*ps.particle_count || b.size() < 3*ps.particle_count)
+      throw std::runtime_error("boris_momentum_push: field arrays too small");
+
+    for (particle_number pn = 0; pn < ps.particle_count; ++pn)
+      update_particle_momentum(ps, pn, e, b, dt, c2, use_vay);
+  }
+}
+
+
+
+
+#endif
@@ -0,0 +1,97 @@
+// Pyrticle - Particle in Cell in Python
+// Interleaved field storage for particle pushers
+// Copyright (C) 2008 Andreas Kloeckner
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+
+
+
+#ifndef _AHFYAUAZ_PYRTICLE_PUSH_FIELDS_HPP_INCLUDED
+#define _AHFYAUAZ_PYRTICLE_PUSH_FIELDS_HPP_INCLUDED
+
+
+
+
+#include "tools.hpp"
+
+
+
+
+namespace pyrticle
+{
+  // field access helpers -----------------------------------------------------
+  // These let field repacking treat absent field components
+  // (zero_vector) as compile-time zeros.
+  inline double field_value(const py_vector &field, unsigned i)
+  { return field[i]; }
+
+  inline double field_value(const zero_vector &field, unsigned i)
+  { return 0; }
+
+
+
+
+  // interleaved field block --------------------------------------------------
+  /** All six field components (ex, ey, ez, bx, by, bz), stored node by node.
+   *
+   * Since an element's nodes are numbered contiguously, this makes the
+   * field data of one element a single contiguous block, so that a
+   * particle gather touches one array instead of six.
+   */
+  class interleaved_field_block
+  {
+    public:
+      static const unsigned field_components = 6;
+
+    private:
+      dyn_vector m_data;
+
+    public:
+      template <class EX, class EY, class EZ,
+               class BX, class BY, class BZ>
+      void repack(
+          const EX &ex, const EY &ey, const EZ &ez,
+          const BX &bx, const BY &by, const BZ &bz,
+          unsigned node_count)
+      {
+        if (m_data.size() != field_components*node_count)
+          m_data.resize(field_components*node_count, false);
+
+        dyn_vector::iterator it = m_data.begin();
+        for (unsigned i = 0; i < node_count; ++i)
+        {
+          *it++ = field_value(ex, i);
+          *it++ = field_value(ey, i);
+          *it++ = field_value(ez, i);
+          *it++ = field_value(bx, i);
+          *it++ = field_value(by, i);
+          *it++ = field_value(bz, i);
+        }
+      }
+
+      unsigned node_count() const
+      { return m_data.size()/field_components; }
+
+      /** Return a pointer to the field_components values at node \c nn. */
+      const double *node(unsigned nn) const
+      { return &m_data[0] + field_components*nn; }
+  };
+}
+
+
+
+
+#endif
@@ -26,110 +26,150 @@
 
 
 #include <vector>
+#include <numeric>
 #include <boost/foreach.hpp>
-#include <boost/assign/list_of.hpp> 
 #include <boost/numeric/ublas/triangular.hpp>
-#include <boost/numeric/bindings/lapack/gesv.hpp>
+#include <boost/numeric/bindings/blas/blas3.hpp>
 #include <boost/numeric/bindings/traits/ublas_matrix.hpp>
 #include <boost/numeric/bindings/traits/ublas_vector2.hpp>
 #include "tools.hpp"
 #include "bases.hpp"
 #include "meshdata.hpp"
+#include "monomial.hpp"
 #include "particle_state.hpp"
+#include "push_fields.hpp"
 
 
 
 
 namespace pyrticle
 {
-  struct monomial_basis_function
+  /** Interpolation coefficients for a chunk of particles that share
+   * one local discretization. Storage is bounded by the chunk capacity,
+   * not by the particle count.
+   */
+  class interpolator
   {
-    /* exponents in each coordinate direction */
-    std::vector<unsigned> m_exponents;
-
-    monomial_basis_function(const std::vector<unsigned> &exponents)
-      : m_exponents(exponents)
-    { }
-
-    monomial_basis_function(unsigned i, unsigned j)
-    { m_exponents = boost::assign::list_of(i)(j); }
-
-    monomial_basis_function(unsigned i, unsigned j, unsigned k)
-    { m_exponents = boost::assign::list_of(i)(j)(k); }
+    public:
+      const local_monomial_discretization &m_ldis;
+      const unsigned m_basis_size;
+      const unsigned m_max_degree;
+      const unsigned m_capacity;
 
-    template <class VecType>
-    const double operator()(const VecType &v) const
-    {
-      double result = 1;
-      unsigned i = 0;
-      BOOST_FOREACH(unsigned exp, m_exponents)
-        result *= pow(v[i++], exp);
+      dyn_vector m_basis_values;
+      dyn_vector m_interpolation_coefficients;
 
-      return result;
-    }
-  };
+      interpolator(
+          const local_monomial_discretization &ldis,
+          unsigned capacity)
+        : m_ldis(ldis), 
+        m_basis_size(ldis.m_basis.size()),
+        m_max_degree(ldis.max_degree()),
+        m_capacity(capacity),
+        m_basis_values(m_basis_size*capacity),
+        m_interpolation_coefficients(m_basis_size*capacity)
+      { 
+        if (m_max_degree > local_monomial_discretization::max_supported_degree)
+          throw std::runtime_error("monomial degree too high for interpolator");
+        if (m_ldis.m_inverse_vandermonde_t.size1() != m_basis_size
+            || m_ldis.m_inverse_vandermonde_t.size2() != m_basis_size)
+          throw std::runtime_error("inverse vandermonde matrix has wrong size");
+      }
 
+      /** Compute interpolation coefficients for the \c chunk_size 
+       * particles listed at \c chunk, all of which must lie in elements 
+       * using this interpolator's local discretization.
+       */
+      template <class ParticleState>
+      void prepare(
+          const mesh_data &md,
+          const ParticleState &ps,
+          const particle_number *chunk,
+          const unsigned chunk_size)
+      {
+        const unsigned xdim = ps.xdim();
 
+        if (chunk_size > m_capacity)
+          throw std::runtime_error("interpolator chunk too large");
 
+        for (unsigned i = 0; i < chunk_size; ++i)
+        {
+          const particle_number pn = chunk[i];
+          const mesh_data::element_info &el_inf = 
+            md.m_element_info[ps.containing_elements[pn]];
 
-  struct local_monomial_discretization
-  {
-    std::vector<monomial_basis_function> m_basis;
-    py_fortran_matrix m_lu_vandermonde_t;
-    py_int_vector m_lu_piv_vandermonde_t;
-  };
+          bounded_vector unit_pt = el_inf.m_inverse_map
+            .operator()<bounded_vector>(
+                subrange(ps.positions, xdim*pn, xdim*(pn+1))
+                );
 
+          m_ldis.evaluate_basis<ParticleState::m_xdim>(
+              unit_pt, m_max_degree, 
+              m_basis_values.begin() + i*m_basis_size);
+        }
 
+        // coefficients = inverse_vandermonde_t * basis_values, 
+        // for the whole chunk at once
+        using namespace boost::numeric::bindings;
+        using blas::detail::gemm;
+
+        const py_fortran_matrix &matrix = m_ldis.m_inverse_vandermonde_t;
+
+        gemm(
+            'N', // "matrix" is column-major
+            'N', // a contiguous array of vectors is column-major
+            m_basis_size,
+            chunk_size,
+            m_basis_size,
+            /*alpha*/ 1,
+            /*a*/ traits::matrix_storage(matrix.as_ublas()),
+            /*lda*/ m_basis_size,
+            /*b*/ traits::vector_storage(m_basis_values),
+            /*ldb*/ m_basis_size,
+            /*beta*/ 0,
+            /*c*/ traits::vector_storage(m_interpolation_coefficients),
+            /*ldc*/ m_basis_size
+            );
+      }
 
+      /** Interpolate all six field components in \c fields to the particle
+       * at index \c i within the current chunk, in a single pass over its
+       * element's contiguous field block.
+       */
+      void operator()(
+          const unsigned i,
+          const mesh_data::element_info &el_inf,
+          const interleaved_field_block &fields,
+          bounded_vector &e, bounded_vector &b) const
+      {
+        const unsigned fc = interleaved_field_block::field_components;
 
-  class interpolator
-  {
-    public:
-      const local_monomial_discretization &m_ldis;
-      dyn_vector m_interpolation_coefficients;
+        dyn_vector::const_iterator coeff = 
+          m_interpolation_coefficients.begin() + i*m_basis_size;
+        const double *f = fields.node(el_inf.m_start);
 
-      interpolator(
-          const local_monomial_discretization &ldis,
-          unsigned particle_count)
-        : m_ldis(ldis),
-        m_interpolation_coefficients(ldis.m_basis.size()*particle_count)
-      { }
+        double acc[fc] = { 0, 0, 0, 0, 0, 0 };
+        for (unsigned j = 0; j < m_basis_size; ++j, ++coeff, f += fc)
+          for (unsigned k = 0; k < fc; ++k)
+            acc[k] += *coeff * f[k];
 
-      template <class VecType>
-      const double operator()(
-          const particle_number pn,
-          const mesh_data::mesh_data::element_number en,
-          const VecType &data) const
-      {
-        const unsigned basis_size = m_ldis.m_basis.size();
-        return inner_prod(
-            subrange(m_interpolation_coefficients,
-              pn*basis_size, (pn+1)*basis_size),
-            subrange(data, 
-              en*basis_size, (en+1)*basis_size)
-            );
+        e[0] = acc[0]; e[1] = acc[1]; e[2] = acc[2];
+        b[0] = acc[3]; b[1] = acc[4]; b[2] = acc[5];
       }
 
       template <class VecType>
       void debug(
-          const particle_number pn,
-          const mesh_data::mesh_data::element_number en,
+          const unsigned i,
+          const mesh_data::element_info &el_inf,
           const VecType &data) const
       {
-        const unsigned basis_size = m_ldis.m_basis.size();
         dyn_vector intp_coeffs(subrange(m_interpolation_coefficients,
-              pn*basis_size, (pn+1)*basis_size));
+              i*m_basis_size, (i+1)*m_basis_size));
         dyn_vector ldata(subrange(data, 
-              en*basis_size, (en+1)*basis_size));
+              el_inf.m_start, el_inf.m_start+m_basis_size));
         std::cout << "INTP" << intp_coeffs << std::endl;
         std::cout << "DATA" << ldata << std::endl;
       }
-
-      const double operator()(
-          const particle_number pn,
-          const mesh_data::mesh_data::element_number en,
-          zero_vector) const
-      { return 0; }
   };
 
 
@@ -141,81 +181,346 @@ namespace pyrticle
     public:
       typedef ParticleState particle_state;
 
+      static const unsigned particle_chunk_size = 256;
+
       const mesh_data &m_mesh_data;
       std::vector<local_monomial_discretization> 
         m_local_discretizations;
       std::vector<unsigned> 
         m_ldis_indices;
 
+      interleaved_field_block m_fields;
+
+      /* particle numbers, sorted by local discretization */
+      std::vector<particle_number> m_particles_by_ldis;
+      std::vector<unsigned> m_ldis_particle_starts;
+
+      /* if set, gather fields element by element--see
+       * for_each_particle_field_by_element() */
+      bool m_element_batched;
+
+      /* particle numbers, sorted by containing element */
+      std::vector<particle_number> m_particles_by_element;
+      std::vector<unsigned> m_element_particle_starts;
 
       monomial_particle_pusher(const mesh_data &md)
-        : m_mesh_data(md)
+        : m_mesh_data(md), m_element_batched(false)
       { }
 
-      interpolator make_interpolator(const ParticleState &ps) const
+
+
+
+      /** Sort particles into m_particles_by_ldis by the local 
+       * discretization of their containing element. The particles
+       * for local discretization \c i end up in the range starting at
+       * <tt>m_ldis_particle_starts[i]</tt> and ending at
+       * <tt>m_ldis_particle_starts[i+1]</tt>.
+       */
+      void group_particles_by_ldis(const ParticleState &ps)
       {
-        const unsigned xdim = ps.xdim();
-        
-        interpolator result(
-            m_local_discretizations[0], ps.particle_count);
+        const unsigned ldis_count = m_local_discretizations.size();
 
-        for (particle_number pn = 0; pn < ps.particle_count; pn++)
+        m_ldis_particle_starts.assign(ldis_count+1, 0);
+        for (particle_number pn = 0; pn < ps.particle_count; ++pn)
         {
-          mesh_data::mesh_data::element_number in_el = 
-            ps.containing_elements[pn];
-          const mesh_data::element_info &el_inf = 
-            m_mesh_data.m_element_info[in_el];
-        
-          if (m_ldis_indices[in_el] != 0)
-            throw std::runtime_error("more than one "
-                "local discretization is currently not "
-                "supported");
+          const unsigned ldis_idx = 
+            m_ldis_indices[ps.containing_elements[pn]];
+          if (ldis_idx >= ldis_count)
+            throw std::runtime_error("invalid local discretization index");
+          ++m_ldis_particle_starts[ldis_idx+1];
+        }
 
-          bounded_vector unit_pt = el_inf.m_inverse_map
-            .operator()<bounded_vector>(
-                subrange(ps.positions, xdim*pn, xdim*(pn+1))
-                );
-          unsigned base_idx = result.m_ldis.m_basis.size()*pn;
+        std::partial_sum(
+            m_ldis_particle_starts.begin(), m_ldis_particle_starts.end(),
+            m_ldis_particle_starts.begin());
+
+        std::vector<unsigned> fill_pos(
+            m_ldis_particle_starts.begin(), m_ldis_particle_starts.end()-1);
+        m_particles_by_ldis.resize(ps.particle_count);
+        for (particle_number pn = 0; pn < ps.particle_count; ++pn)
+          m_particles_by_ldis[fill_pos[
+            m_ldis_indices[ps.containing_elements[pn]]]++] = pn;
+      }
+
+
+
+
+      /** Interpolate the fields to every particle and call
+       * <tt>visitor(pn, e, b)</tt> with the result. 
+       */
+      template <class Visitor>
+      void for_each_particle_field(
+          const ParticleState &ps,
+          Visitor &visitor)
+      {
+        group_particles_by_ldis(ps);
+
+        for (unsigned ldis_idx = 0; 
+            ldis_idx < m_local_discretizations.size(); ++ldis_idx)
+        {
+          const unsigned group_start = m_ldis_particle_starts[ldis_idx];
+          const unsigned group_end = m_ldis_particle_starts[ldis_idx+1];
+
+          if (group_start == group_end)
+            continue;
+
+          interpolator interp(
+              m_local_discretizations[ldis_idx], particle_chunk_size);
+
+          for (unsigned chunk_start = group_start; 
+              chunk_start < group_end; 
+              chunk_start += particle_chunk_size)
+          {
+            const unsigned chunk_size = std::min(
+                unsigned(particle_chunk_size), group_end-chunk_start);
+            const particle_number *chunk = &m_particles_by_ldis[chunk_start];
+
+            interp.prepare(m_mesh_data, ps, chunk, chunk_size);
+
+            for (unsigned i = 0; i < chunk_size; ++i)
+            {
+              const particle_number pn = chunk[i];
+              const mesh_data::element_info &el_inf = 
+                m_mesh_data.m_element_info[ps.containing_elements[pn]];
+
+              bounded_vector e(3), b(3);
+              interp(i, el_inf, m_fields, e, b);
+
+              visitor(pn, e, b);
+            }
+          }
+        }
+      }
+
+
+
+
+      /** Sort particles into m_particles_by_element by their containing
+       * element, analogous to group_particles_by_ldis().
+       */
+      void group_particles_by_element(const ParticleState &ps)
+      {
+        const unsigned el_count = m_mesh_data.m_element_info.size();
+
+        m_element_particle_starts.assign(el_count+1, 0);
+        for (particle_number pn = 0; pn < ps.particle_count; ++pn)
+          ++m_element_particle_starts[ps.containing_elements[pn]+1];
+
+        std::partial_sum(
+            m_element_particle_starts.begin(), m_element_particle_starts.end(),
+            m_element_particle_starts.begin());
+
+        std::vector<unsigned> fill_pos(
+            m_element_particle_starts.begin(), m_element_particle_starts.end()-1);
+        m_particles_by_element.resize(ps.particle_count);
+        for (particle_number pn = 0; pn < ps.particle_count; ++pn)
+          m_particles_by_element[fill_pos[ps.containing_elements[pn]]++] = pn;
+      }
+
+
+
+
+      /** Like for_each_particle_field(), but visits particles element
+       * by element. For each element, the six nodal field components are 
+       * first turned into monomial coefficients (one [6 x basis] x 
+       * [basis x basis] product), which are then evaluated at all of the
+       * element's particles in one dense [6 x basis] x [basis x particles]
+       * product. This pays off when elements hold many particles.
+       */
+      template <class Visitor>
+      void for_each_particle_field_by_element(
+          const ParticleState &ps,
+          Visitor &visitor)
+      {
+        const unsigned xdim = ps.xdim();
+        const unsigned fc = interleaved_field_block::field_components;
+
+        group_particles_by_element(ps);
 
-          for (unsigned i = 0; i < result.m_ldis.m_basis.size(); i++)
-            result.m_interpolation_coefficients[base_idx+i] 
-              = result.m_ldis.m_basis[i](unit_pt);
+        std::vector<unsigned> max_degrees;
+        BOOST_FOREACH(const local_monomial_discretization &ldis,
+            m_local_discretizations)
+        {
+          max_degrees.push_back(ldis.max_degree());
+          if (max_degrees.back() > local_monomial_discretization::max_supported_degree)
+            throw std::runtime_error("monomial degree too high for interpolator");
         }
 
+        dyn_vector basis_values, modal_fields, particle_fields;
+
+        using namespace boost::numeric::bindings;
+        using blas::detail::gemm;
+
+        const unsigned el_count = m_element_particle_starts.size()-1;
+        for (mesh_data::element_number en = 0; en < el_count; ++en)
         {
-          using namespace boost::numeric::bindings;
-          
-          const py_fortran_matrix &matrix = 
-            result.m_ldis.m_lu_vandermonde_t;
-
-          int info;
-          lapack::detail::getrs(
-              'N', 
-              /*n*/ matrix.size1(),
-              /*nrhs*/ ps.particle_count,
-              traits::matrix_storage(matrix.as_ublas()),
-              /*lda*/ matrix.size1(),
-              traits::vector_storage(
-                result.m_ldis.m_lu_piv_vandermonde_t),
-              traits::vector_storage(
-                result.m_interpolation_coefficients),
-              /*ldb*/ matrix.size1(),
-              &info);
-
-          if (info < 0)
-            throw std::runtime_error("invalid argument to getrs");
+          const unsigned el_start = m_element_particle_starts[en];
+          const unsigned el_particles = m_element_particle_starts[en+1]-el_start;
+
+          if (el_particles == 0)
+            continue;
+
+          const mesh_data::element_info &el_inf = m_mesh_data.m_element_info[en];
+          const unsigned ldis_idx = m_ldis_indices[en];
+          if (ldis_idx >= m_local_discretizations.size())
+            throw std::runtime_error("invalid local discretization index");
+
+          const local_monomial_discretization &ldis = 
+            m_local_discretizations[ldis_idx];
+          const unsigned basis_size = ldis.m_basis.size();
+          const py_fortran_matrix &inv_vdm_t = ldis.m_inverse_vandermonde_t;
+
+          if (inv_vdm_t.size1() != basis_size || inv_vdm_t.size2() != basis_size)
+            throw std::runtime_error("inverse vandermonde matrix has wrong size");
+
+          if (basis_values.size() < basis_size*el_particles)
+            basis_values.resize(basis_size*el_particles, false);
+          if (modal_fields.size() < fc*basis_size)
+            modal_fields.resize(fc*basis_size, false);
+          if (particle_fields.size() < fc*el_particles)
+            particle_fields.resize(fc*el_particles, false);
+
+          for (unsigned i = 0; i < el_particles; ++i)
+          {
+            const particle_number pn = m_particles_by_element[el_start+i];
+
+            bounded_vector unit_pt = el_inf.m_inverse_map
+              .operator()<bounded_vector>(
+                  subrange(ps.positions, xdim*pn, xdim*(pn+1))
+                  );
+
+            ldis.evaluate_basis<ParticleState::m_xdim>(
+                unit_pt, max_degrees[ldis_idx],
+                basis_values.begin() + i*basis_size);
+          }
+
+          // modal_fields = nodal_fields * inverse_vandermonde_t,
+          // where nodal_fields is the element's [6 x basis] field block
+          gemm(
+              'N', // the field block is column-major with stride fc
+              'N', // "inv_vdm_t" is column-major
+              fc,
+              basis_size,
+              basis_size,
+              /*alpha*/ 1,
+              /*a*/ m_fields.node(el_inf.m_start),
+              /*lda*/ fc,
+              /*b*/ traits::matrix_storage(inv_vdm_t.as_ublas()),
+              /*ldb*/ basis_size,
+              /*beta*/ 0,
+              /*c*/ traits::vector_storage(modal_fields),
+              /*ldc*/ fc
+              );
+
+          // particle_fields = modal_fields * basis_values
+          gemm(
+              'N',
+              'N', // a contiguous array of vectors is column-major
+              fc,
+              el_particles,
+              basis_size,
+              /*alpha*/ 1,
+              /*a*/ traits::vector_storage(modal_fields),
+              /*lda*/ fc,
+              /*b*/ traits::vector_storage(basis_values),
+              /*ldb*/ basis_size,
+              /*beta*/ 0,
+              /*c*/ traits::vector_storage(particle_fields),
+              /*ldc*/ fc
+              );
+
+          for (unsigned i = 0; i < el_particles; ++i)
+          {
+            dyn_vector::const_iterator f = particle_fields.begin() + fc*i;
+
+            bounded_vector e(3), b(3);
+            e[0] = f[0]; e[1] = f[1]; e[2] = f[2];
+            b[0] = f[3]; b[1] = f[4]; b[2] = f[5];
+
+            visitor(m_particles_by_element[el_start+i], e, b);
+          }
         }
+      }
 
-        return result;
+
+
+
+      template <class Visitor>
+      void gather_fields(const ParticleState &ps, Visitor &visitor)
+      {
+        if (m_element_batched)
+          for_each_particle_field_by_element(ps, visitor);
+        else
+          for_each_particle_field(ps, visitor);
       }
 
 
 
 
+    private:
+      struct force_visitor
+      {
+        const ParticleState &m_ps;
+        const py_vector &m_velocities;
+        py_vector &m_result;
+        py_vector m_vis_e, m_vis_b, m_vis_el_force, m_vis_mag_force;
+        bool m_want_vis;
+
+        force_visitor(const ParticleState &ps, 
+            const py_vector &velocities, py_vector &result)
+          : m_ps(ps), m_velocities(velocities), m_result(result),
+          m_want_vis(false)
+        { }
+
+        void operator()(particle_number pn, 
+            const bounded_vector &e, const bounded_vector &b)
+        {
+          const unsigned vdim = m_ps.vdim();
+          const unsigned v_pstart = vdim*pn;
+          const unsigned v_pend = vdim*(pn+1);
+
+          const double charge = m_ps.charges[pn];
+
+          bounded_vector el_force(charge*e);
+
+          const bounded_vector v = subrange(m_velocities, v_pstart, v_pend);
+          bounded_vector mag_force = cross(v, charge*b);
+
+          // truncate forces to dimensions_velocity entries
+          subrange(m_result, v_pstart, v_pend) = subrange(
+              el_force + mag_force, 0, vdim);
+
+          if (m_want_vis)
+          {
+            subrange(m_vis_e, 3*pn, 3*(pn+1)) = e;
+            subrange(m_vis_b, 3*pn, 3*(pn+1)) = b;
+            subrange(m_vis_el_force, 3*pn, 3*(pn+1)) = el_force;
+            subrange(m_vis_mag_force, 3*pn, 3*(pn+1)) = mag_force;
+          }
+        }
+      };
+
+      struct field_visitor
+      {
+        py_vector m_e, m_b;
+
+        field_visitor(py_vector e, py_vector b)
+          : m_e(e), m_b(b)
+        { }
+
+        void operator()(particle_number pn, 
+            const bounded_vector &e, const bounded_vector &b)
+        {
+          subrange(m_e, 3*pn, 3*(pn+1)) = e;
+          subrange(m_b, 3*pn, 3*(pn+1)) = b;
+        }
+      };
+
+    public:
       // why all these template arguments? In 2D and 1D,
       // instead of passing a hedge::vector, you may simply
-      // pass a zero_vector, and interpolation will know to
-      // not even compute anything, but just return zero.
+      // pass a zero_vector, and the field repacking will
+      // statically know to just store zeros.
       template <class EX, class EY, class EZ, 
                class BX, class BY, class BZ>
       py_vector forces(
@@ -231,97 +536,56 @@ namespace pyrticle
         npy_intp res_dims[] = { ps.particle_count, vdim };
         py_vector result(2, res_dims);
 
-        py_vector
-          vis_e, vis_b, vis_el_force, vis_mag_force;
+        force_visitor visitor(ps, velocities, result);
 
         if (vis_listener)
         {
           npy_intp dims[] = { ps.particle_count, 3 };
-          vis_e = py_vector(2, dims);
-          vis_b = py_vector(2, dims);
-          vis_el_force = py_vector(2, dims);
-          vis_mag_force = py_vector(2, dims);
+          visitor.m_vis_e = py_vector(2, dims);
+          visitor.m_vis_b = py_vector(2, dims);
+          visitor.m_vis_el_force = py_vector(2, dims);
+          visitor.m_vis_mag_force = py_vector(2, dims);
+          visitor.m_want_vis = true;
         }
 
-        interpolator interp = make_interpolator(ps);
+        m_fields.repack(ex, ey, ez, bx, by, bz, m_mesh_data.node_count());
+        gather_fields(ps, visitor);
 
-        for (particle_number pn = 0; pn < ps.particle_count; pn++)
+        if (vis_listener)
         {
-          const unsigned v_pstart = vdim*pn;
-          const unsigned v_pend = vdim*(pn+1);
-
-          mesh_data::mesh_data::element_number in_el = ps.containing_elements[pn];
-
-          bounded_vector e(3);
-          e[0] = interp(pn, in_el, ex);
-          e[1] = interp(pn, in_el, ey);
-          e[2] = interp(pn, in_el, ez);
-
-          bounded_vector b(3);
-          b[0] = interp(pn, in_el, bx);
-          b[1] = interp(pn, in_el, by);
-          b[2] = interp(pn, in_el, bz);
-
-          const double charge = ps.charges[pn];
-
-          bounded_vector el_force(charge*e);
-
-          const bounded_vector v = subrange(velocities, v_pstart, v_pend);
-          bounded_vector mag_force = cross(v, charge*b);
-
-#if 0
-          // code for debugging NaNs
-          if (isnan_any(el_force) || isnan_any(mag_force))
-          {
-            const unsigned x_pstart = ps.xdim()*pn;
-            const unsigned x_pend = ps.xdim()*(pn+1);
-
-            const bounded_vector x = subrange(ps.positions, x_pstart, x_pend);
+          vis_listener->store_particle_vis_vector("pt_e", visitor.m_vis_e);
+          vis_listener->store_particle_vis_vector("pt_b", visitor.m_vis_b);
+          vis_listener->store_particle_vis_vector("el_force", 
+              visitor.m_vis_el_force);
+          vis_listener->store_particle_vis_vector("mag_force", 
+              visitor.m_vis_mag_force);
+        }
 
-            if (isnan_any(el_force))
-            {
-              std::cout << "EL FORCE HAD NAN" << std::endl;
-              interp.debug(pn, in_el, ex);
-              interp.debug(pn, in_el, ey);
-              interp.debug(pn, in_el, ez);
-            }
+        return result;
+      }
 
-            if (isnan_any(mag_force))
-            {
-              std::cout << "MAG FORCE HAD NAN" << std::endl;
-              interp.debug(pn, in_el, bx);
-              interp.debug(pn, in_el, by);
-              interp.debug(pn, in_el, bz);
-            }
 
-            std::cout
-              << el_force << " pn " << pn << " at " << x << " in el " << in_el 
-              << std::endl;
-          }
-#endif
 
-          // truncate forces to dimensions_velocity entries
-          subrange(result, v_pstart, v_pend) = subrange(
-              el_force + mag_force, 0, ps.vdim());
 
-          if (vis_listener)
-          {
-            subrange(vis_e, 3*pn, 3*(pn+1)) = e;
-            subrange(vis_b, 3*pn, 3*(pn+1)) = b;
-            subrange(vis_el_force, 3*pn, 3*(pn+1)) = el_force;
-            subrange(vis_mag_force, 3*pn, 3*(pn+1)) = mag_force;
-          }
-        }
+      /** Store the E and B fields seen by each particle into \c e and
+       * \c b, three components per particle.
+       */
+      template <class EX, class EY, class EZ, 
+               class BX, class BY, class BZ>
+      void particle_fields(
+          const EX &ex, const EY &ey, const EZ &ez,
+          const BX &bx, const BY &by, const BZ &bz,
+          const ParticleState &ps,
+          py_vector e, py_vector b
+          )
+      {
+        if (e.size() < 3*ps.particle_count || b.size() < 3*ps.particle_count)
+          throw std::runtime_error("particle field arrays too small");
 
-        if (vis_listener)
-        {
-          vis_listener->store_particle_vis_vector("pt_e", vis_e);
-          vis_listener->store_particle_vis_vector("pt_b", vis_b);
-          vis_listener->store_particle_vis_vector("el_force", vis_el_force);
-          vis_listener->store_particle_vis_vector("mag_force", vis_mag_force);
-        }
+        field_visitor visitor(e, b);
 
-        return result;
+        m_fields.repack(ex, ey, ez, bx, by, bz, m_mesh_data.node_count());
+        gather_fields(ps, visitor);
       }
   };
 }
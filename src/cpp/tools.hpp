@@ -533,6 +533,25 @@ namespace pyrticle
         }
       }
 
+      /** Evaluate at \c n points, given by their squared distances
+       * from the center.
+       */
+      void evaluate_squared(const double *r_squared, double *result, 
+          const unsigned n) const
+      {
+        if (m_alpha_is_2)
+          for (unsigned i = 0; i < n; ++i)
+          {
+            const double radius_term = m_radius-r_squared[i]/m_radius;
+            result[i] = r_squared[i] > m_radius_squared 
+              ? 0 : m_normalizer*radius_term*radius_term;
+          }
+        else
+          for (unsigned i = 0; i < n; ++i)
+            result[i] = r_squared[i] > m_radius_squared 
+              ? 0 : m_normalizer*pow(m_radius-r_squared[i]/m_radius, m_alpha);
+      }
+
       const double normalizer() const
       { return m_normalizer; }
 
@@ -580,6 +599,21 @@ namespace pyrticle
         }
       }
 
+      void evaluate_squared(const double *r_squared, double *result, 
+          const unsigned n) const
+      {
+        for (unsigned i = 0; i < n; ++i)
+        {
+          if (r_squared[i] > m_radius_squared)
+            result[i] = 0;
+          else
+          {
+            const double sr_squared_m_1 = r_squared[i]/m_radius_squared-1;
+            result[i] = m_normalizer*exp(-1/(sr_squared_m_1*sr_squared_m_1));
+          }
+        }
+      }
+
       const double radius() const
       { return m_radius; }
 
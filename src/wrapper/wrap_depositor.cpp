@@ -52,6 +52,21 @@ namespace
 
 
 
+  template <class Dep>
+  unsigned get_thread_count(const Dep &dep)
+  { return dep.m_thread_count; }
+
+  template <class Dep>
+  void set_thread_count(Dep &dep, int thread_count)
+  {
+    if (thread_count < 1)
+      throw std::runtime_error("thread_count must be at least 1");
+    dep.m_thread_count = thread_count;
+  }
+
+
+
+
   template <class GridDep>
   py_vector get_extra_points(const GridDep &dep)
   { return dep.m_extra_points; }
@@ -76,6 +91,8 @@ namespace
       .DEF_RW_MEMBER(shape_function)
 
       .DEF_RW_MEMBER(bricks)
+      .add_property("thread_count",
+          get_thread_count<cl>, set_thread_count<cl>)
       .DEF_RW_MEMBER(elements_on_grid)
 
       .DEF_RW_MEMBER(first_extra_point)
@@ -86,16 +103,37 @@ namespace
       .DEF_RW_MEMBER(average_groups)
       .DEF_RW_MEMBER(average_group_starts)
 
+      .DEF_RW_MEMBER(local_discretizations)
+      .DEF_RW_MEMBER(ldis_indices)
+      .DEF_RW_MEMBER(preparation_info)
+
       .DEF_SIMPLE_METHOD(grid_node_count)
       .DEF_SIMPLE_METHOD(grid_node_count_with_extra)
       .DEF_SIMPLE_METHOD(find_points_in_element)
+      .DEF_SIMPLE_METHOD(prepare_elements_on_grid)
+      .DEF_SIMPLE_METHOD(update_elements_on_grid)
+      .DEF_SIMPLE_METHOD(write_preparation_cache)
+      .DEF_SIMPLE_METHOD(read_preparation_cache)
 
+      .DEF_SIMPLE_METHOD(prepare_remap)
+      .DEF_SIMPLE_METHOD(assemble_remap_operator)
       .DEF_SIMPLE_METHOD(remap_grid_to_mesh)
       .DEF_SIMPLE_METHOD(remap_residual)
 
       .DEF_SIMPLE_METHOD(deposit_grid_densities)
       .DEF_SIMPLE_METHOD(deposit_grid_j)
       .DEF_SIMPLE_METHOD(deposit_grid_rho)
+      .DEF_SIMPLE_METHOD(deposit_densities)
+      .DEF_SIMPLE_METHOD(deposit_j)
+      .DEF_SIMPLE_METHOD(deposit_rho)
+
+      .DEF_SIMPLE_METHOD(convolution_padding)
+      .DEF_SIMPLE_METHOD(padded_grid_node_count)
+      .DEF_SIMPLE_METHOD(convolution_kernel)
+      .DEF_SIMPLE_METHOD(sample_padded_grid)
+      .DEF_SIMPLE_METHOD(deposit_padded_grid_densities)
+      .DEF_SIMPLE_METHOD(deposit_padded_grid_j)
+      .DEF_SIMPLE_METHOD(deposit_padded_grid_rho)
       ;
 
     wrp.attr("DepositorState") = gdbs_wrap;
@@ -168,6 +206,9 @@ namespace
             )));
 
       wrp
+        .add_property("thread_count",
+            get_thread_count<cl>, set_thread_count<cl>)
+
         .DEF_SIMPLE_METHOD(add_local_diff_matrix)
         .DEF_SIMPLE_METHOD(add_advective_particle)
         .DEF_SIMPLE_METHOD(get_debug_quantity_on_mesh)
@@ -218,10 +259,13 @@ namespace
       wrp
         .DEF_RW_MEMBER(shape_function)
         .DEF_RW_MEMBER(bricks)
+        .add_property("thread_count",
+            get_thread_count<cl>, set_thread_count<cl>)
         .DEF_RW_MEMBER(node_number_list_starts)
         .DEF_RW_MEMBER(node_number_lists)
 
         .DEF_SIMPLE_METHOD(grid_node_count)
+        .DEF_SIMPLE_METHOD(bin_mesh_nodes)
 
         .DEF_SIMPLE_METHOD(deposit_densities)
         .DEF_SIMPLE_METHOD(deposit_j)
@@ -262,6 +306,31 @@ void expose_deposition()
 
   expose_std_vector<element_on_grid>("ElementOnGrid");
 
+  {
+    typedef grid_local_discretization cl;
+    python::class_<cl>("GridLocalDiscretization")
+      .DEF_RW_MEMBER(monomials)
+      .DEF_BYVAL_RW_MEMBER(vandermonde)
+      .DEF_RW_MEMBER(mode_degrees)
+      .DEF_BYVAL_RW_MEMBER(filter_matrix)
+      ;
+  }
+
+  expose_std_vector<grid_local_discretization>("GridLocalDiscretization");
+
+  {
+    typedef element_preparation_info cl;
+    python::class_<cl>("ElementPreparationInfo")
+      .DEF_RO_MEMBER(original_point_count)
+      .DEF_RO_MEMBER(mode_count)
+      .DEF_RO_MEMBER(condition)
+      .DEF_RO_MEMBER(pinv_residual)
+      .DEF_RO_MEMBER(regularized)
+      ;
+  }
+
+  expose_std_vector<element_preparation_info>("ElementPreparationInfo");
+
   python::def("get_shape_function_name", &used_shape_function::name);
 
   {
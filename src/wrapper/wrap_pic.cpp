@@ -20,6 +20,7 @@
 
 #include <boost/python.hpp>
 #include "particle_state.hpp"
+#include "push_boris.hpp"
 #include "wrap_pic.hpp"
 #include "diagnostics.hpp"
 
@@ -71,6 +72,8 @@ namespace
     def("get_velocities", get_velocities<cl>);
     def("find_new_containing_element", find_new_containing_element<cl>);
     def("update_containing_elements", update_containing_elements<cl>);
+    def("boris_push", boris_push<cl>);
+    def("boris_momentum_push", boris_momentum_push<cl>);
 
     def("kill_particle", kill_particle<cl>);
     def("move_particle", move_particle<cl>);
@@ -53,6 +53,13 @@ namespace
               "particle_state", "pusher_state", 
               "depositor", "depositor_state",
               "velocities", "vis_listener"))
+        .def("particle_fields", &cl::template particle_fields<
+            py_vector, py_vector, py_vector,
+            py_vector, py_vector, py_vector, Depositor>,
+            args("ex","ey", "ez", "bx", "by", "bz", 
+              "particle_state", "pusher_state", 
+              "depositor", "depositor_state",
+              "velocities", "e", "b"))
         ;
     }
     else if (particle_state::m_vdim == 2)
@@ -74,6 +81,13 @@ namespace
               "particle_state", "pusher_state", 
               "depositor", "depositor_state",
               "velocities", "vis_listener"))
+        .def("particle_fields", &cl::template particle_fields<
+            py_vector, py_vector, zero_vector,
+            zero_vector, zero_vector, py_vector, Depositor>,
+            args("ex","ey", "ez", "bx", "by", "bz", 
+              "particle_state", "pusher_state", 
+              "depositor", "depositor_state",
+              "velocities", "e", "b"))
         ;
     }
   }
@@ -93,6 +107,7 @@ namespace
       wrp
         .DEF_RW_MEMBER(local_discretizations)
         .DEF_RW_MEMBER(ldis_indices)
+        .DEF_RW_MEMBER(element_batched)
         ;
 
       if (ParticleState::m_vdim == 3)
@@ -102,6 +117,10 @@ namespace
               py_vector, py_vector, py_vector,
               py_vector, py_vector, py_vector>,
               args("ex","ey", "ez", "bx", "by", "bz", "ps", "velocities", "vis_listener"))
+          .def("particle_fields", &cl::template particle_fields<
+              py_vector, py_vector, py_vector,
+              py_vector, py_vector, py_vector>,
+              args("ex","ey", "ez", "bx", "by", "bz", "ps", "e", "b"))
           ;
       }
       else if (ParticleState::m_vdim == 2)
@@ -117,6 +136,10 @@ namespace
               py_vector, py_vector, zero_vector,
               zero_vector, zero_vector, py_vector>,
               args("ex","ey", "ez", "bx", "by", "bz", "ps", "velocities", "vis_listener"))
+          .def("particle_fields", &cl::template particle_fields<
+              py_vector, py_vector, zero_vector,
+              zero_vector, zero_vector, py_vector>,
+              args("ex","ey", "ez", "bx", "by", "bz", "ps", "e", "b"))
           ;
       }
     }
@@ -165,8 +188,7 @@ void expose_pusher()
     typedef local_monomial_discretization cl;
     class_<cl>("LocalMonomialDiscretization")
       .DEF_RW_MEMBER(basis)
-      .DEF_BYVAL_RW_MEMBER(lu_vandermonde_t)
-      .DEF_BYVAL_RW_MEMBER(lu_piv_vandermonde_t)
+      .DEF_BYVAL_RW_MEMBER(inverse_vandermonde_t)
       ;
   }
 
@@ -422,6 +422,791 @@ def test_shape_functions():
 
 
 
+def test_boris_vay_push():
+    from pyrticle.units import SIUnitsWithNaturalConstants
+    units = SIUnitsWithNaturalConstants()
+    c = units.VACUUM_LIGHT_SPEED()
+
+    from hedge.mesh import make_box_mesh
+    from hedge.backends import guess_run_context
+    rcon = guess_run_context([])
+    discr = rcon.make_discretization(
+            make_box_mesh((-1,-1,-1), (1,1,1), max_volume=0.1),
+            order=1)
+
+    from pyrticle.cloud import PicMethod
+    from pyrticle.deposition.shape import ShapeFunctionDepositor
+    from pyrticle.pusher import MonomialParticlePusher
+    method = PicMethod(discr, units,
+            ShapeFunctionDepositor(),
+            MonomialParticlePusher(),
+            3, 3)
+
+    from pyrticle._internal import \
+            FindEventCounters, boris_push, boris_momentum_push
+
+    def push(x, u, e, b, dt, steps, use_vay):
+        """Push an electron starting at C{x} with normalized momentum
+        C{u} through constant fields C{e} and C{b}. Return its positions
+        after each step and its final normalized momentum.
+        """
+        state = method.make_state()
+        gamma = (1+numpy.dot(u, u)/c**2)**0.5
+        method.add_particles(state,
+                [(x, u/gamma, -units.EL_CHARGE, units.EL_MASS)], 1)
+
+        e = numpy.array(e, dtype=numpy.float64)
+        b = numpy.array(b, dtype=numpy.float64)
+
+        positions = [state.positions[0].copy()]
+        for step in xrange(steps):
+            boris_push(method.mesh_data, state.particle_state,
+                    e, b, dt, c, use_vay,
+                    method._make_boundary_hit_listener(state),
+                    FindEventCounters())
+            assert len(state) == 1
+            positions.append(state.positions[0].copy())
+
+        return numpy.array(positions), state.momenta[0]/units.EL_MASS
+
+    from math import pi, sqrt
+    bz = 1e-2
+
+    for use_vay in [False, True]:
+        # gyration in a pure magnetic field
+        gamma = 1/sqrt(1-0.5**2)
+        u_perp = gamma*0.5*c
+        omega = units.EL_CHARGE*bz/(gamma*units.EL_MASS)
+        radius = u_perp/(gamma*omega)
+
+        steps = 200
+        positions, u = push(numpy.zeros(3), numpy.array([0, u_perp, 0]),
+                [0, 0, 0], [0, 0, bz], 2*pi/omega/steps, steps, use_vay)
+
+        assert la.norm(positions[-1]-positions[0]) < 2e-3*radius
+        assert abs(la.norm(u)-u_perp) < 1e-12*u_perp
+        diameter = positions[:,0].max()-positions[:,0].min()
+        assert abs(diameter-2*radius) < 1e-4*radius
+
+        # the momentum-only half step is reversible
+        state = method.make_state()
+        method.add_particles(state,
+                [(numpy.zeros(3), numpy.array([0, 0.5*c, 0]),
+                    -units.EL_CHARGE, units.EL_MASS)], 1)
+        u_start = state.momenta[0].copy()
+        e = numpy.zeros(3)
+        b = numpy.array([0, 0, bz])
+        dt = 2*pi/omega/steps
+        boris_momentum_push(state.particle_state, e, b, -dt/2, c, use_vay)
+        assert la.norm(state.momenta[0]-u_start) > 1e-3*la.norm(u_start)
+        boris_momentum_push(state.particle_state, e, b, dt/2, c, use_vay)
+        assert la.norm(state.momenta[0]-u_start) < 1e-12*la.norm(u_start)
+
+        # E x B drift, for a particle started at the drift velocity.
+        # Only the Vay scheme gets it exactly, at any gamma.
+        if use_vay:
+            drift_betas = [0.3, 0.99]
+            tolerance = 1e-10
+        else:
+            drift_betas = [0.3]
+            tolerance = 1e-3
+
+        for drift_beta in drift_betas:
+            v_drift = drift_beta*c
+            gamma = 1/sqrt(1-drift_beta**2)
+            omega = units.EL_CHARGE*bz/(gamma*units.EL_MASS)
+            dt = 2*pi/omega/100
+            steps = int(0.4/(v_drift*dt))
+
+            positions, u = push(numpy.array([-0.5, 0, 0]),
+                    numpy.array([gamma*v_drift, 0, 0]),
+                    [0, v_drift*bz, 0], [0, 0, bz], dt, steps, use_vay)
+
+            drift_distance = v_drift*steps*dt
+            assert abs(positions[-1,0]-positions[0,0]-drift_distance) \
+                    < tolerance*drift_distance
+            assert abs(positions[:,1]).max() < tolerance*drift_distance
+
+
+
+
+def test_monomial_pusher_element_batched():
+    from pyrticle.units import SIUnitsWithNaturalConstants
+    units = SIUnitsWithNaturalConstants()
+    c = units.VACUUM_LIGHT_SPEED()
+
+    from hedge.mesh import make_box_mesh
+    from hedge.backends import guess_run_context
+    rcon = guess_run_context([])
+    discr = rcon.make_discretization(
+            make_box_mesh((-1,-1,-1), (1,1,1), max_volume=0.1),
+            order=3)
+
+    from hedge.models.em import MaxwellOperator
+    max_op = MaxwellOperator(
+            epsilon=units.EPSILON0,
+            mu=units.MU0,
+            flux_type=1)
+    dt = max_op.estimate_timestep(discr)
+
+    # spatially varying fields, so that the gathers matter
+    from hedge.tools import make_obj_array
+    x, y, z = [discr.nodes[:,axis].copy() for axis in range(3)]
+    fields = max_op.assemble_eh(
+            e=make_obj_array([1e4*y, 1e4*x*z, 1e3*(1+x)]),
+            h=make_obj_array([1e2*z, 0*x, 1e2*(1-y**2)]),
+            discr=discr)
+
+    from pyrticle.cloud import PicMethod
+    from pyrticle.deposition.shape import ShapeFunctionDepositor
+    from pyrticle.pusher import MonomialParticlePusher
+
+    results = []
+    for element_batched in [False, True]:
+        method = PicMethod(discr, units,
+                ShapeFunctionDepositor(),
+                MonomialParticlePusher(element_batched=element_batched),
+                3, 3)
+
+        # several particles per element
+        state = method.make_state()
+        method.add_particles(state,
+                [(numpy.array([s, 0.5*s, -0.3*s]),
+                    numpy.array([0.1*c, -0.05*c, 0.02*c]),
+                    -units.EL_CHARGE, units.EL_MASS)
+                    for s in numpy.linspace(-0.8, 0.8, 40)],
+                40)
+
+        for step in range(5):
+            method.boris_push(state, max_op, fields, dt)
+
+        results.append((state.positions.copy(), state.momenta.copy()))
+
+    (x_chunked, p_chunked), (x_batched, p_batched) = results
+    assert_close(x_batched, x_chunked)
+    assert_close(p_batched, p_chunked)
+
+
+
+
+def test_leapfrog_cycling():
+    from pyrticle.units import SIUnitsWithNaturalConstants
+    units = SIUnitsWithNaturalConstants()
+    c = units.VACUUM_LIGHT_SPEED()
+
+    from hedge.mesh import make_box_mesh
+    from hedge.backends import guess_run_context
+    rcon = guess_run_context([])
+    discr = rcon.make_discretization(
+            make_box_mesh((-1,-1,-1), (1,1,1), max_volume=0.1),
+            order=2)
+
+    from pyrticle.cloud import PicMethod
+    from pyrticle.deposition.shape import ShapeFunctionDepositor
+    from pyrticle.pusher import MonomialParticlePusher
+    method = PicMethod(discr, units,
+            ShapeFunctionDepositor(),
+            MonomialParticlePusher(),
+            3, 3)
+
+    from hedge.models.em import MaxwellOperator
+    max_op = MaxwellOperator(
+            epsilon=units.EPSILON0,
+            mu=units.MU0,
+            flux_type=1)
+
+    from pyrticle.cloud import FieldRhsCalculator, LeapfrogAdvancer, \
+            TimesteppablePicState
+    from hedge.timestep.runge_kutta import LSRK4TimeStepper
+    from hedge.tools import make_obj_array
+    from pyrticle.tools import PolynomialShapeFunction
+
+    f_rhs_calculator = FieldRhsCalculator(method, max_op)
+    stepper = LSRK4TimeStepper()
+    dt = max_op.estimate_timestep(discr)
+
+    def make_state():
+        state = method.make_state()
+        method.add_particles(state,
+                [(numpy.array([x, 0.1, -0.2]), 
+                    numpy.array([0.1*c, 0.05*c, 0]),
+                    -units.EL_CHARGE, units.EL_MASS)
+                    for x in [-0.3, 0, 0.3]],
+                3)
+        method.depositor.set_shape_function(state,
+                PolynomialShapeFunction(0.5, 3, 2))
+        return state
+
+    # a uniform initial field, so that the particles feel the time
+    # interpolation of the fields
+    zeros = discr.volume_zeros()
+    fields = max_op.assemble_eh(
+            e=make_obj_array([zeros+1e4, zeros, zeros]),
+            h=make_obj_array([zeros, zeros, zeros+1e2]),
+            discr=discr)
+
+    def field_step(state, j):
+        def rhs(t, flds):
+            return (f_rhs_calculator(t, lambda: flds, lambda: state)
+                    + max_op.assemble_fields(e=-1/max_op.epsilon*j))
+        return stepper(fields, 0, dt, rhs)
+
+    def push(state, flds, push_dt, first):
+        if first:
+            method.boris_push(state, max_op, flds, -push_dt/2, 
+                    momenta_only=True)
+        method.boris_push(state, max_op, flds, push_dt)
+
+    def advance(state, **kwargs):
+        advancer = LeapfrogAdvancer(method, max_op, LSRK4TimeStepper(),
+                f_rhs_calculator, dt, **kwargs)
+        new_fields, ts_state = advancer(
+                make_obj_array([fields, TimesteppablePicState(method, state)]),
+                0)
+        return advancer, new_fields
+
+    def assert_same_particles(state_a, state_b):
+        assert_close(state_a.positions, state_b.positions)
+        assert_close(state_a.momenta, state_b.momenta)
+
+    # a substep ratio of one is the plain leapfrog
+    state, ref_state = make_state(), make_state()
+    advancer, new_fields = advance(state, subcycles=1)
+
+    ref_fields = field_step(ref_state, method.deposit_j(ref_state))
+    push(ref_state, fields, dt, first=True)
+
+    assert_close(new_fields, ref_fields)
+    assert_same_particles(state, ref_state)
+    assert_close(advancer.j, method.deposit_j(ref_state))
+
+    # subcycling pushes through time-interpolated fields and averages J
+    state, ref_state = make_state(), make_state()
+    advancer, new_fields = advance(state, subcycles=2)
+
+    ref_fields = field_step(ref_state, method.deposit_j(ref_state))
+    push(ref_state, fields, dt/2, first=True)
+    j_1 = method.deposit_j(ref_state)
+    push(ref_state, (fields+ref_fields)/2, dt/2, first=False)
+    j_2 = method.deposit_j(ref_state)
+
+    assert_close(new_fields, ref_fields)
+    assert_same_particles(state, ref_state)
+    assert_close(advancer.j, (j_1+j_2)/2)
+
+    # supercycling takes one long step and averages J across it
+    state, ref_state = make_state(), make_state()
+    advancer, new_fields = advance(state, supercycles=3)
+
+    j_before = method.deposit_j(ref_state)
+    push(ref_state, fields, 3*dt, first=True)
+    j_avg = (j_before + method.deposit_j(ref_state))/2
+
+    assert_same_particles(state, ref_state)
+    assert_close(advancer.j, j_avg)
+    assert_close(new_fields, field_step(ref_state, j_avg))
+
+
+
+
+def make_2d_pic(depositor, positions, velocity=(0, 0), periodicity=None,
+        debug=set()):
+    """Return a tuple C{(method, state)} with one unit-charge particle at
+    each of C{positions}, all moving at C{velocity} on a 2D mesh with
+    the given C{periodicity} and deposited by C{depositor}.
+    """
+    from pyrticle.units import SIUnitsWithNaturalConstants
+    units = SIUnitsWithNaturalConstants()
+
+    from hedge.mesh import make_rect_mesh
+    from hedge.backends import guess_run_context
+    rcon = guess_run_context([])
+    discr = rcon.make_discretization(
+            make_rect_mesh((-1,-1), (1,1), max_area=0.01,
+                periodicity=periodicity),
+            order=3)
+
+    from pyrticle.cloud import PicMethod
+    from pyrticle.pusher import MonomialParticlePusher
+    method = PicMethod(discr, units, depositor,
+            MonomialParticlePusher(),
+            2, 2, debug=debug)
+
+    state = method.make_state()
+    method.add_particles(state,
+            [(numpy.array(pos, dtype=numpy.float64),
+                numpy.array(velocity, dtype=numpy.float64),
+                1, units.EL_MASS)
+                for pos in positions],
+            len(positions))
+
+    from pyrticle.tools import PolynomialShapeFunction
+    method.depositor.set_shape_function(state,
+            PolynomialShapeFunction(0.3, 2, 2))
+
+    return method, state
+
+
+
+
+def make_advective_pic(positions, velocity=(0, 0), **depositor_kwargs):
+    """Like L{make_2d_pic}, with an L{AdvectiveDepositor} made from 
+    C{depositor_kwargs}.
+    """
+    from pyrticle.deposition.advective import AdvectiveDepositor
+    return make_2d_pic(AdvectiveDepositor(**depositor_kwargs),
+            positions, velocity)
+
+
+
+
+def deposit_2d(depositor, positions=None, velocity=(1e6, -2e6)):
+    """Return a tuple C{(method, state, rho, j)} for the particles
+    of L{make_2d_pic}, by default a spread-out beam.
+    """
+    if positions is None:
+        positions = [(x, y) 
+                for x in numpy.linspace(-0.7, 0.6, 4)
+                for y in numpy.linspace(-0.5, 0.8, 3)]
+
+    method, state = make_2d_pic(depositor, positions, velocity)
+    return method, state, method.deposit_rho(state), method.deposit_j(state)
+
+
+
+
+def assert_close(a, b, rel_tol=1e-12):
+    def flat(x):
+        x = numpy.asarray(x)
+        if x.dtype == object:
+            # field object arrays
+            return numpy.hstack([flat(x_i) for x_i in x])
+        else:
+            return numpy.ravel(x)
+
+    assert la.norm(flat(a) - flat(b)) <= rel_tol*la.norm(flat(b))
+
+
+
+
+def test_advective_upkeep_and_move():
+    # element charges are always below twice the particle charge, so
+    # upkeep has to retire every single element
+    method, state = make_advective_pic([(0, 0)], kill_threshold=2)
+    assert state.depositor_state.active_elements > 1
+    method.upkeep(state)
+    assert state.depositor_state.active_elements == 0
+
+    # moved particles keep their elements
+    method, state = make_advective_pic([(-0.5, 0), (0, 0.1), (0.5, 0.3)])
+    backend = method.depositor.backend
+    ds = state.depositor_state
+    discr = method.discretization
+
+    def deposited_charge(pn):
+        return discr.integral(
+                method.depositor._deposit_rho(state, slice(pn, pn+1)))
+
+    backend.note_change_size(ds, 2)
+    first_two_elements = ds.active_elements
+    charge_1 = deposited_charge(1)
+    assert abs(charge_1-1) < 1e-10
+
+    backend.note_move(ds, 1, 0, 1)
+    moved_elements = ds.active_elements
+    assert 0 < moved_elements < first_two_elements
+
+    backend.note_change_size(ds, 1)
+    assert ds.active_elements == moved_elements
+    assert abs(deposited_charge(0)-charge_1) < 1e-10
+
+
+
+
+def test_advective_thread_count():
+    from pyrticle.deposition.advective import AdvectiveDepositor
+    from py.test import raises
+    raises(ValueError, AdvectiveDepositor, thread_count=0)
+
+    dt = 1e-9
+
+    results = []
+    for thread_count in [1, 4]:
+        method, state = make_advective_pic([(-0.2, 0.1)],
+                velocity=(1e7, 0), thread_count=thread_count)
+
+        for step in range(5):
+            rhs = method.depositor.rhs(state)
+            state = method.advance_state(state,
+                    method.velocities(state)*dt, 0, rhs*dt)
+            method.upkeep(state)
+
+        results.append((
+            method.discretization.integral(method.deposit_rho(state)),
+            state.depositor_state.active_elements))
+
+    (charge_1, elements_1), (charge_4, elements_4) = results
+    assert abs(charge_1-1) < 1e-2
+    assert abs(charge_4-charge_1) < 1e-12
+    assert elements_4 == elements_1
+
+
+
+
+def test_advective_local_div():
+    for thread_count in [1, 4]:
+        method, state = make_advective_pic([(-0.3, 0.1), (0.2, -0.4)],
+                velocity=(1e7, -5e6), thread_count=thread_count)
+        discr = method.discretization
+        velocities = method.velocities(state)
+
+        local_div = method.depositor.backend.get_debug_quantity_on_mesh(
+                state.depositor_state, state.particle_state,
+                "local_div", velocities)
+
+        # -v . grad rho, one local axis at a time
+        v = numpy.reshape(velocities, (len(state), 2))[0]
+        rho = method.deposit_rho(state)
+        local_div_ref = discr.volume_zeros()
+        for eg in discr.element_groups:
+            diff_mats = eg.local_discretization.differentiation_matrices()
+            for el in eg.members:
+                el_range = discr.find_el_range(el.id)
+                coefficients = -numpy.dot(el.inverse_map.matrix, v)
+                for loc_axis, diff_mat in enumerate(diff_mats):
+                    local_div_ref[el_range] += coefficients[loc_axis] \
+                            * numpy.dot(diff_mat, rho[el_range])
+
+        assert la.norm(local_div_ref) > 0
+        assert_close(local_div, local_div_ref, 1e-10)
+
+
+
+
+def test_grid_pointwise_preparation():
+    """Check the natively prepared simplex_extra elements against the 
+    pointwise projection that used to be done in Python.
+    """
+    from pyrticle.deposition.grid import GridDepositor
+    from pyrticle.deposition.grid_base import SingleBrickGenerator
+
+    # coarse enough that most elements need extra points, and with the
+    # preparation's debug visualization (written to a scratch directory)
+    from tempfile import mkdtemp
+    from shutil import rmtree
+    import os
+    vis_dir = mkdtemp()
+    prev_dir = os.getcwd()
+    os.chdir(vis_dir)
+    try:
+        method, state = make_2d_pic(
+                GridDepositor(
+                    brick_generator=SingleBrickGenerator(overresolve=0.5),
+                    submethod="simplex_extra"),
+                [(0, 0)], debug=set(["depositor", "vis_files"]))
+        assert [name for name in os.listdir(vis_dir) 
+                if name.startswith("rec-debug")]
+    finally:
+        os.chdir(prev_dir)
+        rmtree(vis_dir)
+
+    depositor = method.depositor
+    backend = depositor.backend
+    discr = method.discretization
+    dims = discr.dimensions
+
+    assert len(backend.extra_points)
+    extra_points = numpy.reshape(backend.extra_points, (-1, dims))
+
+    from hedge.polynomial import generic_vandermonde
+    from pyrticle._internal import ElementOnGrid
+
+    for eg in discr.element_groups:
+        ldis = eg.local_discretization
+
+        for el in eg.members:
+            eog = backend.elements_on_grid[el.id]
+            assert eog.element_number == el.id
+
+            # structured points, as found by the old code
+            ref_eog = ElementOnGrid()
+            ref_eog.element_number = el.id
+            points = list(backend.find_points_in_element(ref_eog,
+                depositor.el_tolerance * la.norm(el.map.matrix, 2)))
+
+            grid_nodes = list(eog.grid_nodes)
+            struct_count = len(ref_eog.grid_nodes)
+            assert grid_nodes[:struct_count] == list(ref_eog.grid_nodes)
+            assert la.norm(eog.weight_factors[:struct_count]
+                    - ref_eog.weight_factors) < 1e-12
+
+            # extra points sit on element nodes and carry unit weight
+            el_nodes = discr.nodes[discr.find_el_range(el.id)]
+            for gn in grid_nodes[struct_count:]:
+                assert gn >= backend.first_extra_point
+                pt = extra_points[gn - backend.first_extra_point]
+                points.append(pt)
+                assert min(la.norm(node - pt) for node in el_nodes) < 1e-12
+            assert (eog.weight_factors[struct_count:] == 1).all()
+
+            if struct_count < ldis.node_count():
+                assert len(grid_nodes) >= ldis.node_count()
+
+            # the least-squares interpolation matrix
+            scaled_vdm = generic_vandermonde(
+                    [el.inverse_map(x) for x in points],
+                    ldis.basis_functions())
+            for i, weight in enumerate(eog.weight_factors):
+                scaled_vdm[i] *= weight
+
+            ref_imat = numpy.dot(ldis.vandermonde(), la.pinv(scaled_vdm))
+            assert la.norm(eog.interpolation_matrix - ref_imat) \
+                    < 1e-8*la.norm(ref_imat)
+
+
+
+
+def test_grid_fft_convolution():
+    from pyrticle.deposition.grid import GridDepositor
+    from pyrticle.deposition.grid_base import SingleBrickGenerator
+
+    # the second particle's shape reaches across the periodic boundary
+    for periodicity, positions in [
+            (None, [(0.1, -0.2)]),
+            ((True, False), [(0.1, -0.2), (0.9, 0.1)]),
+            ]:
+        rhos = []
+        for fft_convolution in [False, True]:
+            method, state = make_2d_pic(
+                    GridDepositor(
+                        brick_generator=SingleBrickGenerator(),
+                        fft_convolution=fft_convolution),
+                    positions, periodicity=periodicity)
+            rhos.append(method.deposit_rho(state))
+
+        discr = method.discretization
+        rho_direct, rho_fft = rhos
+
+        # cloud-in-cell accuracy
+        assert la.norm(rho_fft - rho_direct) < 3e-2*la.norm(rho_direct)
+
+        # charge conservation, including periodic images
+        for rho in rhos:
+            assert abs(discr.integral(rho) - len(positions)) \
+                    < 2e-2*len(positions)
+
+
+
+
+def test_grid_cache_with_adaptive_bricks():
+    from pyrticle.deposition.grid import GridDepositor
+    from pyrticle.deposition.grid_base import ParticleAdaptiveBrickGenerator
+
+    from tempfile import mkdtemp
+    from shutil import rmtree
+    import os
+    cache_dir = mkdtemp()
+
+    try:
+        rhos = []
+        for run in range(2):
+            method, state = make_2d_pic(
+                    GridDepositor(
+                        brick_generator=ParticleAdaptiveBrickGenerator(
+                            rebrick_interval=1),
+                        cache_dir=cache_dir),
+                    [(0.1, 0.2), (0.15, 0.25)])
+
+            # the first upkeep rebricks, which for the second run 
+            # re-prepares elements whose preparation came from the cache
+            method.upkeep(state)
+            assert len(method.depositor.backend.bricks) > 1
+            rhos.append(method.deposit_rho(state))
+
+        assert len(os.listdir(cache_dir)) == 1
+        assert la.norm(rhos[1]-rhos[0]) < 1e-10*la.norm(rhos[0])
+    finally:
+        rmtree(cache_dir)
+
+
+
+def test_grid_brick_submethod_threads():
+    from pyrticle.deposition.grid import GridDepositor
+    from pyrticle.deposition.grid_base import FineCoreBrickGenerator
+
+    # elements spanning both bricks get one element_on_grid per brick, 
+    # all of which add onto that element's nodes in the remap
+    results = [deposit_2d(GridDepositor(
+        brick_generator=FineCoreBrickGenerator(core_axis=0),
+        submethod="brick", thread_count=thread_count))
+        for thread_count in [1, 4]]
+
+    method = results[0][0]
+    assert len(method.depositor.backend.bricks) > 1
+    assert len(method.depositor.backend.elements_on_grid) \
+            > len(method.discretization.mesh.elements)
+
+    (_, _, rho_1, j_1), (_, _, rho_4, j_4) = results
+    assert_close(rho_4, rho_1)
+    assert_close(j_4, j_1)
+
+
+
+def test_grid_deposition_threads():
+    from pyrticle.deposition.grid import GridDepositor
+    from pyrticle.deposition.grid_find import GridFindDepositor
+
+    # multi-threaded deposition goes through per-slab tile buffers,
+    # their halos and overflow lists
+    for depositor_class in [GridDepositor, GridFindDepositor]:
+        (_, _, rho_1, j_1), (_, _, rho_4, j_4) = [
+                deposit_2d(depositor_class(thread_count=thread_count))
+                for thread_count in [1, 4]]
+
+        assert la.norm(rho_1) > 0
+        assert_close(rho_4, rho_1)
+        assert_close(j_4, j_1)
+
+
+
+def test_grid_tile_sparse_deposition():
+    from pyrticle.deposition.grid import GridDepositor
+
+    method, state = make_2d_pic(GridDepositor(),
+            [(-0.6, -0.5), (-0.5, -0.6)], velocity=(1e6, -2e6))
+    depositor = method.depositor
+    units = method.units
+
+    def check(state):
+        velocities = method.velocities(state)
+        whole = slice(None)
+
+        assert la.norm(depositor._deposit_rho(state, whole)) > 0
+        assert_close(depositor._deposit_rho(state, whole),
+                depositor.remap_grid_to_mesh(
+                    depositor.deposit_grid_rho(state)))
+        assert_close(depositor._deposit_j(state, velocities, whole),
+                depositor.remap_grid_to_mesh(
+                    depositor.deposit_grid_j(state, velocities)))
+
+        rho, j = depositor._deposit_densities(state, velocities, whole)
+        assert_close(rho, depositor.remap_grid_to_mesh(
+            depositor.deposit_grid_rho(state)))
+        assert_close(j, depositor.remap_grid_to_mesh(
+            depositor.deposit_grid_j(state, velocities)))
+
+    check(state)
+
+    # move the beam to the other corner, so that the backend's grid
+    # storage has to forget the tiles touched the first time
+    moved_state = method.make_state()
+    method.add_particles(moved_state,
+            [(numpy.array(pos, dtype=numpy.float64),
+                numpy.array([1e6, -2e6], dtype=numpy.float64),
+                1, units.EL_MASS)
+                for pos in [(0.6, 0.5), (0.5, 0.6)]],
+            2)
+    depositor.set_shape_function(moved_state, depositor.shape_function)
+    check(moved_state)
+
+
+
+def test_grid_sparse_remap():
+    from pyrticle.deposition.grid import GridDepositor
+
+    for enforce_continuity in [False, True]:
+        results = []
+        for sparse_remap in [False, True]:
+            method, state, rho, j = deposit_2d(GridDepositor(
+                enforce_continuity=enforce_continuity,
+                sparse_remap=sparse_remap))
+
+            depositor = method.depositor
+            residual = depositor.remap_residual(
+                    depositor.deposit_grid_rho(state))
+            results.append((rho, j, residual))
+
+        (rho_el, j_el, residual_el), (rho_sp, j_sp, residual_sp) = results
+        assert_close(rho_sp, rho_el, 1e-10)
+        assert_close(j_sp, j_el, 1e-10)
+        assert_close(residual_sp, residual_el, 1e-10)
+
+
+
+def test_grid_find_node_binning():
+    from pyrticle.deposition.grid_find import GridFindDepositor
+    from pyrticle.deposition.grid_base import FineCoreBrickGenerator
+    from pyrticle._internal import BoxFloat
+
+    for brick_generator in [None,
+            FineCoreBrickGenerator(overresolve=0.2, mesh_margin=2e-3)]:
+        method, state = make_2d_pic(
+                GridFindDepositor(brick_generator=brick_generator),
+                [(0, 0)])
+        backend = method.depositor.backend
+        discr = method.discretization
+
+        # the binning formerly done in Python
+        grid_node_num_to_nodes = {}
+        for eg in discr.element_groups:
+            for el in eg.members:
+                el_bbox = BoxFloat(*el.bounding_box(discr.mesh.points))
+                el_slice = discr.find_el_range(el.id)
+
+                for brk in backend.bricks:
+                    if brk.bounding_box().intersect(el_bbox).is_empty():
+                        continue
+
+                    for node_num in range(el_slice.start, el_slice.stop):
+                        try:
+                            cell_number = brk.which_cell(
+                                        discr.nodes[node_num])
+                        except ValueError:
+                            pass
+                        else:
+                            grid_node_num_to_nodes.setdefault(
+                                    brk.index(cell_number), []).append(node_num)
+
+        starts = list(backend.node_number_list_starts)
+        lists = list(backend.node_number_lists)
+        assert len(starts) == backend.grid_node_count() + 1
+
+        for gnn in xrange(backend.grid_node_count()):
+            assert lists[starts[gnn]:starts[gnn+1]] \
+                    == sorted(grid_node_num_to_nodes.get(gnn, []))
+
+
+
+def test_grid_find_cell_runs():
+    from pyrticle.deposition.grid_find import GridFindDepositor
+
+    for thread_count in [1, 4]:
+        method, state, rho, j = deposit_2d(
+                GridFindDepositor(thread_count=thread_count))
+
+        # evaluate the shape function node by node and particle by particle
+        discr = method.discretization
+        sf = method.depositor.shape_function
+        velocities = numpy.reshape(method.velocities(state), (len(state), 2))
+
+        rho_ref = numpy.zeros(len(discr))
+        j_ref = numpy.zeros((len(discr), 2))
+        for pn in xrange(len(state)):
+            center = state.positions[pn]
+            for node_num, node in enumerate(discr.nodes):
+                q_shapeval = state.charges[pn]*sf(
+                        numpy.asarray(node - center, dtype=numpy.float64))
+                if q_shapeval:
+                    rho_ref[node_num] += q_shapeval
+                    j_ref[node_num] += q_shapeval*velocities[pn]
+
+        assert la.norm(rho_ref) > 0
+        assert_close(rho, rho_ref)
+        assert_close(j, j_ref)
+
+
+
+
 if __name__ == "__main__":
     import sys
     if len(sys.argv) > 1: